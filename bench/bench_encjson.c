@@ -0,0 +1,817 @@
+/* for clock_gettime(2) and getopt(3) */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <encjson.h>
+#include <fsdyn/float.h>
+#include <fsdyn/fsalloc.h>
+
+/* A microbenchmark driver for the encoding and decoding hot paths.
+ *
+ *   bench_encjson [ -t seconds ] [ -j ] [ -c baseline [ -p percent ] ]
+ *                 [ file ... ]
+ *
+ * Each benchmark is run over each document of the corpus: a built-in
+ * set of synthetic documents modeled after the usual JSON benchmark
+ * files plus the given files (say, twitter.json, canada.json and
+ * citm_catalog.json). A benchmark is repeated until it has taken at
+ * least the given time (0.3 seconds by default), and the best of
+ * three rounds is reported.
+ *
+ * The float formatting benchmarks compare binary64_format(), which
+ * encode_float() uses, with a shortest round-trip formatter built on
+ * printf(3). Before they are timed, both are checked to round-trip
+ * every sample and their outputs are compared.
+ *
+ * With -j, the results are printed as a JSON array, which can later be
+ * given as a baseline with -c. Then, each result is compared with the
+ * baseline, and the exit status is 1 if any throughput has dropped by
+ * more than the given percentage (10 by default). */
+
+enum {
+    ROUNDS = 3,
+    SMALL_OBJECT_SIZE = 16,  /* below JIT_SIZE_LIMIT */
+    LARGE_OBJECT_SIZE = 1000,
+    LOOKUP_ARRAY_SIZE = 10000,
+    DEEP_NESTING = 150,      /* below JSON_DEFAULT_MAX_DEPTH */
+    FLOAT_SAMPLES = 10000,
+    FORMAT_SPACE = BINARY64_MAX_FORMAT_SPACE + 32 /* enough for %.17g */
+};
+
+typedef struct {
+    char *name;
+    char *encoding;
+    size_t size;
+    json_thing_t *thing, *copy;
+    char *buffer; /* room for the compact and pretty encodings */
+    size_t buffer_size;
+} document_t;
+
+typedef struct {
+    json_thing_t *container;
+    char **names; /* NULL for an array */
+    size_t count;
+} lookup_t;
+
+typedef size_t (*formatter_t)(double value, char *buf);
+
+typedef struct {
+    formatter_t format;
+    const double *values;
+    size_t count;
+} formatting_t;
+
+typedef void (*operation_t)(void *arg);
+
+typedef struct {
+    const char *benchmark, *document;
+    double mb_per_s;     /* 0 if the benchmark processes no encoding */
+    double ops_per_s;    /* documents or lookups per second */
+    double allocs_per_op;
+} result_t;
+
+typedef struct {
+    result_t *results;
+    size_t count, capacity;
+    double min_time;
+} report_t;
+
+/* Allocations are counted through the fsalloc() reallocator hook. */
+static realloc_t next_reallocator;
+static unsigned long long allocations;
+
+static void *counting_reallocator(void *ptr, size_t size)
+{
+    if (!ptr && size)
+        allocations++;
+    return next_reallocator(ptr, size);
+}
+
+static uint64_t random_state = 88172645463325252ULL;
+
+/* xorshift64 */
+static uint64_t random_next(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static double random_double(double low, double high)
+{
+    return low + (high - low) * (random_next() >> 11) * 0x1p-53;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void add(json_thing_t *object, const char *field, json_thing_t *value)
+{
+    json_add_to_object(object, field, value);
+}
+
+static json_thing_t *make_pair(long long a, long long b)
+{
+    json_thing_t *pair = json_make_array();
+    json_add_to_array(pair, json_make_integer(a));
+    json_add_to_array(pair, json_make_integer(b));
+    return pair;
+}
+
+/* Status updates with plenty of short strings, some of them non-ASCII
+ * or escaped, like twitter.json. */
+static json_thing_t *make_twitter(void)
+{
+    json_thing_t *statuses = json_make_array();
+    unsigned i;
+    for (i = 0; i < 1000; i++) {
+        char text[200];
+        json_thing_t *status = json_make_object();
+        add(status, "created_at",
+            json_make_string("Sun Aug 31 00:29:15 +0000 2014"));
+        add(status, "id", json_make_unsigned(505874924095815681ULL + i));
+        sprintf(text, "%llu", 505874924095815681ULL + i);
+        add(status, "id_str", json_make_string(text));
+        sprintf(text,
+                "@aym0566x \n\n名前:前田あゆみ\n第一印象:なんか怖っ！\n"
+                "\"quoted\" #%u http://t.co/%08x",
+                i, (unsigned) random_next());
+        add(status, "text", json_make_string(text));
+        add(status, "source",
+            json_make_string("<a href=\"http://twitter.com/download/iphone\" "
+                             "rel=\"nofollow\">Twitter for iPhone</a>"));
+        add(status, "truncated", json_make_boolean(false));
+        add(status, "in_reply_to_status_id", json_make_null());
+        json_thing_t *user = json_make_object();
+        add(user, "id", json_make_unsigned(1186275104 + i));
+        sprintf(text, "user%u", i);
+        add(user, "screen_name", json_make_string(text));
+        add(user, "name", json_make_string("AYUMI"));
+        add(user, "location", json_make_string("東京"));
+        add(user, "description",
+            json_make_string("ONE PIECE愛しすぎて今では麦わらの一味の"
+                             "一員です。ONE PIECE好きな人ならフォロー"
+                             "してください"));
+        add(user, "url", json_make_null());
+        add(user, "followers_count", json_make_integer(random_next() % 5000));
+        add(user, "friends_count", json_make_integer(random_next() % 5000));
+        add(user, "verified", json_make_boolean(i % 7 == 0));
+        add(user, "profile_background_color", json_make_string("C0DEED"));
+        add(status, "user", user);
+        json_thing_t *entities = json_make_object();
+        json_thing_t *hashtags = json_make_array();
+        json_thing_t *hashtag = json_make_object();
+        sprintf(text, "tag%u", i % 50);
+        add(hashtag, "text", json_make_string(text));
+        add(hashtag, "indices", make_pair(10, 20));
+        json_add_to_array(hashtags, hashtag);
+        add(entities, "hashtags", hashtags);
+        add(entities, "urls", json_make_array());
+        add(status, "entities", entities);
+        add(status, "retweet_count", json_make_integer(i % 100));
+        add(status, "favorited", json_make_boolean(false));
+        add(status, "lang", json_make_string("ja"));
+        json_add_to_array(statuses, status);
+    }
+    json_thing_t *twitter = json_make_object();
+    add(twitter, "statuses", statuses);
+    json_thing_t *metadata = json_make_object();
+    add(metadata, "completed_in", json_make_float(0.087));
+    add(metadata, "count", json_make_integer(1000));
+    add(twitter, "search_metadata", metadata);
+    return twitter;
+}
+
+/* Polygons of coordinates with full-precision floats, like
+ * canada.json. */
+static json_thing_t *make_canada(void)
+{
+    json_thing_t *coordinates = json_make_array();
+    unsigned i, j;
+    for (i = 0; i < 480; i++) {
+        json_thing_t *ring = json_make_array();
+        for (j = 0; j < 100; j++) {
+            json_thing_t *point = json_make_array();
+            json_add_to_array(point,
+                              json_make_float(random_double(-141, -52)));
+            json_add_to_array(point, json_make_float(random_double(41, 83)));
+            json_add_to_array(ring, point);
+        }
+        json_add_to_array(coordinates, ring);
+    }
+    json_thing_t *geometry = json_make_object();
+    add(geometry, "type", json_make_string("Polygon"));
+    add(geometry, "coordinates", coordinates);
+    json_thing_t *feature = json_make_object();
+    add(feature, "type", json_make_string("Feature"));
+    json_thing_t *properties = json_make_object();
+    add(properties, "name", json_make_string("Canada"));
+    add(feature, "properties", properties);
+    add(feature, "geometry", geometry);
+    json_thing_t *features = json_make_array();
+    json_add_to_array(features, feature);
+    json_thing_t *canada = json_make_object();
+    add(canada, "type", json_make_string("FeatureCollection"));
+    add(canada, "features", features);
+    return canada;
+}
+
+/* Large objects keyed by numeric identifiers and many small integers,
+ * like citm_catalog.json. */
+static json_thing_t *make_citm(void)
+{
+    char name[40];
+    json_thing_t *area_names = json_make_object();
+    unsigned i, j;
+    for (i = 0; i < 200; i++) {
+        sprintf(name, "%u", 205705993 + i);
+        add(area_names, name, json_make_string("Arrière-scène central"));
+    }
+    json_thing_t *events = json_make_object();
+    for (i = 0; i < 180; i++) {
+        json_thing_t *event = json_make_object();
+        add(event, "description", json_make_null());
+        add(event, "id", json_make_integer(138586341 + i));
+        add(event, "logo",
+            i % 3 ? json_make_null()
+                  : json_make_string("/images/UE0AAAAACEKo6QAAAAZDSVRN"));
+        sprintf(name, "Concert %u", i);
+        add(event, "name", json_make_string(name));
+        json_thing_t *sub_topics = json_make_array();
+        for (j = 0; j < 4; j++)
+            json_add_to_array(sub_topics, json_make_integer(337184262 + j));
+        add(event, "subTopicIds", sub_topics);
+        add(event, "subjectCode", json_make_null());
+        json_thing_t *topics = json_make_array();
+        json_add_to_array(topics, json_make_integer(324846099));
+        json_add_to_array(topics, json_make_integer(107888604));
+        add(event, "topicIds", topics);
+        sprintf(name, "%u", 138586341 + i);
+        add(events, name, event);
+    }
+    json_thing_t *performances = json_make_array();
+    for (i = 0; i < 240; i++) {
+        json_thing_t *performance = json_make_object();
+        add(performance, "eventId", json_make_integer(138586341 + i % 180));
+        add(performance, "id", json_make_integer(339887544 + i));
+        json_thing_t *prices = json_make_array();
+        for (j = 0; j < 3; j++) {
+            json_thing_t *price = json_make_object();
+            add(price, "amount", json_make_integer(90250 - 10000 * j));
+            add(price, "audienceSubCategoryId", json_make_integer(337100890));
+            add(price, "seatCategoryId", json_make_integer(338937295 + j));
+            json_add_to_array(prices, price);
+        }
+        add(performance, "prices", prices);
+        json_thing_t *areas = json_make_array();
+        for (j = 0; j < 5; j++) {
+            json_thing_t *area = json_make_object();
+            add(area, "areaId", json_make_integer(205705999 + j));
+            add(area, "blockIds", json_make_array());
+            json_add_to_array(areas, area);
+        }
+        add(performance, "areas", areas);
+        add(performance, "start",
+            json_make_integer(1372701600000LL + 86400000LL * i));
+        add(performance, "venueCode", json_make_string("PLEYEL_PLEYEL"));
+        json_add_to_array(performances, performance);
+    }
+    json_thing_t *citm = json_make_object();
+    add(citm, "areaNames", area_names);
+    add(citm, "events", events);
+    add(citm, "performances", performances);
+    return citm;
+}
+
+/* A flat numeric array like a feature vector. */
+static json_thing_t *make_numbers(void)
+{
+    json_thing_t *numbers = json_make_array();
+    unsigned i;
+    for (i = 0; i < 50000; i++)
+        if (i % 4)
+            json_add_to_array(numbers, json_make_float(random_double(-1, 1)));
+        else
+            json_add_to_array(numbers,
+                              json_make_integer(random_next() % 1000000));
+    return numbers;
+}
+
+/* Chains of alternately nested arrays and objects. */
+static json_thing_t *make_deep(void)
+{
+    json_thing_t *chains = json_make_array();
+    unsigned i, j;
+    for (i = 0; i < 200; i++) {
+        json_thing_t *chain = json_make_integer(i);
+        for (j = 0; j < DEEP_NESTING; j++) {
+            json_thing_t *container;
+            if (j % 2) {
+                container = json_make_object();
+                add(container, "a", chain);
+            } else {
+                container = json_make_array();
+                json_add_to_array(container, chain);
+            }
+            chain = container;
+        }
+        json_add_to_array(chains, chain);
+    }
+    return chains;
+}
+
+/* Strings full of characters that must be escaped. */
+static json_thing_t *make_escapes(void)
+{
+    json_thing_t *strings = json_make_array();
+    unsigned i;
+    for (i = 0; i < 5000; i++) {
+        char s[100];
+        sprintf(s,
+                "line %u\n\t\"quoted\" back\\slash \x01\x1f control "
+                "é€𝄞 </script>\r\n",
+                i);
+        json_add_to_array(strings, json_make_string(s));
+    }
+    return strings;
+}
+
+/* Doubles of the kinds found in JSON documents: fractions,
+ * coordinates, whole numbers, short decimals and arbitrary finite bit
+ * patterns. */
+static double *make_float_samples(size_t count)
+{
+    double *values = fsalloc(count * sizeof values[0]);
+    size_t i;
+    for (i = 0; i < count; i++)
+        switch (i % 5) {
+            case 0:
+                values[i] = random_double(-1, 1);
+                break;
+            case 1:
+                values[i] = random_double(-180, 180);
+                break;
+            case 2:
+                values[i] = random_next() % 1000000;
+                break;
+            case 3:
+                values[i] = (double) (random_next() % 100000) / 100;
+                break;
+            default:
+                for (;;) {
+                    uint64_t bits = random_next();
+                    if ((bits >> 52 & 0x7ff) != 0x7ff) {
+                        memcpy(&values[i], &bits, sizeof bits);
+                        break;
+                    }
+                }
+        }
+    return values;
+}
+
+static size_t format_binary64(double value, char *buf)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    (void) binary64_format(bits, buf);
+    return strlen(buf);
+}
+
+/* The fewest significant digits that read back as the same double */
+static size_t format_printf_shortest(double value, char *buf)
+{
+    int precision;
+    for (precision = 1; precision < 17; precision++) {
+        snprintf(buf, FORMAT_SPACE, "%.*g", precision, value);
+        if (strtod(buf, NULL) == value)
+            return strlen(buf);
+    }
+    return snprintf(buf, FORMAT_SPACE, "%.17g", value);
+}
+
+static bool round_trips(const char *s, double value)
+{
+    double parsed = strtod(s, NULL);
+    return !memcmp(&parsed, &value, sizeof value);
+}
+
+/* Report the samples the formatters fail to round-trip or disagree
+ * on. Return false if either formatter fails. */
+static bool check_formatters(const double *values, size_t count)
+{
+    size_t failures = 0, differences = 0, i;
+    for (i = 0; i < count; i++) {
+        char a[FORMAT_SPACE], b[FORMAT_SPACE];
+        format_binary64(values[i], a);
+        format_printf_shortest(values[i], b);
+        if (!round_trips(a, values[i]) || !round_trips(b, values[i])) {
+            if (!failures++)
+                fprintf(stderr, "format_float: %s or %s does not round-trip\n",
+                        a, b);
+        } else if (strcmp(a, b) && !differences++)
+            fprintf(stderr, "format_float: first difference: %s vs %s\n", a,
+                    b);
+    }
+    fprintf(stderr,
+            "format_float: %zu samples, %zu round-trip failures, "
+            "%zu differences\n",
+            count, failures, differences);
+    return !failures;
+}
+
+static void prepare_document(document_t *doc)
+{
+    doc->thing = json_utf8_decode(doc->encoding, doc->size);
+    doc->copy = json_clone(doc->thing);
+    size_t compact = json_utf8_encode(doc->thing, NULL, 0);
+    size_t pretty = json_utf8_prettyprint(doc->thing, NULL, 0, 0, 2);
+    doc->buffer_size = (compact > pretty ? compact : pretty) + 1;
+    doc->buffer = fsalloc(doc->buffer_size);
+}
+
+static void make_document(document_t *doc, const char *name,
+                          json_thing_t *thing)
+{
+    doc->name = strcpy(fsalloc(strlen(name) + 1), name);
+    doc->encoding = json_utf8_encode_alloc(thing, &doc->size);
+    json_destroy_thing(thing);
+    prepare_document(doc);
+}
+
+static bool read_document(document_t *doc, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    size_t capacity = 1 << 16;
+    doc->encoding = fsalloc(capacity);
+    doc->size = 0;
+    size_t count;
+    while ((count = fread(doc->encoding + doc->size, 1, capacity - doc->size,
+                          f))) {
+        doc->size += count;
+        if (doc->size == capacity)
+            doc->encoding = fsrealloc(doc->encoding, capacity *= 2);
+    }
+    fclose(f);
+    json_thing_t *thing = json_utf8_decode(doc->encoding, doc->size);
+    if (!thing) {
+        fprintf(stderr, "%s: not valid JSON\n", path);
+        fsfree(doc->encoding);
+        return false;
+    }
+    json_destroy_thing(thing);
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    doc->name = strcpy(fsalloc(strlen(name) + 1), name);
+    prepare_document(doc);
+    return true;
+}
+
+static void release_document(document_t *doc)
+{
+    json_destroy_thing(doc->thing);
+    json_destroy_thing(doc->copy);
+    fsfree(doc->buffer);
+    fsfree(doc->encoding);
+    fsfree(doc->name);
+}
+
+static void decode_op(void *arg)
+{
+    document_t *doc = arg;
+    json_destroy_thing(json_utf8_decode(doc->encoding, doc->size));
+}
+
+static void encode_op(void *arg)
+{
+    document_t *doc = arg;
+    (void) json_utf8_encode(doc->thing, doc->buffer, doc->buffer_size);
+}
+
+static void prettyprint_op(void *arg)
+{
+    document_t *doc = arg;
+    (void) json_utf8_prettyprint(doc->thing, doc->buffer, doc->buffer_size,
+                                 0, 2);
+}
+
+static void clone_op(void *arg)
+{
+    document_t *doc = arg;
+    json_destroy_thing(json_clone(doc->thing));
+}
+
+static void equal_op(void *arg)
+{
+    document_t *doc = arg;
+    if (!json_thing_equal(doc->thing, doc->copy, 0))
+        abort();
+}
+
+static void object_get_op(void *arg)
+{
+    lookup_t *lookup = arg;
+    size_t i;
+    for (i = 0; i < lookup->count; i++)
+        if (!json_object_get(lookup->container, lookup->names[i]))
+            abort();
+}
+
+static void array_get_op(void *arg)
+{
+    lookup_t *lookup = arg;
+    size_t i;
+    for (i = 0; i < lookup->count; i++)
+        if (!json_array_get(lookup->container, i))
+            abort();
+}
+
+static void format_op(void *arg)
+{
+    formatting_t *formatting = arg;
+    char buf[FORMAT_SPACE];
+    size_t i;
+    for (i = 0; i < formatting->count; i++)
+        (void) formatting->format(formatting->values[i], buf);
+}
+
+/* Return the number of operations per second. */
+static double measure(operation_t op, void *arg, double min_time)
+{
+    double best = 0;
+    int round;
+    for (round = 0; round < ROUNDS; round++) {
+        size_t n = 1, i;
+        double elapsed;
+        for (;;) {
+            double start = now();
+            for (i = 0; i < n; i++)
+                op(arg);
+            elapsed = now() - start;
+            if (elapsed >= min_time)
+                break;
+            n *= 2;
+        }
+        if (n / elapsed > best)
+            best = n / elapsed;
+    }
+    return best;
+}
+
+/* Run the operation and record the result. An operation consists of
+ * ops_per_call documents or lookups and processes size bytes of
+ * encoding. */
+static void run(report_t *report, const char *benchmark,
+                const char *document, operation_t op, void *arg,
+                size_t ops_per_call, size_t size)
+{
+    op(arg); /* warm up */
+    unsigned long long before = allocations;
+    op(arg);
+    double allocs = allocations - before;
+    double calls_per_s = measure(op, arg, report->min_time);
+    if (report->count == report->capacity) {
+        report->capacity = report->capacity ? 2 * report->capacity : 64;
+        report->results =
+            fsrealloc(report->results,
+                      report->capacity * sizeof report->results[0]);
+    }
+    result_t *result = &report->results[report->count++];
+    result->benchmark = benchmark;
+    result->document = document;
+    result->mb_per_s = size * calls_per_s / 1e6;
+    result->ops_per_s = ops_per_call * calls_per_s;
+    result->allocs_per_op = allocs / ops_per_call;
+    fprintf(stderr, "%-14s %-20s %10.1f MB/s %14.0f op/s %10.1f allocs/op\n",
+            benchmark, document, result->mb_per_s, result->ops_per_s,
+            result->allocs_per_op);
+}
+
+static void run_document_benchmarks(report_t *report, document_t *doc)
+{
+    run(report, "decode", doc->name, decode_op, doc, 1, doc->size);
+    run(report, "encode", doc->name, encode_op, doc, 1, doc->size);
+    run(report, "prettyprint", doc->name, prettyprint_op, doc, 1, doc->size);
+    run(report, "clone", doc->name, clone_op, doc, 1, doc->size);
+    run(report, "equal", doc->name, equal_op, doc, 1, doc->size);
+}
+
+static void run_object_get(report_t *report, const char *document,
+                           size_t size)
+{
+    lookup_t lookup = {
+        .container = json_make_object(),
+        .names = fsalloc(size * sizeof lookup.names[0]),
+        .count = size,
+    };
+    size_t i;
+    for (i = 0; i < size; i++) {
+        char name[40];
+        sprintf(name, "field-%zu", i);
+        lookup.names[i] = strcpy(fsalloc(strlen(name) + 1), name);
+        json_add_to_object(lookup.container, name, json_make_integer(i));
+    }
+    run(report, "object_get", document, object_get_op, &lookup, size, 0);
+    for (i = 0; i < size; i++)
+        fsfree(lookup.names[i]);
+    fsfree(lookup.names);
+    json_destroy_thing(lookup.container);
+}
+
+static void run_array_get(report_t *report)
+{
+    lookup_t lookup = {
+        .container = json_make_array(),
+        .names = NULL,
+        .count = LOOKUP_ARRAY_SIZE,
+    };
+    size_t i;
+    for (i = 0; i < lookup.count; i++)
+        json_add_to_array(lookup.container, json_make_integer(i));
+    run(report, "array_get", "array-10000", array_get_op, &lookup,
+        lookup.count, 0);
+    json_destroy_thing(lookup.container);
+}
+
+static void run_format_float(report_t *report, const char *formatter,
+                             formatter_t format, const double *values,
+                             size_t count)
+{
+    formatting_t formatting = { format, values, count };
+    char buf[FORMAT_SPACE];
+    size_t size = 0, i;
+    for (i = 0; i < count; i++)
+        size += format(values[i], buf);
+    run(report, "format_float", formatter, format_op, &formatting, count,
+        size);
+}
+
+static bool run_float_benchmarks(report_t *report)
+{
+    double *values = make_float_samples(FLOAT_SAMPLES);
+    bool ok = check_formatters(values, FLOAT_SAMPLES);
+    if (ok) {
+        run_format_float(report, "binary64_format", format_binary64, values,
+                         FLOAT_SAMPLES);
+        run_format_float(report, "printf_shortest", format_printf_shortest,
+                         values, FLOAT_SAMPLES);
+    }
+    fsfree(values);
+    return ok;
+}
+
+static json_thing_t *report_to_json(report_t *report)
+{
+    json_thing_t *array = json_make_array();
+    size_t i;
+    for (i = 0; i < report->count; i++) {
+        result_t *result = &report->results[i];
+        json_thing_t *entry = json_make_object();
+        add(entry, "benchmark", json_make_string(result->benchmark));
+        add(entry, "document", json_make_string(result->document));
+        add(entry, "mb_per_s", json_make_float(result->mb_per_s));
+        add(entry, "ops_per_s", json_make_float(result->ops_per_s));
+        add(entry, "allocs_per_op", json_make_float(result->allocs_per_op));
+        json_add_to_array(array, entry);
+    }
+    return array;
+}
+
+static json_thing_t *find_baseline(json_thing_t *baseline,
+                                   const result_t *result)
+{
+    json_element_t *element;
+    for (element = json_array_first(baseline); element;
+         element = json_element_next(element)) {
+        json_thing_t *entry = json_element_value(element);
+        const char *benchmark, *document;
+        if (json_thing_type(entry) == JSON_OBJECT &&
+            json_object_get_string(entry, "benchmark", &benchmark) &&
+            json_object_get_string(entry, "document", &document) &&
+            !strcmp(benchmark, result->benchmark) &&
+            !strcmp(document, result->document))
+            return entry;
+    }
+    return NULL;
+}
+
+/* Return the number of regressions beyond the threshold. */
+static size_t compare(report_t *report, json_thing_t *baseline,
+                      double threshold)
+{
+    size_t regressions = 0, i;
+    for (i = 0; i < report->count; i++) {
+        result_t *result = &report->results[i];
+        json_thing_t *entry = find_baseline(baseline, result);
+        double ops_per_s, allocs_per_op;
+        if (!entry || !json_object_get_double(entry, "ops_per_s", &ops_per_s) ||
+            !json_object_get_double(entry, "allocs_per_op", &allocs_per_op) ||
+            ops_per_s <= 0) {
+            fprintf(stderr, "%-14s %-20s (no baseline)\n", result->benchmark,
+                    result->document);
+            continue;
+        }
+        double change = 100 * (result->ops_per_s / ops_per_s - 1);
+        bool regressed = change < -threshold;
+        if (regressed)
+            regressions++;
+        fprintf(stderr, "%-14s %-20s %+7.1f%% op/s %+8.1f allocs/op%s\n",
+                result->benchmark, result->document, change,
+                result->allocs_per_op - allocs_per_op,
+                regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [ -t seconds ] [ -j ] [ -c baseline [ -p percent ] ] "
+            "[ file ... ]\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    report_t report = { .results = NULL, .min_time = 0.3 };
+    bool json_output = false;
+    const char *baseline_path = NULL;
+    double threshold = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:jc:p:")) != -1)
+        switch (opt) {
+            case 't':
+                report.min_time = atof(optarg);
+                break;
+            case 'j':
+                json_output = true;
+                break;
+            case 'c':
+                baseline_path = optarg;
+                break;
+            case 'p':
+                threshold = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    json_thing_t *baseline = NULL;
+    if (baseline_path) {
+        baseline = json_utf8_decode_path(baseline_path, (size_t) -1);
+        if (!baseline || json_thing_type(baseline) != JSON_ARRAY) {
+            fprintf(stderr, "%s: not a benchmark report\n", baseline_path);
+            return EXIT_FAILURE;
+        }
+    }
+    next_reallocator = fs_get_reallocator();
+    fs_set_reallocator(counting_reallocator);
+    size_t count = 6 + argc - optind, i;
+    document_t *docs = fsalloc(count * sizeof docs[0]);
+    make_document(&docs[0], "twitter", make_twitter());
+    make_document(&docs[1], "canada", make_canada());
+    make_document(&docs[2], "citm_catalog", make_citm());
+    make_document(&docs[3], "numbers", make_numbers());
+    make_document(&docs[4], "deep", make_deep());
+    make_document(&docs[5], "escapes", make_escapes());
+    for (count = 6; optind < argc; optind++)
+        if (read_document(&docs[count], argv[optind]))
+            count++;
+    for (i = 0; i < count; i++)
+        run_document_benchmarks(&report, &docs[i]);
+    run_object_get(&report, "object-16", SMALL_OBJECT_SIZE);
+    run_object_get(&report, "object-1000", LARGE_OBJECT_SIZE);
+    run_array_get(&report);
+    bool formatters_ok = run_float_benchmarks(&report);
+    if (json_output) {
+        json_thing_t *output = report_to_json(&report);
+        json_utf8_write_file(output, stdout,
+                             JSON_WRITE_PRETTY | JSON_WRITE_NEWLINE);
+        json_destroy_thing(output);
+    }
+    size_t regressions = 0;
+    if (baseline) {
+        regressions = compare(&report, baseline, threshold);
+        json_destroy_thing(baseline);
+    }
+    for (i = 0; i < count; i++)
+        release_document(&docs[i]);
+    fsfree(docs);
+    fsfree(report.results);
+    fs_set_reallocator(next_reallocator);
+    return regressions || !formatters_ok ? EXIT_FAILURE : EXIT_SUCCESS;
+}
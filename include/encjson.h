@@ -2,6 +2,7 @@
 #define __ENCJSON__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -12,10 +13,18 @@ extern "C" {
 typedef struct json_thing json_thing_t;
 typedef struct json_element json_element_t;
 typedef struct json_field json_field_t;
+typedef struct json_arena json_arena_t;
+typedef struct json_decoder json_decoder_t;
+typedef struct json_parser json_parser_t;
+typedef struct json_path json_path_t;
+typedef struct json_path_set json_path_set_t;
 
 json_thing_t *json_make_integer(long long n);
 json_thing_t *json_make_unsigned(unsigned long long n);
 json_thing_t *json_make_float(double n);
+/* Booleans and nulls are shared, immutable singletons. Destroying one
+ * has no effect, and the same boolean or null may be added to any
+ * number of arrays and objects. */
 json_thing_t *json_make_boolean(bool truth_value);
 json_thing_t *json_make_null(void);
 /* The value of a string created with json_make_bounded_string() has a
@@ -61,6 +70,21 @@ void json_destroy_thing(json_thing_t *thing);
 
 json_thing_t *json_clone(json_thing_t *thing);
 
+/* Like json_clone() but the copy shares the arrays and objects inside
+ * the thing with the original; only the top level is copied. A shared
+ * array or object is copied, one level at a time, when it is about to
+ * be handed out of either (e.g., by json_object_get() or
+ * json_array_first()) so that a copy can be modified independently of
+ * the original and its other copies. Things that were obtained from
+ * inside the original before the call must be looked up again.
+ *
+ * The original and its copies can be used and destroyed in any order,
+ * each from a different thread, except that the copies of a lazy
+ * decoding (json_utf8_decode_lazy()) must stay in the same thread as
+ * the original. The thing must not be in an arena or a json_freeze()
+ * block. */
+json_thing_t *json_share(json_thing_t *thing);
+
 typedef enum {
     JSON_ARRAY,
     JSON_OBJECT,
@@ -117,10 +141,21 @@ bool json_array_get_unsigned(json_thing_t *thing, unsigned n,
 bool json_array_get_double(json_thing_t *thing, unsigned n, double *value);
 bool json_array_get_boolean(json_thing_t *thing, unsigned n, bool *value);
 
-/* May result in an O(n) traversal. */
 size_t json_array_size(json_thing_t *array);
 
-/* NULL is returned for an empty array. */
+/* Cast up to count leading elements of the array into values with
+ * the cast functions above. Return the number of elements cast. It is
+ * less than count if the array is shorter or if the element at that
+ * index cannot be cast. */
+size_t json_array_to_doubles(json_thing_t *array, double *values,
+                             size_t count);
+size_t json_array_to_int64s(json_thing_t *array, int64_t *values,
+                            size_t count);
+size_t json_array_to_uint64s(json_thing_t *array, uint64_t *values,
+                             size_t count);
+
+/* NULL is returned for an empty array. Adding elements to the array
+ * invalidates its json_element_t iterators. */
 json_element_t *json_array_first(json_thing_t *array);
 
 /* NULL is returned when the array is exhausted. */
@@ -131,6 +166,16 @@ json_thing_t *json_element_value(json_element_t *element);
 /* If the object does not have the specified field, NULL is returned. */
 json_thing_t *json_object_get(json_thing_t *object, const char *key);
 
+/* An interned key is a field name whose hash has been computed in
+ * advance. Interning the same name again returns the same key. Keys
+ * are never released (nor counted as leaks by fsdyn). json_intern() is
+ * thread-safe. */
+typedef const struct json_key *json_key_t;
+json_key_t json_intern(const char *name);
+
+/* Like json_object_get() but avoid hashing the key. */
+json_thing_t *json_object_get_key(json_thing_t *object, json_key_t key);
+
 /* The return value is false if the requested field is either missing
  * or is not of the expected type. The numeric accessors use the
  * corresponding cast functions to get the field value. */
@@ -163,17 +208,47 @@ json_thing_t *json_object_dig(json_thing_t *object, const char *const *keys,
 json_thing_t *json_object_fetch_func(json_thing_t *object, const char *key,
                                      ...);
 
+/* Compile a path expression like "a.b[3].c" for repeated evaluation.
+ * The expression is a sequence of field names separated by '.' and
+ * array indices in brackets; a field name cannot contain '.' or '['.
+ * The empty expression denotes the thing itself. In case of a syntax
+ * error, NULL is returned and errno is set to EINVAL. */
+json_path_t *json_path_compile(const char *expr);
+
+/* Return the value the path leads to or NULL if the path does not
+ * match the structure. */
+json_thing_t *json_path_eval(const json_path_t *path, json_thing_t *thing);
+
+void json_destroy_path(json_path_t *path);
+
+/* A path set evaluates a number of compiled paths at once. Paths that
+ * share a prefix share the work of following it. The paths may be
+ * destroyed after the path set has been made. */
+json_path_set_t *json_make_path_set(json_path_t *const *paths, size_t count);
+
+/* Store the value that paths[i] leads to in results[i], or NULL if it
+ * does not match the structure. */
+void json_path_set_eval(const json_path_set_t *set, json_thing_t *thing,
+                        json_thing_t **results);
+
+void json_destroy_path_set(json_path_set_t *set);
+
 /* If the object does not have the specified field, NULL is returned. */
 json_thing_t *json_object_pop(json_thing_t *object, const char *key);
 
 /* The order of object fields is unspecified. NULL is returned for an
- * empty object. */
+ * empty object. Adding or popping fields invalidates the json_field_t
+ * iterators of the object. */
 json_field_t *json_object_first(json_thing_t *object);
 
 /* NULL is returned when the fields are exhausted. */
 json_field_t *json_field_next(json_field_t *field);
 
 const char *json_field_name(json_field_t *field);
+/* Return the length in bytes of the field name. Note that the name
+ * returned by json_field_name() is not NUL-terminated if the field was
+ * decoded with JSON_DECODE_ZERO_COPY. */
+size_t json_field_name_length(json_field_t *field);
 json_thing_t *json_field_value(json_field_t *field);
 
 /* json_utf8_encode() has semantics analogous to snprintf(3):
@@ -186,6 +261,10 @@ json_thing_t *json_field_value(json_field_t *field);
  * As a result, a return value >= size means the encoding was truncated.
  * Also, json_utf8_encode(thing, NULL, 0) can be used to calculate the
  * space requirement of the encoding.
+ *
+ * Arrays and objects remember the length of their compact encoding
+ * until they or anything inside them is modified, which makes
+ * repeated sizing of largely unchanged things cheap.
  */
 size_t json_utf8_encode(json_thing_t *thing, void *buffer, size_t size);
 
@@ -196,19 +275,76 @@ size_t json_utf8_encode(json_thing_t *thing, void *buffer, size_t size);
 size_t json_utf8_prettyprint(json_thing_t *thing, void *buffer, size_t size,
                              unsigned left_margin, unsigned indentation);
 
+/* A sink receives an encoding in pieces as it is produced. The write
+ * function returns false in case of an error. */
+typedef struct {
+    void *obj;
+    bool (*write)(void *obj, const void *data, size_t size);
+} json_sink_t;
+
+/* Encode the thing into the sink in a single pass. No NUL terminator
+ * is written. Return false if the sink failed. */
+bool json_utf8_encode_to(json_thing_t *thing, json_sink_t *sink);
+
+/* Like json_utf8_encode_to() but produces a prettyprinted output (see
+ * json_utf8_prettyprint()). */
+bool json_utf8_prettyprint_to(json_thing_t *thing, json_sink_t *sink,
+                              unsigned left_margin, unsigned indentation);
+
+/* Like json_utf8_encode_to() but encode the contents of large arrays
+ * and objects near the top of the tree in pieces, using up to nthreads
+ * worker threads. The output is identical to that of
+ * json_utf8_encode_to(). Pieces are buffered until they reach the
+ * sink, so memory use can grow with the document. The thing must not
+ * be accessed from other threads during the call. */
+bool json_utf8_encode_parallel(json_thing_t *thing, unsigned nthreads,
+                               json_sink_t *sink);
+
+/* Encode the thing in a single pass into a NUL-terminated buffer
+ * allocated with fsalloc(). If size is not NULL, the length of the
+ * encoding is stored in it. The caller must fsfree() the buffer. */
+char *json_utf8_encode_alloc(json_thing_t *thing, size_t *size);
+
+/* Like json_utf8_encode_alloc() but produces a prettyprinted output
+ * (see json_utf8_prettyprint()). */
+char *json_utf8_prettyprint_alloc(json_thing_t *thing, size_t *size,
+                                  unsigned left_margin, unsigned indentation);
+
 /* Pretty-print the JSON thing to the given file. Terminate the output
- * with a newline. Return whatever fprintf(3) returns. */
+ * with a newline. Return the number of bytes written or a negative
+ * number in case of an error, like fprintf(3). */
 int json_utf8_dump(json_thing_t *thing, FILE *f);
 
+enum {
+    /* Prettyprint with an indentation of two (see
+     * json_utf8_prettyprint()); the default is compact. */
+    JSON_WRITE_PRETTY = 1 << 0,
+    /* Terminate the output with a newline. */
+    JSON_WRITE_NEWLINE = 1 << 1,
+};
+
+/* Encode the thing to the file descriptor in a single pass through a
+ * fixed-size staging buffer, so the memory use does not depend on the
+ * size of the document. The flags are a bitwise or of JSON_WRITE_*
+ * flags. Return false and set errno if write(2) fails; the output
+ * may then be incomplete. */
+bool json_utf8_write(json_thing_t *thing, int fd, unsigned flags);
+
+/* Like json_utf8_write() but write to a stdio stream. */
+bool json_utf8_write_file(json_thing_t *thing, FILE *f, unsigned flags);
+
 /* A plugin function for fstrace's %I directive. It is safe to use a
- * maximum of four times on a single fstrace line.
+ * maximum of four times on a single fstrace line. Each thread has its
+ * own trace buffers, so no lock is needed around the call. The output
+ * is cut short at the maximum size.
  *
  * See also: json_trace_max_size(). */
 const char *json_trace(void /* json_thing_t */ *thing);
 
 /* By default, json_trace() limits the output to a "reasonable" size.
  * This pseudofield can be used to adjust the size for the next call to
- * json_trace(). The function always returns "". Example:
+ * json_trace() in the same thread. The function always returns "".
+ * Example:
  *
  * FSTRACE_DECL(XYZ_CONFIGURE, "UID=%64u CONFIGURATION=%I%I");
  *
@@ -230,6 +366,21 @@ const char *json_trace_thing_type(void /* json_thing_t */ *thing);
  * name of the type. */
 const char *json_trace_type(void /* json_thing_type_t */ *ptype);
 
+/* A plugin function for fstrace's %I directive. Render the statistics
+ * (see json_stats_get()) as JSON, subject to json_trace_max_size(). */
+const char *json_trace_stats(void /* json_stats_t */ *stats);
+
+enum {
+    JSON_DEFAULT_MAX_DEPTH = 200
+};
+
+/* The decoders reject encodings whose arrays and objects are nested
+ * more deeply than the given limit (JSON_DEFAULT_MAX_DEPTH unless set
+ * otherwise). Decoding, encoding, cloning, comparing and destroying
+ * keep their state on the heap, so a large limit does not put the
+ * C stack at risk. Return the previous limit. */
+unsigned json_set_max_depth(unsigned depth);
+
 /* Parse the given JSON encoding and return the corresponding decoding
  * or NULL in case of a syntax error.
  *
@@ -239,10 +390,128 @@ const char *json_trace_type(void /* json_thing_type_t */ *ptype);
  * JSON_INTEGER is chosen in the overlapping range [0..LLONG_MAX]. */
 json_thing_t *json_utf8_decode(const void *buffer, size_t size);
 
+enum {
+    /* Locate all structural characters, string boundaries and the
+     * starts of scalars in a first pass over the whole buffer (using
+     * vector instructions where available) and build the decoding
+     * from that index in a second pass. The index costs four bytes
+     * per token, but the second pass never looks at whitespace. */
+    JSON_DECODE_STRUCTURAL_INDEX = 1 << 0,
+    /* String values and field names that contain no escape sequences
+     * point directly into the given buffer instead of being copied.
+     * The caller must keep the buffer intact for as long as the
+     * decoding exists. Such strings are not NUL-terminated; use
+     * json_string_length() and json_field_name_length(). Clones of
+     * the decoding (json_clone()) do not refer to the buffer. */
+    JSON_DECODE_ZERO_COPY = 1 << 1,
+    /* Store nonempty arrays of nothing but numbers packed, without a
+     * node per element. Encoding, hashing, json_array_size() and the
+     * json_array_to_*() functions work on a packed array as is; any
+     * other access to its elements gives it element nodes first, so
+     * it must not be accessed from multiple threads simultaneously.
+     * Ignored when decoding into an arena. */
+    JSON_DECODE_PACK_NUMBERS = 1 << 2,
+};
+
+/* Like json_utf8_decode() but the decoding strategy is chosen with the
+ * bitwise or of JSON_DECODE_* flags. The decoded values are the same
+ * regardless of the flags. */
+json_thing_t *json_utf8_decode_ex(const void *buffer, size_t size,
+                                  unsigned flags);
+
 /* Parse the given JSON encoding and return the corresponding decoding
  * or NULL in case of a syntax error. */
 json_thing_t *json_utf8_decode_string(const char *encoding);
 
+/* Like json_utf8_decode() but decode nested arrays and objects only
+ * when they are first accessed. The whole encoding is validated up
+ * front. The decoding refers to the buffer, which must stay intact
+ * until the decoding is destroyed (as with JSON_DECODE_ZERO_COPY).
+ * The compact encoding of an array or object that has not been
+ * accessed is its original encoding without the whitespace. Since
+ * accessing a lazy decoding may modify it, it must not be accessed
+ * from multiple threads simultaneously. */
+json_thing_t *json_utf8_decode_lazy(const void *buffer, size_t size);
+
+/* An arena is a memory region that holds any number of decoded JSON
+ * things. Allocation from an arena is cheap, and all things in it are
+ * released at once by json_clear_arena() or json_destroy_arena(). */
+json_arena_t *json_make_arena(void);
+
+/* Release all things decoded into the arena but keep the arena itself
+ * for reuse. */
+void json_clear_arena(json_arena_t *arena);
+
+void json_destroy_arena(json_arena_t *arena);
+
+/* Like json_utf8_decode() but allocate the decoding from the given
+ * arena. The returned thing (and anything inside it) is owned by the
+ * arena: it must not be passed to json_destroy_thing() and it must not
+ * be modified with json_add_to_array(), json_add_to_object() or
+ * json_object_pop(). It can be read, encoded, compared and cloned
+ * normally; a clone is allocated with fsalloc().
+ *
+ * In case of a syntax error, NULL is returned and the partial decoding
+ * is left in the arena until the arena is cleared. */
+json_thing_t *json_utf8_decode_in_arena(json_arena_t *arena,
+                                        const void *buffer, size_t size);
+
+/* A decoder context keeps the memory of the decodings released to it
+ * (nodes, element and field vectors and short strings) for decodings
+ * to come. Unlike with an arena, each decoding has a lifetime of its
+ * own. A decoder context must not be used from multiple threads
+ * simultaneously; keep one per thread. */
+json_decoder_t *json_make_decoder(void);
+
+/* Release the memory kept by the decoder context. Decodings made with
+ * it are not affected. */
+void json_destroy_decoder(json_decoder_t *decoder);
+
+/* Like json_utf8_decode_ex() but take memory from the decoder context.
+ * The decoding is an ordinary one; it may be modified and destroyed
+ * with json_destroy_thing() as well. */
+json_thing_t *json_decoder_decode(json_decoder_t *decoder,
+                                  const void *buffer, size_t size,
+                                  unsigned flags);
+
+/* Like json_destroy_thing() but keep the memory in the decoder context.
+ * The thing need not have been decoded with the context. */
+void json_decoder_release(json_decoder_t *decoder, json_thing_t *thing);
+
+/* Runtime statistics. The counters are cumulative over the lifetime
+ * of the process and all of its threads; take two snapshots and
+ * subtract to measure an interval.
+ *
+ * Every decoder counts toward decode_calls, decoded_bytes and
+ * decode_nanoseconds: the tree decoders, the push parser (a call per
+ * json_parser_finish(), the bytes and time of every feed), the scanner
+ * and the binary decoder. Likewise, every encoder, the parallel and
+ * binary ones included, counts toward the encode_* counters; a
+ * parallel encoding is timed as a whole. max_depth is the deepest
+ * nesting seen by any of the decoders. index_builds counts the lookup
+ * tables built for large objects, and read_bytes the buffer space
+ * allocated for file input. */
+typedef struct {
+    uint64_t nodes[JSON_RAW + 1];      /* indexed by json_thing_type_t */
+    uint64_t node_bytes[JSON_RAW + 1]; /* indexed by json_thing_type_t */
+    uint64_t string_bytes;
+    uint64_t index_builds;
+    uint64_t decode_calls;
+    uint64_t decoded_bytes;
+    uint64_t decode_nanoseconds;
+    uint64_t encode_calls;
+    uint64_t encoded_bytes;
+    uint64_t encode_nanoseconds;
+    uint64_t read_bytes;
+    uint64_t max_depth;
+} json_stats_t;
+
+/* Store the current statistics in *stats. The statistics are only
+ * collected if the library is compiled with ENCJSON_STATS defined
+ * (scons stats=1). Otherwise, *stats is zeroed and false is
+ * returned. */
+bool json_stats_get(json_stats_t *stats);
+
 /* Parse the JSON encoding read from the given file and return the
  * corresponding decoding or NULL in case of an error (consult errno).
  * In addition to 'read' errors this function can set errno to the
@@ -255,6 +524,133 @@ json_thing_t *json_utf8_decode_string(const char *encoding);
  * interrupted by a signal. */
 json_thing_t *json_utf8_decode_file(FILE *f, size_t max_size);
 
+/* Like json_utf8_decode_file() but decode the rest of the given file
+ * descriptor. A regular file is mapped into memory and decoded in
+ * place; other files are read into a buffer. The file descriptor is
+ * left positioned at the end of the file. Note that a mapped file must
+ * not be truncated during the call. */
+json_thing_t *json_utf8_decode_fd(int fd, size_t max_size);
+
+/* Like json_utf8_decode_fd() but decode the file with the given path
+ * name. */
+json_thing_t *json_utf8_decode_path(const char *path, size_t max_size);
+
+/* A push parser decodes a JSON encoding that arrives in chunks of any
+ * size. It keeps its state between chunks so there is no need to
+ * collect the whole encoding into a contiguous buffer first. The
+ * decodings are equal to those of json_utf8_decode(). */
+json_parser_t *json_make_parser(void);
+
+/* Parse the next chunk of the encoding. Return false in case of a
+ * syntax error, after which the parser rejects any further chunks
+ * until json_parser_finish() is called. */
+bool json_parser_feed(json_parser_t *parser, const void *chunk, size_t size);
+
+/* Declare the end of the encoding and return the decoding or NULL if
+ * the syntax was bad or the encoding incomplete. The decoding is owned
+ * by the caller. The parser is ready to parse another encoding after
+ * the call. */
+json_thing_t *json_parser_finish(json_parser_t *parser);
+
+void json_destroy_parser(json_parser_t *parser);
+
+/* Event callbacks for json_utf8_scan(). Any callback may be NULL.
+ * Returning false from a callback stops the scan. The string values
+ * and field names given to the callbacks are valid only for the
+ * duration of the call and are not NUL-terminated. */
+typedef struct {
+    bool (*start_object)(void *ctx);
+    bool (*key)(void *ctx, const char *name, size_t len);
+    bool (*end_object)(void *ctx);
+    bool (*start_array)(void *ctx);
+    bool (*end_array)(void *ctx);
+    bool (*string)(void *ctx, const char *value, size_t len);
+    bool (*integer)(void *ctx, long long value);
+    bool (*unsigned_integer)(void *ctx, unsigned long long value);
+    bool (*real)(void *ctx, double value);
+    bool (*boolean)(void *ctx, bool value);
+    bool (*null)(void *ctx);
+} json_callbacks_t;
+
+/* Scan the given JSON encoding and report its contents through the
+ * callbacks without building a decoding. The numbers are reported as
+ * json_utf8_decode() would decode them. Return true if the encoding is
+ * valid and no callback stopped the scan. In case of a syntax error,
+ * errno is set to EINVAL; note that events may have been reported
+ * before the error was detected. */
+bool json_utf8_scan(const void *buffer, size_t size,
+                    const json_callbacks_t *cb, void *ctx);
+
+typedef struct {
+    /* The number of worker threads. With 0 or 1, the records are
+     * decoded by the calling thread. */
+    unsigned num_workers;
+    /* Whether the records are delivered in the order of the input.
+     * Otherwise, the records of a chunk are delivered (in order) as
+     * soon as the chunk is decoded. */
+    bool ordered;
+    /* The approximate number of bytes decoded by a worker at a time;
+     * 0 for a default of 1 MiB. */
+    size_t chunk_size;
+    /* JSON_DECODE_* */
+    unsigned flags;
+} json_ndjson_options_t;
+
+/* A record callback receives the offset of the record in the input and
+ * its decoding, or NULL if the record is not valid JSON. The decoding
+ * belongs to the decoder and is valid only for the duration of the
+ * call; it must not be modified or destroyed (see json_clone()).
+ * Returning false stops the decoding. */
+typedef bool (*json_record_cb_t)(void *ctx, size_t offset,
+                                 json_thing_t *record);
+
+/* Decode newline-delimited JSON (a.k.a. JSON lines): each line of the
+ * input holds one record. Lines consisting of whitespace only are
+ * skipped. The callback is always invoked from the calling thread.
+ * Return false if the callback stopped the decoding. */
+bool json_ndjson_decode(const void *buffer, size_t size,
+                        const json_ndjson_options_t *options,
+                        json_record_cb_t record, void *ctx);
+
+/* Like json_ndjson_decode() but read the input from the given file
+ * until the end of the file. Return false also in case of a read error
+ * (consult errno). */
+bool json_ndjson_decode_file(FILE *f, const json_ndjson_options_t *options,
+                             json_record_cb_t record, void *ctx);
+
+/* The binary encoding is a compact, versioned serialization of a
+ * thing that preserves JSON_INTEGER, JSON_UNSIGNED and JSON_FLOAT
+ * values exactly. Strings and field names are stored NUL-terminated,
+ * and arrays and objects carry their encoded lengths so a reader can
+ * skip over them. The encoding is independent of the host's byte
+ * order and alignment and may be read straight from a memory mapping.
+ *
+ * json_binary_encode() returns a buffer allocated with fsalloc() and
+ * stores its size in *size. */
+char *json_binary_encode(json_thing_t *thing, size_t *size);
+
+/* Decode a binary encoding. The only flag supported is
+ * JSON_DECODE_ZERO_COPY, which makes the decoding refer to the strings
+ * and field names in the buffer instead of copying them. In case of
+ * a malformed encoding or an unsupported version, NULL is returned
+ * and errno is set to EINVAL. */
+json_thing_t *json_binary_decode(const void *buffer, size_t size,
+                                 unsigned flags);
+
+/* Lay out a copy of the thing in a single contiguous block allocated
+ * with fsalloc() and store the size of the block in *size. The block
+ * contains no pointers, so it can be written to a file and used from
+ * a memory mapping in any process on the same architecture. */
+void *json_freeze(json_thing_t *thing, size_t *size);
+
+/* Return the root of a block produced by json_freeze() or NULL (with
+ * errno set to EINVAL) if the block is not one. The block must be
+ * 8-byte aligned and is trusted beyond its header. The things in it
+ * work with all accessors, encoders and json_clone() but must not be
+ * modified or passed to json_destroy_thing(); they stay valid as long
+ * as the block does. */
+json_thing_t *json_frozen_root(const void *block, size_t size);
+
 /* Return true if and only if a and b are (recursively) equal. The operands must
  * not have been constructed with the help of json_make_raw().
  *
@@ -270,11 +666,24 @@ json_thing_t *json_utf8_decode_file(FILE *f, size_t max_size);
  */
 bool json_thing_equal(json_thing_t *a, json_thing_t *b, double tolerance);
 
+/* Return a hash of the thing that is consistent with json_thing_equal()
+ * with zero tolerance: equal things have equal hashes provided that
+ * no object in them has duplicate field names. The order of the fields
+ * of an object does not affect the hash, and numbers hash by value
+ * regardless of their type (1 and 1.0 hash alike). The hash does not
+ * depend on the process; it is never 0.
+ *
+ * Arrays and objects remember their hashes until they are modified.
+ * json_thing_equal() tells arrays and objects with different
+ * remembered hashes apart without comparing their contents. */
+uint64_t json_thing_hash(json_thing_t *thing);
+
 #ifdef __cplusplus
 }
 
 #include <functional>
 #include <memory>
+#include <new>
 #include <string>
 
 namespace fsecure {
@@ -295,22 +704,33 @@ inline JsonThingPtr make_json_thing_ptr(json_thing_t *thing)
 
 #if __cplusplus >= 201703L
 
+inline bool append_to_string(void *obj, const void *data, size_t size)
+{
+    try {
+        static_cast<std::string *>(obj)->append(static_cast<const char *>(data),
+                                                size);
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
 inline std::string dump(json_thing_t *thing)
 {
-    size_t size = json_utf8_encode(thing, nullptr, 0);
     std::string str;
-    str.resize(size);
-    json_utf8_encode(thing, str.data(), size + 1);
+    json_sink_t sink = { &str, append_to_string };
+    if (!json_utf8_encode_to(thing, &sink))
+        throw std::bad_alloc();
     return str;
 }
 
 inline std::string dump(json_thing_t *thing, unsigned left_margin,
                         unsigned indent)
 {
-    size_t size = json_utf8_prettyprint(thing, nullptr, 0, left_margin, indent);
     std::string str;
-    str.resize(size);
-    json_utf8_prettyprint(thing, str.data(), size + 1, left_margin, indent);
+    json_sink_t sink = { &str, append_to_string };
+    if (!json_utf8_prettyprint_to(thing, &sink, left_margin, indent))
+        throw std::bad_alloc();
     return str;
 }
 
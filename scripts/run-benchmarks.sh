@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+
+main () {
+    cd "$(dirname "$0")/.." &&
+    if [ -n "$FSARCHS" ]; then
+        local archs=()
+        IFS=, read -ra archs <<< "$FSARCHS"
+        for arch in "${archs[@]}" ; do
+            run-benchmarks "$arch" "$@"
+        done
+    else
+        local os=$(uname -m -s)
+        case $os in
+            "Darwin arm64")
+                run-benchmarks darwin "$@";;
+            "Darwin x86_64")
+                run-benchmarks darwin "$@";;
+            "FreeBSD amd64")
+                run-benchmarks freebsd_amd64 "$@";;
+            "Linux i686")
+                run-benchmarks linux32 "$@";;
+            "Linux x86_64")
+                run-benchmarks linux64 "$@";;
+            "Linux aarch64")
+                run-benchmarks linux_arm64 "$@";;
+            "OpenBSD amd64")
+                run-benchmarks openbsd_amd64 "$@";;
+            *)
+                echo "$0: Unknown OS architecture: $os" >&2
+                exit 1
+        esac
+    fi
+}
+
+run-benchmarks () {
+    arch=$1
+    shift
+    echo "bench_encjson[$arch]..." >&2 &&
+    stage/$arch/build/bench/bench_encjson "$@"
+}
+
+main "$@"
@@ -1,18 +1,34 @@
+/* for mmap(2), posix_madvise(2) and O_CLOEXEC */
+#define _POSIX_C_SOURCE 200809L
+
 #include "encjson.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <fsdyn/charstr.h>
 #include <fsdyn/float.h>
 #include <fsdyn/fsalloc.h>
-#include <fsdyn/hashtable.h>
-#include <fsdyn/list.h>
 
 #include "encjson_version.h"
 
@@ -23,36 +39,119 @@
 #endif
 
 enum {
-    MAX_DECODE_NESTING_LEVELS = 200,
     JIT_SIZE_LIMIT = 30,
-    JIT_ACCESS_LIMIT = 1000
+    JIT_ACCESS_LIMIT = 1000,
+    VECTOR_INITIAL_CAPACITY = 4,
+    ARENA_CHUNK_SIZE = 8192,
+    ARENA_ALIGNMENT = 8 /* power of two, please */
+};
+
+enum {
+    THING_IN_ARENA = 1, /* owned by a json_arena_t */
+    THING_BORROWED = 2, /* the string or field name is in the caller's
+                         * buffer (JSON_DECODE_ZERO_COPY) */
+    THING_INLINE = 4,   /* the string value is stored in the node */
+    THING_STATIC = 8,   /* a shared, immutable true, false or null */
+    THING_LAZY = 16,    /* an array or object not decoded yet */
+    THING_FROZEN = 32,  /* in a json_freeze() block */
+    THING_SHALLOW = 64, /* the arrays and objects in it may be shared */
+    THING_PACKED = 128  /* an array of numbers without element nodes */
+};
+
+enum {
+    /* Decode nested arrays and objects lazily (json_utf8_decode_lazy());
+     * an internal decoder flag next to the JSON_DECODE_* flags */
+    DECODE_LAZY = 1 << 16,
+    /* Ignore the depth limit; the input was validated when the lazy
+     * decoding was made, possibly under a different limit */
+    DECODE_EXPANSION = 1 << 17,
 };
 
 typedef struct {
-    char *name;
+    char *name; /* not necessarily NUL-terminated */
+    size_t name_len;
     json_thing_t *value;
+    uint32_t hash;  /* of the name; see hash_name() */
+    unsigned flags; /* THING_BORROWED */
 } pair_t;
 
-/* Optimization of arrays and objects. When we detect that linear
- * lookups are taking a "long" time, we construct a C array or hash
- * table to speed up access. */
+typedef struct {
+    json_thing_type_t type; /* JSON_INTEGER, JSON_UNSIGNED or JSON_FLOAT */
+    union {
+        long long integer;
+        unsigned long long u_integer;
+        double real;
+    };
+} number_t;
+
+/* An open-addressing hash index over the fields of an object. Each
+ * slot holds the position of a field plus one, or zero if the slot is
+ * empty. Collisions are resolved by linear probing. */
+typedef struct {
+    size_t mask; /* the number of slots minus one */
+    size_t slots[];
+} object_index_t;
+
+/* Arrays and objects know their parent and remember the length of
+ * their compact encoding and their json_thing_hash() once computed.
+ * Adding or popping an element or field forgets both all the way up.
+ * The same thing may be encoded or hashed in several threads at once,
+ * so they are accessed atomically (see known_size()). */
+typedef struct {
+    json_thing_t *parent;       /* NULL at the root */
+    atomic_size_t encoded_size; /* 0 if unknown */
+    _Atomic uint64_t hash;      /* 0 if unknown */
+} tree_link_t;
+
+/* Array elements and object fields are stored in contiguous vectors
+ * that grow geometrically. Each vector has room for a terminating
+ * sentinel (a NULL element or a field with a NULL name) so that a
+ * json_element_t or json_field_t can be a plain pointer into the
+ * vector.
+ *
+ * Optimization of objects. Every field carries the hash of its name,
+ * which is compared before the name itself. When we detect that
+ * linear lookups are taking a "long" time, we construct a hash index
+ * to speed up access. Once constructed, the index is kept up to date
+ * as fields are added and popped.
+ *
+ * Nodes are allocated only as large as their type requires (see
+ * node_size()), so a number takes up no more than 16 bytes on a 64-bit
+ * target. Strings of up to INLINE_STRING_MAX bytes are stored in the
+ * node itself.
+ *
+ * An array of numbers decoded with JSON_DECODE_PACK_NUMBERS keeps them
+ * in a single vector of number_t without a sentinel (THING_PACKED).
+ * Encoding, hashing and the bulk casts read the vector directly;
+ * anything that needs element nodes unpacks the array first (see
+ * expand()). */
 struct json_thing {
-    json_thing_type_t type;
+    uint8_t type;  /* json_thing_type_t */
+    uint8_t flags; /* THING_* */
+    uint8_t short_len; /* THING_INLINE */
+    atomic_uint shares; /* references besides the first; see json_share() */
     union {
         struct {
-            list_t *elements;
-            uint64_t random_access_counter;
-            json_thing_t **lookup_table; /* may be NULL */
+            union {
+                json_thing_t **elements; /* NULL if capacity == 0 */
+                number_t *numbers;       /* THING_PACKED */
+            };
+            size_t count, capacity;
+            tree_link_t link;
         } array;
         struct {
-            list_t *fields;
+            pair_t *fields; /* NULL if capacity == 0 */
+            size_t count, capacity;
+            tree_link_t link; /* at the same offset as array.link */
             uint64_t random_access_counter;
-            hash_table_t *lookup_table; /* may be NULL */
+            object_index_t *index;      /* may be NULL */
+            json_thing_t *arena_next;   /* the previous object in the arena */
         } object;
         struct {
             char *utf8;
             size_t len;
         } string;
+        char short_string[sizeof(char *) + sizeof(size_t)]; /* THING_INLINE */
         struct {
             long long value;
         } integer;
@@ -68,1461 +167,5962 @@ struct json_thing {
         struct {
             char *repr;
         } raw;
+        struct {
+            const char *start; /* in the caller's buffer */
+            size_t len;
+        } lazy; /* THING_LAZY; array.link or object.link is valid */
+        struct {
+            /* Offsets relative to their own location:
+             *  - array: to a NULL-terminated vector of offsets to
+             *    the elements
+             *  - object: to a vector of frozen_pair_t terminated by a
+             *    zero name offset, and to an object_index_t
+             *  - string and raw: to the NUL-terminated bytes */
+            int64_t items;
+            size_t count; /* the same as array.count and string.len */
+            int64_t index;
+        } frozen; /* THING_FROZEN */
     };
 };
 
-_Static_assert(sizeof(double) == sizeof(uint64_t),
-               "encjson requires a 64-bit double type.");
-typedef union {
-    double f;
-    uint64_t i;
-} bin64_t;
+typedef struct {
+    int64_t name, value; /* relative to their own location */
+    size_t name_len;
+    uint32_t hash;
+} frozen_pair_t;
+
+/* Iteration handles (json_element_t and json_field_t) into frozen
+ * vectors are tagged in the lowest bit since vector entries are at
+ * least 8-byte aligned. */
+enum {
+    FROZEN_HANDLE = 1,
+};
 
-static const char *decode(const char *p, const char *end, json_thing_t **thing,
-                          unsigned levels);
-static const char *decode_string_value(const char *p, const char *end,
-                                       char **value, size_t *len);
+/* Resolve an offset relative to its own location. */
+static void *follow(const int64_t *offset)
+{
+    return (char *) offset + *offset;
+}
 
-static void json_error()
+enum {
+    INLINE_STRING_MAX = sizeof ((json_thing_t *) 0)->short_string - 1,
+};
+
+#define NODE_SIZE(member) \
+    (offsetof(json_thing_t, member) + sizeof ((json_thing_t *) 0)->member)
+
+static size_t node_size(json_thing_type_t type)
 {
-    /* set your debugger breakpoint here */
+    switch (type) {
+        case JSON_ARRAY:
+            return NODE_SIZE(array);
+        case JSON_OBJECT:
+            return NODE_SIZE(object);
+        case JSON_STRING:
+            return NODE_SIZE(string);
+        case JSON_RAW:
+            return NODE_SIZE(raw);
+        default:
+            return NODE_SIZE(integer);
+    }
 }
 
-static bool exhausted(const char *p, const char *end)
+/* A frozen array or object has no link. */
+static tree_link_t *link_of(json_thing_t *container)
 {
-    if (p < end)
-        return false;
-    json_error();
-    return true;
+    if (container->type == JSON_ARRAY)
+        return &container->array.link;
+    return &container->object.link;
 }
 
-static json_thing_t *make_thing(json_thing_type_t type)
+static bool is_container(json_thing_t *thing)
 {
-    json_thing_t *thing = fsalloc(sizeof *thing);
-    thing->type = type;
-    return thing;
+    return thing->type == JSON_ARRAY || thing->type == JSON_OBJECT;
 }
 
-json_thing_t *json_make_raw(const char *encoding)
+static bool shared(json_thing_t *thing)
 {
-    json_thing_t *thing = make_thing(JSON_RAW);
-    thing->raw.repr = charstr_dupstr(encoding);
-    return thing;
+    return atomic_load_explicit(&thing->shares, memory_order_acquire) != 0;
 }
 
-json_thing_t *json_make_integer(long long n)
+static void adopt(json_thing_t *container, json_thing_t *child)
 {
-    json_thing_t *thing = make_thing(JSON_INTEGER);
-    thing->integer.value = n;
-    return thing;
+    if (is_container(child) && !(child->flags & THING_FROZEN))
+        link_of(child)->parent = container;
 }
 
-json_thing_t *json_make_unsigned(unsigned long long n)
+/* Concurrent encoders agree on the length, so the order in which they
+ * record it does not matter. The same goes for hashes. */
+static size_t known_size(json_thing_t *container)
 {
-    json_thing_t *thing = make_thing(JSON_UNSIGNED);
-    thing->u_integer.value = n;
-    return thing;
+    return atomic_load_explicit(&link_of(container)->encoded_size,
+                                memory_order_relaxed);
 }
 
-json_thing_t *json_make_float(double n)
+static void set_known_size(json_thing_t *container, size_t size)
 {
-    json_thing_t *thing = make_thing(JSON_FLOAT);
-    thing->real.value = n;
-    return thing;
+    atomic_store_explicit(&link_of(container)->encoded_size, size,
+                          memory_order_relaxed);
 }
 
-json_thing_t *json_make_boolean(bool truth_value)
+static uint64_t known_hash(json_thing_t *container)
 {
-    json_thing_t *thing = make_thing(JSON_BOOLEAN);
-    thing->boolean.value = truth_value;
-    return thing;
+    return atomic_load_explicit(&link_of(container)->hash,
+                                memory_order_relaxed);
 }
 
-json_thing_t *json_make_null(void)
+static void set_known_hash(json_thing_t *container, uint64_t hash)
 {
-    return make_thing(JSON_NULL);
+    atomic_store_explicit(&link_of(container)->hash, hash,
+                          memory_order_relaxed);
 }
 
-static int is_ascii_control_character(char c)
+/* If the length or the hash of an array or object is unknown, so is
+ * that of its parent (but see expand_lazy()). */
+static void forget_memos(json_thing_t *container)
 {
-    return (c & 0xe0) == 0 || c == 0x7f;
+    for (; container && (known_size(container) || known_hash(container));
+         container = link_of(container)->parent) {
+        set_known_size(container, 0);
+        set_known_hash(container, 0);
+    }
 }
 
-static int is_at_latin_control_character(const char *s)
+static json_thing_t json_true = {
+    .type = JSON_BOOLEAN,
+    .flags = THING_STATIC,
+    .boolean.value = true,
+};
+
+static json_thing_t json_false = {
+    .type = JSON_BOOLEAN,
+    .flags = THING_STATIC,
+    .boolean.value = false,
+};
+
+static json_thing_t json_null = {
+    .type = JSON_NULL,
+    .flags = THING_STATIC,
+};
+
+static const char *string_utf8(json_thing_t *thing)
 {
-    return s[0] == (char) 0xc2 && (s[1] & 0xe0) == 0x80;
+    if (thing->flags & THING_INLINE)
+        return thing->short_string;
+    if (thing->flags & THING_FROZEN)
+        return follow(&thing->frozen.items);
+    return thing->string.utf8;
 }
 
-json_thing_t *json_adopt_bounded_string(char *s, size_t size)
+static const char *raw_repr(json_thing_t *thing)
 {
-    assert(charstr_valid_utf8_bounded(s, s + size));
-    json_thing_t *thing = make_thing(JSON_STRING);
-    thing->string.utf8 = s;
-    thing->string.len = size;
-    return thing;
+    if (thing->flags & THING_FROZEN)
+        return follow(&thing->frozen.items);
+    return thing->raw.repr;
 }
 
-json_thing_t *json_adopt_string(char *s)
+static size_t string_len(json_thing_t *thing)
 {
-    return json_adopt_bounded_string(s, strlen(s));
+    if (thing->flags & THING_INLINE)
+        return thing->short_len;
+    return thing->string.len;
 }
 
-json_thing_t *json_make_bounded_string(const char *s, size_t size)
+_Static_assert(sizeof(double) == sizeof(uint64_t),
+               "encjson requires a 64-bit double type.");
+typedef union {
+    double f;
+    uint64_t i;
+} bin64_t;
+
+typedef struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    uint64_t data[];
+} arena_chunk_t;
+
+/* Everything decoded into an arena is bump-allocated from a chain of
+ * chunks. The JIT lookup indices of objects come from fsalloc(),
+ * though, so the arena links its objects together and releases their
+ * indices when it is cleared. Cleared chunks of the standard size are
+ * kept for reuse until the arena is destroyed. */
+struct json_arena {
+    arena_chunk_t *chunks; /* the first chunk is kept by json_clear_arena() */
+    arena_chunk_t *spares; /* cleared standard-size chunks */
+    char *next, *end;
+    json_thing_t *objects; /* the most recent object */
+};
+
+typedef struct {
+    json_arena_t *arena;    /* NULL for the fsalloc() heap */
+    json_decoder_t *pools;  /* may be NULL; see json_decoder_decode() */
+    unsigned flags;         /* JSON_DECODE_* */
+} decoder_t;
+
+static const char *decode(decoder_t *dec, const char *p, const char *end,
+                          json_thing_t **thing);
+static const char *decode_string_value(decoder_t *dec, const char *p,
+                                       const char *end, char **value,
+                                       size_t *len, unsigned *flags);
+static void expand_lazy(json_thing_t *thing);
+static void unpack(json_thing_t *array);
+
+/* Make sure an array or object is decoded but leave a packed array
+ * packed. */
+static json_thing_t *decoded(json_thing_t *thing)
 {
-    char *dup = fsalloc(size + 1);
-    memcpy(dup, s, size);
-    dup[size] = '\0';
-    return json_adopt_bounded_string(dup, size);
+    if (thing->flags & THING_LAZY)
+        expand_lazy(thing);
+    return thing;
 }
 
-json_thing_t *json_make_string(const char *s)
+/* Make sure an array or object is decoded and has element nodes
+ * before it is accessed. */
+static json_thing_t *expand(json_thing_t *thing)
 {
-    return json_make_bounded_string(s, strlen(s));
+    if (thing->flags & THING_PACKED)
+        unpack(thing);
+    return decoded(thing);
 }
 
-json_thing_t *json_make_array(void)
+static json_thing_t *element_at(json_thing_t *array, size_t i)
 {
-    json_thing_t *thing = make_thing(JSON_ARRAY);
-    thing->array.elements = make_list();
-    thing->array.random_access_counter = 0;
-    thing->array.lookup_table = NULL;
-    return thing;
+    assert(!(array->flags & THING_PACKED));
+    if (array->flags & THING_FROZEN)
+        return follow((int64_t *) follow(&array->frozen.items) + i);
+    return array->array.elements[i];
 }
 
-static void clobber_array(json_thing_t *array)
+/* Return the field at the given position with the name and value
+ * resolved. */
+static pair_t field_at(json_thing_t *object, size_t i)
 {
-    if (!array->array.lookup_table)
-        return;
-    fsfree(array->array.lookup_table);
-    array->array.random_access_counter = 0;
-    array->array.lookup_table = NULL;
+    if (!(object->flags & THING_FROZEN))
+        return object->object.fields[i];
+    frozen_pair_t *f = (frozen_pair_t *) follow(&object->frozen.items) + i;
+    return (pair_t) {
+        .name = follow(&f->name),
+        .name_len = f->name_len,
+        .value = follow(&f->value),
+        .hash = f->hash,
+        .flags = THING_BORROWED,
+    };
 }
 
-json_thing_t *json_add_to_array(json_thing_t *array, json_thing_t *element)
+static void json_error()
 {
-    assert(array->type == JSON_ARRAY);
-    clobber_array(array);
-    list_append(array->array.elements, element);
-    return array;
+    /* set your debugger breakpoint here */
 }
 
-json_thing_t *json_make_object(void)
+static bool exhausted(const char *p, const char *end)
 {
-    json_thing_t *thing = make_thing(JSON_OBJECT);
-    thing->object.fields = make_list();
-    thing->object.random_access_counter = 0;
-    thing->object.lookup_table = NULL;
-    return thing;
+    if (p < end)
+        return false;
+    json_error();
+    return true;
 }
 
-static void clobber_object(json_thing_t *object)
+static atomic_uint max_depth = JSON_DEFAULT_MAX_DEPTH;
+
+unsigned json_set_max_depth(unsigned depth)
 {
-    if (!object->object.lookup_table)
-        return;
-    destroy_hash_table(object->object.lookup_table);
-    object->object.random_access_counter = 0;
-    object->object.lookup_table = NULL;
+    return atomic_exchange(&max_depth, depth);
 }
 
-static void add_to_object(json_thing_t *object, char *key, json_thing_t *value)
+static unsigned depth_limit(void)
 {
-    assert(object->type == JSON_OBJECT);
-    pair_t *f = fsalloc(sizeof *f);
-    clobber_object(object);
-    f->name = key;
-    f->value = value;
-    list_append(object->object.fields, f);
+    return atomic_load_explicit(&max_depth, memory_order_relaxed);
 }
 
-json_thing_t *json_add_to_object(json_thing_t *object, const char *field,
-                                 json_thing_t *value)
+/* The tree walks keep their state in a work stack rather than on the
+ * C stack. The first few levels fit in the work stack itself; deeper
+ * walks grow it with fsrealloc(). */
+enum {
+    WORK_STACK_LOCAL_SIZE = 512
+};
+
+typedef struct {
+    char *frames;
+    size_t frame_size, depth, capacity;
+    _Alignas(max_align_t) char local[WORK_STACK_LOCAL_SIZE];
+} work_stack_t;
+
+static void stack_init(work_stack_t *stack, size_t frame_size)
 {
-    add_to_object(object, charstr_dupstr(field), value);
-    return object;
+    stack->frames = stack->local;
+    stack->frame_size = frame_size;
+    stack->depth = 0;
+    stack->capacity = sizeof stack->local / frame_size;
 }
 
-void json_destroy_thing(json_thing_t *thing)
+/* Return the new, uninitialized top frame. */
+static void *stack_push(work_stack_t *stack)
 {
-    list_elem_t *e;
-    switch (thing->type) {
-        case JSON_ARRAY:
-            clobber_array(thing);
-            for (e = list_get_first(thing->array.elements); e; e = list_next(e))
-                json_destroy_thing((json_thing_t *) list_elem_get_value(e));
-            destroy_list(thing->array.elements);
-            break;
-        case JSON_OBJECT:
-            clobber_object(thing);
-            for (e = list_get_first(thing->object.fields); e;
-                 e = list_next(e)) {
-                pair_t *f = (pair_t *) list_elem_get_value(e);
-                fsfree(f->name);
-                json_destroy_thing(f->value);
-                fsfree(f);
-            }
-            destroy_list(thing->object.fields);
-            break;
-        case JSON_STRING:
-            fsfree(thing->string.utf8);
-            break;
-        case JSON_INTEGER:
-        case JSON_UNSIGNED:
-        case JSON_FLOAT:
-        case JSON_BOOLEAN:
-        case JSON_NULL:
-            break;
-        case JSON_RAW:
-            fsfree(thing->raw.repr);
-            break;
-        default:
-            assert(0);
+    if (stack->depth == stack->capacity) {
+        size_t size = 2 * stack->capacity * stack->frame_size;
+        if (stack->frames == stack->local) {
+            stack->frames = fsalloc(size);
+            memcpy(stack->frames, stack->local, sizeof stack->local);
+        } else
+            stack->frames = fsrealloc(stack->frames, size);
+        stack->capacity *= 2;
     }
-    fsfree(thing);
+    return stack->frames + stack->depth++ * stack->frame_size;
 }
 
-static json_thing_t *clone_array(json_thing_t *array)
+static void *stack_top(work_stack_t *stack)
 {
-    json_thing_t *clone = json_make_array();
-    json_element_t *e;
-    for (e = json_array_first(array); e; e = json_element_next(e)) {
-        json_thing_t *ec = json_clone(json_element_value(e));
-        if (!ec) {
-            json_destroy_thing(clone);
-            return NULL;
-        }
-        if (!json_add_to_array(clone, ec)) {
-            json_destroy_thing(ec);
-            json_destroy_thing(clone);
-            return NULL;
-        }
-    }
-    return clone;
+    assert(stack->depth);
+    return stack->frames + (stack->depth - 1) * stack->frame_size;
 }
 
-static json_thing_t *clone_object(json_thing_t *object)
+static void stack_pop(work_stack_t *stack)
 {
-    json_thing_t *clone = json_make_object();
-    json_field_t *f;
-    for (f = json_object_first(object); f; f = json_field_next(f)) {
-        json_thing_t *ec = json_clone(json_field_value(f));
-        json_add_to_object(clone, json_field_name(f), ec);
-    }
-    return clone;
+    assert(stack->depth);
+    stack->depth--;
 }
 
-json_thing_t *json_clone(json_thing_t *thing)
+static void stack_release(work_stack_t *stack)
 {
-    switch (thing->type) {
-        case JSON_ARRAY:
-            return clone_array(thing);
-        case JSON_OBJECT:
-            return clone_object(thing);
-        case JSON_STRING:
-            return json_make_string(thing->string.utf8);
-        case JSON_INTEGER:
-            return json_make_integer(thing->integer.value);
-        case JSON_UNSIGNED:
-            return json_make_unsigned(thing->u_integer.value);
-        case JSON_FLOAT:
-            return json_make_float(thing->real.value);
-        case JSON_BOOLEAN:
-            return json_make_boolean(thing->boolean.value);
-        case JSON_NULL:
-            return json_make_null();
-        case JSON_RAW:
-            return json_make_raw(thing->raw.repr);
-        default:
-            abort();
-    }
+    if (stack->frames != stack->local)
+        fsfree(stack->frames);
 }
 
-json_thing_type_t json_thing_type(json_thing_t *thing)
+/* An array or object being walked and the position of the next element
+ * or field in it. */
+typedef struct {
+    json_thing_t *container;
+    size_t next;
+} walk_frame_t;
+
+/* Statistics (json_stats_get()) are compiled in only if ENCJSON_STATS
+ * is defined. Each thread counts in a block of its own, which only it
+ * writes, so the counters need no atomic read-modify-write. The
+ * blocks of live threads are linked together for json_stats_get();
+ * when a thread exits, its counts are folded into the retired
+ * totals. */
+#ifdef ENCJSON_STATS
+_Static_assert(sizeof(json_stats_t) % sizeof(uint64_t) == 0,
+               "json_stats_t must consist of uint64_t counters.");
+
+enum {
+    STATS_COUNT = sizeof(json_stats_t) / sizeof(uint64_t),
+};
+
+#define STAT_INDEX(field) (offsetof(json_stats_t, field) / sizeof(uint64_t))
+
+typedef struct stats_block {
+    struct stats_block *prev, *next;
+    _Atomic uint64_t values[STATS_COUNT];
+} stats_block_t;
+
+static struct {
+    pthread_mutex_t lock;
+    stats_block_t *blocks;
+    uint64_t retired[STATS_COUNT];
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local stats_block_t *thread_stats;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+/* Add up or take the maximum of the counter values. */
+static void fold_stat(uint64_t *total, size_t i, uint64_t value)
 {
-    return thing->type;
+    if (i != STAT_INDEX(max_depth))
+        *total += value;
+    else if (value > *total)
+        *total = value;
 }
 
-long long json_integer_value(json_thing_t *thing)
+static void retire_stats(void *p)
 {
-    assert(thing->type == JSON_INTEGER);
-    return thing->integer.value;
+    stats_block_t *block = p;
+    pthread_mutex_lock(&stats.lock);
+    size_t i;
+    for (i = 0; i < STATS_COUNT; i++)
+        fold_stat(&stats.retired[i], i,
+                  atomic_load_explicit(&block->values[i],
+                                       memory_order_relaxed));
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        stats.blocks = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    pthread_mutex_unlock(&stats.lock);
+    thread_stats = NULL;
+    fs_reallocator_skew(1);
+    fsfree(block);
 }
 
-unsigned long long json_unsigned_value(json_thing_t *thing)
+static void make_stats_key(void)
 {
-    assert(thing->type == JSON_UNSIGNED);
-    return thing->u_integer.value;
+    pthread_key_create(&stats_key, retire_stats);
 }
 
-double json_double_value(json_thing_t *thing)
+static _Atomic uint64_t *stat_counter(size_t i)
 {
-    assert(thing->type == JSON_FLOAT);
-    return thing->real.value;
+    if (!thread_stats) {
+        stats_block_t *block = fsalloc(sizeof *block);
+        fs_reallocator_skew(-1); /* not a leak */
+        size_t j;
+        for (j = 0; j < STATS_COUNT; j++)
+            atomic_init(&block->values[j], 0);
+        pthread_once(&stats_once, make_stats_key);
+        pthread_setspecific(stats_key, block);
+        pthread_mutex_lock(&stats.lock);
+        block->prev = NULL;
+        block->next = stats.blocks;
+        if (stats.blocks)
+            stats.blocks->prev = block;
+        stats.blocks = block;
+        pthread_mutex_unlock(&stats.lock);
+        thread_stats = block;
+    }
+    return &thread_stats->values[i];
 }
 
-bool json_boolean_value(json_thing_t *thing)
+static void stat_add(size_t i, uint64_t n)
 {
-    assert(thing->type == JSON_BOOLEAN);
-    return thing->boolean.value;
+    _Atomic uint64_t *counter = stat_counter(i);
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
 }
 
-const char *json_string_value(json_thing_t *thing)
+static void stat_max(size_t i, uint64_t n)
 {
-    assert(thing->type == JSON_STRING);
-    return thing->string.utf8;
+    _Atomic uint64_t *counter = stat_counter(i);
+    if (n > atomic_load_explicit(counter, memory_order_relaxed))
+        atomic_store_explicit(counter, n, memory_order_relaxed);
 }
 
-size_t json_string_length(json_thing_t *thing)
+static uint64_t stat_clock(void)
 {
-    assert(thing->type == JSON_STRING);
-    return thing->string.len;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
-const char *json_raw_encoding(json_thing_t *thing)
+bool json_stats_get(json_stats_t *result)
 {
-    assert(thing->type == JSON_RAW);
-    return thing->raw.repr;
+    uint64_t totals[STATS_COUNT];
+    pthread_mutex_lock(&stats.lock);
+    memcpy(totals, stats.retired, sizeof totals);
+    stats_block_t *block;
+    size_t i;
+    for (block = stats.blocks; block; block = block->next)
+        for (i = 0; i < STATS_COUNT; i++)
+            fold_stat(&totals[i], i,
+                      atomic_load_explicit(&block->values[i],
+                                           memory_order_relaxed));
+    pthread_mutex_unlock(&stats.lock);
+    memcpy(result, totals, sizeof *result);
+    return true;
 }
 
-json_element_t *json_array_first(json_thing_t *array)
+#define STAT_ADD(field, n) stat_add(STAT_INDEX(field), (n))
+#define STAT_ADD_AT(field, i, n) stat_add(STAT_INDEX(field) + (i), (n))
+#define STAT_MAX(field, n) stat_max(STAT_INDEX(field), (n))
+#define STAT_CLOCK() stat_clock()
+#else
+bool json_stats_get(json_stats_t *result)
 {
-    assert(array->type == JSON_ARRAY);
-    return (json_element_t *) list_get_first(array->array.elements);
+    memset(result, 0, sizeof *result);
+    return false;
 }
 
-json_element_t *json_element_next(json_element_t *element)
+#define STAT_ADD(field, n) ((void) (n))
+#define STAT_ADD_AT(field, i, n) ((void) (i), (void) (n))
+#define STAT_MAX(field, n) ((void) (n))
+#define STAT_CLOCK() ((uint64_t) 0)
+#endif
+
+static void count_node(json_thing_type_t type)
 {
-    return (json_element_t *) list_next((list_elem_t *) element);
+    STAT_ADD_AT(nodes, type, 1);
+    STAT_ADD_AT(node_bytes, type, node_size(type));
 }
 
-json_thing_t *json_element_value(json_element_t *element)
+static void count_encode(size_t size, uint64_t t0)
 {
-    return (json_thing_t *) list_elem_get_value((list_elem_t *) element);
+    STAT_ADD(encode_calls, 1);
+    STAT_ADD(encoded_bytes, size);
+    STAT_ADD(encode_nanoseconds, STAT_CLOCK() - t0);
 }
 
-static void optimize_array(json_thing_t *array)
+static json_thing_t *make_thing(json_thing_type_t type)
 {
-    array->array.lookup_table = fsalloc(list_size(array->array.elements) *
-                                        sizeof array->array.lookup_table[0]);
-    json_element_t *e;
-    size_t i = 0;
-    for (e = json_array_first(array); e; e = json_element_next(e))
-        array->array.lookup_table[i++] = json_element_value(e);
+    count_node(type);
+    json_thing_t *thing = fsalloc(node_size(type));
+    thing->type = type;
+    thing->flags = 0;
+    atomic_init(&thing->shares, 0);
+    return thing;
 }
 
-json_thing_t *json_array_get(json_thing_t *array, unsigned n)
+static void make_arena_chunk(json_arena_t *arena, size_t size)
 {
-    assert(array->type == JSON_ARRAY);
-    if (n >= list_size(array->array.elements))
-        return NULL;
-    if (array->array.lookup_table)
-        return array->array.lookup_table[n];
-    json_element_t *e;
-    unsigned i;
-    if (list_size(array->array.elements) >= JIT_SIZE_LIMIT) {
-        array->array.random_access_counter += n;
-        if (array->array.random_access_counter >= JIT_ACCESS_LIMIT) {
-            optimize_array(array);
-            return json_array_get(array, n);
-        }
+    arena_chunk_t *chunk;
+    if (size == ARENA_CHUNK_SIZE && arena->spares) {
+        chunk = arena->spares;
+        arena->spares = chunk->prev;
+    } else {
+        chunk = fsalloc(sizeof *chunk + size);
+        chunk->size = size;
     }
-    for (e = json_array_first(array), i = 0; i < n;
-         e = json_element_next(e), i++)
-        ;
-    return json_element_value(e);
+    chunk->prev = arena->chunks;
+    arena->chunks = chunk;
+    arena->next = (char *) chunk->data;
+    arena->end = arena->next + size;
 }
 
-bool json_array_get_array(json_thing_t *thing, unsigned n, json_thing_t **value)
+json_arena_t *json_make_arena(void)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_thing_type(field) == JSON_ARRAY) {
-        *value = field;
-        return true;
-    }
-    return false;
+    json_arena_t *arena = fsalloc(sizeof *arena);
+    arena->chunks = arena->spares = NULL;
+    arena->objects = NULL;
+    make_arena_chunk(arena, ARENA_CHUNK_SIZE);
+    return arena;
 }
 
-bool json_array_get_object(json_thing_t *thing, unsigned n,
-                           json_thing_t **value)
+static size_t arena_round(size_t size)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_thing_type(field) == JSON_OBJECT) {
-        *value = field;
-        return true;
-    }
-    return false;
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
 }
 
-bool json_array_get_string(json_thing_t *thing, unsigned n, const char **value)
+static void *arena_alloc(json_arena_t *arena, size_t size)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_thing_type(field) == JSON_STRING) {
-        *value = field->string.utf8;
-        return true;
+    size = arena_round(size);
+    if (size > arena->end - arena->next) {
+        /* A large request gets a chunk of its own so the tail of the
+         * current chunk isn't abandoned needlessly. */
+        if (size > ARENA_CHUNK_SIZE / 4) {
+            char *next = arena->next, *end = arena->end;
+            make_arena_chunk(arena, size);
+            void *ptr = arena->next;
+            arena->next = next;
+            arena->end = end;
+            return ptr;
+        }
+        make_arena_chunk(arena, ARENA_CHUNK_SIZE);
     }
-    return false;
+    void *ptr = arena->next;
+    arena->next += size;
+    return ptr;
 }
 
-bool json_array_get_integer(json_thing_t *thing, unsigned n, long long *value)
+/* The most recent allocation can often be extended in place. */
+static void *arena_realloc(json_arena_t *arena, void *ptr, size_t old_size,
+                           size_t new_size)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_cast_to_integer(field, value))
-        return true;
-    return false;
+    old_size = arena_round(old_size);
+    if (ptr && (char *) ptr + old_size == arena->next &&
+        arena_round(new_size) - old_size <= arena->end - arena->next) {
+        arena->next = (char *) ptr + arena_round(new_size);
+        return ptr;
+    }
+    void *new_ptr = arena_alloc(arena, new_size);
+    if (ptr)
+        memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
 }
 
-bool json_array_get_unsigned(json_thing_t *thing, unsigned n,
-                             unsigned long long *value)
+static void clobber_object(json_thing_t *object);
+
+void json_clear_arena(json_arena_t *arena)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_cast_to_unsigned(field, value))
-        return true;
-    return false;
+    json_thing_t *object;
+    for (object = arena->objects; object; object = object->object.arena_next)
+        clobber_object(object);
+    arena->objects = NULL;
+    while (arena->chunks->prev) {
+        arena_chunk_t *chunk = arena->chunks;
+        arena->chunks = chunk->prev;
+        if (chunk->size == ARENA_CHUNK_SIZE) {
+            chunk->prev = arena->spares;
+            arena->spares = chunk;
+        } else
+            fsfree(chunk);
+    }
+    arena->next = (char *) arena->chunks->data;
+    arena->end = arena->next + ARENA_CHUNK_SIZE;
 }
 
-bool json_array_get_double(json_thing_t *thing, unsigned n, double *value)
+void json_destroy_arena(json_arena_t *arena)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_cast_to_double(field, value))
-        return true;
-    return false;
+    json_clear_arena(arena);
+    fsfree(arena->chunks);
+    while (arena->spares) {
+        arena_chunk_t *chunk = arena->spares;
+        arena->spares = chunk->prev;
+        fsfree(chunk);
+    }
+    fsfree(arena);
 }
 
-bool json_array_get_boolean(json_thing_t *thing, unsigned n, bool *value)
+/* A decoder context keeps released blocks of the fsalloc() heap in
+ * free lists for reuse. The blocks stay ordinary heap blocks, so a
+ * decoding made with a context can be destroyed with
+ * json_destroy_thing(), and a context can take back any decoding. The
+ * size of a released string or vector is not always known exactly,
+ * only that the block is at least as large as its contents need.
+ * Such blocks are therefore released to the largest size class they
+ * are known to fill. */
+enum {
+    POOL_MAX_BLOCKS = 1 << 16,    /* per free list */
+    STRING_POOL_CLASSES = 6,      /* 8, 16, ..., 256 bytes */
+    VECTOR_POOL_CLASSES = 8       /* VECTOR_INITIAL_CAPACITY << 0..7 */
+};
+
+typedef struct {
+    void *head; /* the first word of a free block points to the next */
+    size_t count;
+} pool_t;
+
+struct json_decoder {
+    pool_t nodes[JSON_RAW + 1]; /* by type; see node_size() */
+    pool_t strings[STRING_POOL_CLASSES];
+    pool_t elements[VECTOR_POOL_CLASSES], fields[VECTOR_POOL_CLASSES];
+};
+
+static void *pool_take(pool_t *pool, size_t size)
 {
-    json_thing_t *field = json_array_get(thing, n);
-    if (field && json_thing_type(field) == JSON_BOOLEAN) {
-        *value = field->boolean.value;
-        return true;
+    void *block = pool->head;
+    if (!block)
+        return fsalloc(size);
+    pool->head = *(void **) block;
+    pool->count--;
+    return block;
+}
+
+static void pool_give(pool_t *pool, void *block)
+{
+    if (pool->count == POOL_MAX_BLOCKS) {
+        fsfree(block);
+        return;
     }
-    return false;
+    *(void **) block = pool->head;
+    pool->head = block;
+    pool->count++;
 }
 
-size_t json_array_size(json_thing_t *array)
+static void pool_drain(pool_t *pool)
 {
-    assert(array->type == JSON_ARRAY);
-    return list_size(array->array.elements);
+    while (pool->head) {
+        void *block = pool->head;
+        pool->head = *(void **) block;
+        fsfree(block);
+    }
+    pool->count = 0;
 }
 
-json_field_t *json_object_first(json_thing_t *object)
+static void *take_string(json_decoder_t *pools, size_t size)
 {
-    assert(object->type == JSON_OBJECT);
-    return (json_field_t *) list_get_first(object->object.fields);
+    unsigned k = 0;
+    while (k < STRING_POOL_CLASSES && (size_t) 8 << k < size)
+        k++;
+    if (k == STRING_POOL_CLASSES)
+        return fsalloc(size);
+    return pool_take(&pools->strings[k], (size_t) 8 << k);
 }
 
-json_field_t *json_field_next(json_field_t *field)
+/* Release a block of at least size bytes. */
+static void give_string(json_decoder_t *pools, void *block, size_t size)
 {
-    return (json_field_t *) list_next((list_elem_t *) field);
+    if (!pools || size < 8) {
+        fsfree(block);
+        return;
+    }
+    unsigned k = 0;
+    while (k + 1 < STRING_POOL_CLASSES && (size_t) 16 << k <= size)
+        k++;
+    pool_give(&pools->strings[k], block);
 }
 
-const char *json_field_name(json_field_t *field)
+/* Release a vector with room for capacity entries and the sentinel. */
+static void give_vector(json_decoder_t *pools, pool_t *pool, void *vector,
+                        size_t capacity)
 {
-    return ((pair_t *) list_elem_get_value((list_elem_t *) field))->name;
+    if (!pools || capacity < VECTOR_INITIAL_CAPACITY) {
+        fsfree(vector);
+        return;
+    }
+    unsigned k = 0;
+    while (k + 1 < VECTOR_POOL_CLASSES &&
+           (size_t) VECTOR_INITIAL_CAPACITY << (k + 1) <= capacity)
+        k++;
+    pool_give(&pool[k], vector);
 }
 
-json_thing_t *json_field_value(json_field_t *field)
+/* Make room for one more entry and the sentinel in a vector being
+ * decoded like reserve() does but with blocks from the free lists. */
+static void *take_vector(json_decoder_t *pools, pool_t *pool, void *vector,
+                         size_t count, size_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return vector;
+    size_t new_capacity = *capacity ? 2 * *capacity : VECTOR_INITIAL_CAPACITY;
+    unsigned k = 0;
+    while (k < VECTOR_POOL_CLASSES &&
+           (size_t) VECTOR_INITIAL_CAPACITY << k < new_capacity)
+        k++;
+    if (k == VECTOR_POOL_CLASSES ||
+        (size_t) VECTOR_INITIAL_CAPACITY << k != new_capacity)
+        return vector; /* left for reserve() */
+    void *new_vector = pool_take(&pool[k], (new_capacity + 1) * size);
+    if (count)
+        memcpy(new_vector, vector, count * size);
+    if (vector)
+        give_vector(pools, pool, vector, *capacity);
+    *capacity = new_capacity;
+    return new_vector;
+}
+
+json_decoder_t *json_make_decoder(void)
 {
-    return ((pair_t *) list_elem_get_value((list_elem_t *) field))->value;
+    json_decoder_t *decoder = fsalloc(sizeof *decoder);
+    memset(decoder, 0, sizeof *decoder);
+    return decoder;
 }
 
-static void optimize_object(json_thing_t *object)
+void json_destroy_decoder(json_decoder_t *decoder)
 {
-    object->object.lookup_table =
-        make_hash_table(list_size(object->object.fields),
-                        (uint64_t(*)(const void *)) hash_string,
-                        (int (*)(const void *, const void *)) strcmp);
-    json_field_t *f;
-    for (f = json_object_first(object); f; f = json_field_next(f)) {
-        hash_elem_t *he =
-            hash_table_put(object->object.lookup_table, json_field_name(f),
-                           json_field_value(f));
-        if (he) /* forget conflicting entries */
-            destroy_hash_element(he);
+    unsigned k;
+    for (k = 0; k <= JSON_RAW; k++)
+        pool_drain(&decoder->nodes[k]);
+    for (k = 0; k < STRING_POOL_CLASSES; k++)
+        pool_drain(&decoder->strings[k]);
+    for (k = 0; k < VECTOR_POOL_CLASSES; k++) {
+        pool_drain(&decoder->elements[k]);
+        pool_drain(&decoder->fields[k]);
     }
+    fsfree(decoder);
 }
 
-json_thing_t *json_object_get(json_thing_t *object, const char *key)
+static void *decoder_alloc(decoder_t *dec, size_t size)
 {
-    assert(object->type == JSON_OBJECT);
-    if (object->object.lookup_table) {
-        hash_elem_t *he = hash_table_get(object->object.lookup_table, key);
-        return he ? (json_thing_t *) hash_elem_get_value(he) : NULL;
-    }
-    json_field_t *f;
-    if (list_size(object->object.fields) >= JIT_SIZE_LIMIT)
-        for (f = json_object_first(object); f; f = json_field_next(f)) {
-            if (++object->object.random_access_counter >= JIT_ACCESS_LIMIT) {
-                optimize_object(object);
-                return json_object_get(object, key);
-            }
-            if (!strcmp(key, json_field_name(f)))
-                return json_field_value(f);
-        }
-    else
-        for (f = json_object_first(object); f; f = json_field_next(f))
-            if (!strcmp(key, json_field_name(f)))
-                return json_field_value(f);
-    return NULL;
+    STAT_ADD(string_bytes, size);
+    if (dec->arena)
+        return arena_alloc(dec->arena, size);
+    if (dec->pools)
+        return take_string(dec->pools, size);
+    return fsalloc(size);
 }
 
-json_thing_t *json_object_dig(json_thing_t *thing, const char *const *keys,
-                              size_t num_keys)
+static void decoder_free(decoder_t *dec, void *ptr, size_t size)
 {
-    int i;
-    for (i = 0; i < num_keys; i++) {
-        if (!thing || json_thing_type(thing) != JSON_OBJECT)
-            return NULL;
-        thing = json_object_get(thing, keys[i]);
+    if (!dec->arena)
+        give_string(dec->pools, ptr, size);
+}
+
+static json_thing_t *decoder_make_thing(decoder_t *dec, json_thing_type_t type)
+{
+    if (dec->pools) {
+        count_node(type);
+        json_thing_t *thing =
+            pool_take(&dec->pools->nodes[type], node_size(type));
+        thing->type = type;
+        thing->flags = 0;
+        atomic_init(&thing->shares, 0);
+        return thing;
     }
+    if (!dec->arena)
+        return make_thing(type);
+    count_node(type);
+    json_thing_t *thing = arena_alloc(dec->arena, node_size(type));
+    thing->type = type;
+    thing->flags = THING_IN_ARENA;
+    atomic_init(&thing->shares, 0);
     return thing;
 }
 
-json_thing_t *json_object_fetch_func(json_thing_t *thing, const char *key, ...)
+static json_thing_t *decoder_make_array(decoder_t *dec)
 {
-    va_list ap;
-    va_start(ap, key);
-    while (key) {
-        if (!thing || json_thing_type(thing) != JSON_OBJECT) {
-            va_end(ap);
-            return NULL;
-        }
-        thing = json_object_get(thing, key);
-        key = va_arg(ap, const char *);
-    }
-    va_end(ap);
+    json_thing_t *thing = decoder_make_thing(dec, JSON_ARRAY);
+    thing->array.elements = NULL;
+    thing->array.count = thing->array.capacity = 0;
+    thing->array.link = (tree_link_t) { NULL, 0, 0 };
     return thing;
 }
 
-bool json_object_get_array(json_thing_t *thing, const char *key,
-                           json_thing_t **value)
+static json_thing_t *decoder_make_object(decoder_t *dec)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_thing_type(field) == JSON_ARRAY) {
-        *value = field;
-        return true;
+    json_thing_t *thing = decoder_make_thing(dec, JSON_OBJECT);
+    thing->object.fields = NULL;
+    thing->object.count = thing->object.capacity = 0;
+    thing->object.link = (tree_link_t) { NULL, 0, 0 };
+    thing->object.random_access_counter = 0;
+    thing->object.index = NULL;
+    if (dec->arena) {
+        thing->object.arena_next = dec->arena->objects;
+        dec->arena->objects = thing;
     }
-    return false;
+    return thing;
 }
 
-bool json_object_get_object(json_thing_t *thing, const char *key,
-                            json_thing_t **value)
+/* Make room for one more entry and the sentinel in a vector of
+ * entries of the given size. */
+static void *reserve(json_arena_t *arena, void *vector, size_t count,
+                     size_t *capacity, size_t size)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_thing_type(field) == JSON_OBJECT) {
-        *value = field;
-        return true;
-    }
-    return false;
+    if (count < *capacity)
+        return vector;
+    size_t new_capacity = *capacity ? 2 * *capacity : VECTOR_INITIAL_CAPACITY;
+    if (arena)
+        vector = arena_realloc(arena, vector, (*capacity + 1) * size,
+                               (new_capacity + 1) * size);
+    else
+        vector = fsrealloc(vector, (new_capacity + 1) * size);
+    *capacity = new_capacity;
+    return vector;
 }
 
-bool json_object_get_string(json_thing_t *thing, const char *key,
-                            const char **value)
+static void append_element(json_arena_t *arena, json_thing_t *array,
+                           json_thing_t *element)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_thing_type(field) == JSON_STRING) {
-        *value = field->string.utf8;
-        return true;
+    array->array.elements =
+        reserve(arena, array->array.elements, array->array.count,
+                &array->array.capacity, sizeof array->array.elements[0]);
+    array->array.elements[array->array.count++] = element;
+    array->array.elements[array->array.count] = NULL;
+    adopt(array, element);
+    forget_memos(array);
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(const char *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 0x100000001b3;
     }
-    return false;
+    return h;
 }
 
-bool json_object_get_integer(json_thing_t *thing, const char *key,
-                             long long *value)
+/* FNV-1a, folded to 32 bits */
+static uint32_t hash_name(const char *name, size_t len)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_cast_to_integer(field, value))
-        return true;
-    return false;
+    uint64_t h = hash_bytes(name, len);
+    return h ^ h >> 32;
 }
 
-bool json_object_get_unsigned(json_thing_t *thing, const char *key,
-                              unsigned long long *value)
+static void index_insert(object_index_t *index, const pair_t *fields,
+                         size_t position)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_cast_to_unsigned(field, value))
-        return true;
-    return false;
+    size_t slot = fields[position].hash & index->mask;
+    while (index->slots[slot])
+        slot = (slot + 1) & index->mask;
+    index->slots[slot] = position + 1;
 }
 
-bool json_object_get_double(json_thing_t *thing, const char *key, double *value)
+/* Build an index that is at most half full. Fields are inserted in
+ * order so that, among equal names, the first field is found first. */
+static object_index_t *make_index(const pair_t *fields, size_t count)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_cast_to_double(field, value))
-        return true;
-    return false;
+    size_t size = 16;
+    while (size < 2 * (count + 1))
+        size *= 2;
+    object_index_t *index =
+        fsalloc(sizeof *index + size * sizeof index->slots[0]);
+    index->mask = size - 1;
+    memset(index->slots, 0, size * sizeof index->slots[0]);
+    size_t i;
+    for (i = 0; i < count; i++)
+        index_insert(index, fields, i);
+    return index;
 }
 
-bool json_object_get_boolean(json_thing_t *thing, const char *key, bool *value)
+static void index_object(json_thing_t *object)
 {
-    json_thing_t *field = json_object_get(thing, key);
-    if (field && json_thing_type(field) == JSON_BOOLEAN) {
-        *value = field->boolean.value;
-        return true;
-    }
-    return false;
+    STAT_ADD(index_builds, 1);
+    object_index_t *index =
+        make_index(object->object.fields, object->object.count);
+    fsfree(object->object.index);
+    object->object.index = index;
 }
 
-json_thing_t *json_object_pop(json_thing_t *object, const char *key)
+/* Take the field at the given position out of the index and renumber
+ * the fields after it. The deletion shifts the rest of the probe
+ * sequence back, which preserves the order of equal names. */
+static void index_remove(object_index_t *index, const pair_t *fields,
+                         size_t position)
 {
-    assert(object->type == JSON_OBJECT);
-    clobber_object(object);
-    list_elem_t *e;
-    for (e = list_get_first(object->object.fields); e; e = list_next(e)) {
-        pair_t *f = (pair_t *) list_elem_get_value(e);
-        if (!strcmp(key, f->name)) {
-            fsfree(f->name);
-            json_thing_t *value = f->value;
-            fsfree(f);
-            list_remove(object->object.fields, e);
-            return value;
+    size_t hole = fields[position].hash & index->mask;
+    while (index->slots[hole] != position + 1)
+        hole = (hole + 1) & index->mask;
+    size_t slot = hole;
+    for (;;) {
+        slot = (slot + 1) & index->mask;
+        if (!index->slots[slot])
+            break;
+        size_t home = fields[index->slots[slot] - 1].hash & index->mask;
+        /* can the entry move back to the hole (cyclically)? */
+        if (((slot - home) & index->mask) >= ((slot - hole) & index->mask)) {
+            index->slots[hole] = index->slots[slot];
+            hole = slot;
         }
     }
-    return NULL;
+    index->slots[hole] = 0;
+    for (slot = 0; slot <= index->mask; slot++)
+        if (index->slots[slot] > position + 1)
+            index->slots[slot]--;
 }
 
-static void encode_char(char c, char **q, char *end)
+static void append_field(json_arena_t *arena, json_thing_t *object,
+                         char *key, size_t key_len, unsigned key_flags,
+                         json_thing_t *value)
 {
-    if (*q < end)
-        *(*q)++ = c;
+    assert(object->type == JSON_OBJECT);
+    object->object.fields =
+        reserve(arena, object->object.fields, object->object.count,
+                &object->object.capacity, sizeof object->object.fields[0]);
+    size_t position = object->object.count++;
+    pair_t *f = &object->object.fields[position];
+    f->name = key;
+    f->name_len = key_len;
+    f->value = value;
+    f->hash = hash_name(key, key_len);
+    f->flags = key_flags;
+    object->object.fields[object->object.count].name = NULL;
+    adopt(object, value);
+    forget_memos(object);
+    object_index_t *index = object->object.index;
+    if (index) {
+        if (2 * object->object.count > index->mask)
+            index_object(object);
+        else
+            index_insert(index, object->object.fields, position);
+    }
 }
 
-static size_t encode_repr(const char *repr, char **q, char *end)
+/* Undo a partial decoding in case of an error. Things in an arena are
+ * left for json_clear_arena() to reclaim. */
+static void decoder_discard(decoder_t *dec, json_thing_t *thing)
 {
-    size_t count = 0;
-    while (*repr) {
-        encode_char(*repr++, q, end);
-        count++;
-    }
-    return count;
+    if (dec->pools)
+        json_decoder_release(dec->pools, thing);
+    else if (!dec->arena)
+        json_destroy_thing(thing);
 }
 
-static size_t encode_raw(json_thing_t *thing, char **q, char *end);
-static size_t prettyprint_raw(json_thing_t *thing, char **q, char *end,
-                              unsigned left_margin, unsigned indentation);
+json_thing_t *json_make_raw(const char *encoding)
+{
+    json_thing_t *thing = make_thing(JSON_RAW);
+    thing->raw.repr = charstr_dupstr(encoding);
+    return thing;
+}
 
-static size_t encode_array(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_make_integer(long long n)
 {
-    encode_char('[', q, end);
-    size_t count = 1;
-    json_element_t *e = json_array_first(thing);
-    if (e)
-        for (;;) {
-            count += encode_raw(json_element_value(e), q, end);
-            e = json_element_next(e);
-            if (!e)
-                break;
-            encode_char(',', q, end);
-            count++;
-        }
-    encode_char(']', q, end);
-    count++;
-    return count;
+    json_thing_t *thing = make_thing(JSON_INTEGER);
+    thing->integer.value = n;
+    return thing;
 }
 
-static size_t encode_string_value(const char *value, char **q, char *end)
+json_thing_t *json_make_unsigned(unsigned long long n)
 {
-    encode_char('"', q, end);
-    size_t count = 1;
-    const char *p;
-    for (p = value; *p; p++)
-        if (is_ascii_control_character(*p))
-            switch (*p) {
-                case '\b':
-                    count += encode_repr("\\b", q, end);
-                    break;
-                case '\f':
-                    count += encode_repr("\\f", q, end);
-                    break;
-                case '\n':
-                    count += encode_repr("\\n", q, end);
-                    break;
-                case '\r':
-                    count += encode_repr("\\r", q, end);
-                    break;
-                case '\t':
-                    count += encode_repr("\\t", q, end);
-                    break;
-                default: {
-                    char buf[10];
-                    sprintf(buf, "\\u%04x", *p & 0xff);
-                    count += encode_repr(buf, q, end);
-                }
-            }
-        else if (is_at_latin_control_character(p)) {
-            char buf[10];
-            sprintf(buf, "\\u%04x", (p[0] & 0x1f) << 6 | (p[1] & 0x3f));
-            p++;
-            count += encode_repr(buf, q, end);
-        } else if (*p == '\\' || *p == '"') {
-            encode_char('\\', q, end);
-            encode_char(*p, q, end);
-            count += 2;
-        } else {
-            encode_char(*p, q, end);
-            count++;
-        }
-    encode_char('"', q, end);
-    return count + 1;
+    json_thing_t *thing = make_thing(JSON_UNSIGNED);
+    thing->u_integer.value = n;
+    return thing;
 }
 
-static size_t encode_object(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_make_float(double n)
 {
-    encode_char('{', q, end);
-    size_t count = 1;
-    json_field_t *f = json_object_first(thing);
-    if (f)
-        for (;;) {
-            count += encode_string_value(json_field_name(f), q, end);
-            encode_char(':', q, end);
-            count++;
-            count += encode_raw(json_field_value(f), q, end);
-            f = json_field_next(f);
-            if (!f)
-                break;
-            encode_char(',', q, end);
-            count++;
-        }
-    encode_char('}', q, end);
-    count++;
-    return count;
+    json_thing_t *thing = make_thing(JSON_FLOAT);
+    thing->real.value = n;
+    return thing;
 }
 
-static size_t encode_string(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_make_boolean(bool truth_value)
 {
-    return encode_string_value(thing->string.utf8, q, end);
+    return truth_value ? &json_true : &json_false;
 }
 
-static size_t encode_integer(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_make_null(void)
 {
-    char buf[4 * sizeof thing->integer.value];
-    sprintf(buf, "%lld", thing->integer.value);
-    return encode_repr(buf, q, end);
+    return &json_null;
 }
 
-static size_t encode_unsigned(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_adopt_bounded_string(char *s, size_t size)
 {
-    char buf[4 * sizeof thing->u_integer.value];
-    sprintf(buf, "%llu", thing->u_integer.value);
-    return encode_repr(buf, q, end);
+    assert(charstr_valid_utf8_bounded(s, s + size));
+    json_thing_t *thing = make_thing(JSON_STRING);
+    thing->string.utf8 = s;
+    thing->string.len = size;
+    return thing;
 }
 
-static size_t encode_float(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_adopt_string(char *s)
 {
-    char buf[BINARY64_MAX_FORMAT_SPACE];
-    bin64_t value = { .f = thing->real.value };
-    (void) binary64_format(value.i, buf);
-    return encode_repr(buf, q, end);
+    return json_adopt_bounded_string(s, strlen(s));
 }
 
-static size_t encode_raw(json_thing_t *thing, char **q, char *end)
+json_thing_t *json_make_bounded_string(const char *s, size_t size)
 {
-    switch (thing->type) {
-        case JSON_ARRAY:
-            return encode_array(thing, q, end);
-        case JSON_OBJECT:
-            return encode_object(thing, q, end);
-        case JSON_STRING:
-            return encode_string(thing, q, end);
-        case JSON_INTEGER:
-            return encode_integer(thing, q, end);
-        case JSON_UNSIGNED:
-            return encode_unsigned(thing, q, end);
-        case JSON_FLOAT:
-            return encode_float(thing, q, end);
-        case JSON_BOOLEAN:
-            return encode_repr(thing->boolean.value ? "true" : "false", q, end);
-        case JSON_NULL:
-            return encode_repr("null", q, end);
-        case JSON_RAW:
-            return encode_repr(thing->raw.repr, q, end);
-        default:
-            abort();
+    if (size <= INLINE_STRING_MAX) {
+        assert(charstr_valid_utf8_bounded(s, s + size));
+        json_thing_t *thing = make_thing(JSON_STRING);
+        thing->flags = THING_INLINE;
+        thing->short_len = size;
+        memcpy(thing->short_string, s, size);
+        thing->short_string[size] = '\0';
+        return thing;
     }
+    char *dup = fsalloc(size + 1);
+    memcpy(dup, s, size);
+    dup[size] = '\0';
+    return json_adopt_bounded_string(dup, size);
 }
 
-size_t json_utf8_encode(json_thing_t *thing, void *buffer, size_t size)
+json_thing_t *json_make_string(const char *s)
 {
-    char *q = buffer;
-    if (!size)
-        return encode_raw(thing, &q, q);
-    size_t count = encode_raw(thing, &q, q + size - 1);
-    *q = '\0';
-    return count;
+    return json_make_bounded_string(s, strlen(s));
 }
 
-static void indent(char **q, char *end, unsigned left_margin)
+json_thing_t *json_make_array(void)
 {
-    while (left_margin--)
-        encode_char(' ', q, end);
+    json_thing_t *thing = make_thing(JSON_ARRAY);
+    thing->array.elements = NULL;
+    thing->array.count = thing->array.capacity = 0;
+    thing->array.link = (tree_link_t) { NULL, 0, 0 };
+    return thing;
 }
 
-static size_t prettyprint_array(json_thing_t *thing, char **q, char *end,
-                                unsigned left_margin, unsigned indentation)
+json_thing_t *json_add_to_array(json_thing_t *array, json_thing_t *element)
 {
-    encode_char('[', q, end);
-    size_t count = 1;
-    json_element_t *e = json_array_first(thing);
-    if (e) {
-        unsigned deeper = left_margin + indentation;
-        for (;;) {
-            encode_char('\n', q, end);
-            indent(q, end, deeper);
-            count += deeper + 1;
-            count += prettyprint_raw(json_element_value(e), q, end, deeper,
-                                     indentation);
-            e = json_element_next(e);
-            if (!e)
-                break;
-            encode_char(',', q, end);
-            count++;
-        }
-        encode_char('\n', q, end);
-        indent(q, end, left_margin);
-        count += left_margin + 1;
-    }
-    encode_char(']', q, end);
-    count++;
-    return count;
+    assert(array->type == JSON_ARRAY);
+    assert(!(array->flags & (THING_IN_ARENA | THING_FROZEN)));
+    assert(!shared(array));
+    append_element(NULL, expand(array), element);
+    return array;
 }
 
-static size_t prettyprint_object(json_thing_t *thing, char **q, char *end,
-                                 unsigned left_margin, unsigned indentation)
+static json_thing_t *make_number(const number_t *number)
 {
-    encode_char('{', q, end);
-    size_t count = 1;
-    json_field_t *f = json_object_first(thing);
-    if (f) {
-        unsigned deeper = left_margin + indentation;
-        for (;;) {
-            encode_char('\n', q, end);
-            indent(q, end, deeper);
-            count += deeper + 1;
-            count += encode_string_value(json_field_name(f), q, end);
-            encode_char(':', q, end);
-            encode_char(' ', q, end);
-            count += 2;
-            count += prettyprint_raw(json_field_value(f), q, end, deeper,
-                                     indentation);
-            f = json_field_next(f);
-            if (!f)
-                break;
-            encode_char(',', q, end);
-            count++;
-        }
-        encode_char('\n', q, end);
-        indent(q, end, left_margin);
-        count += left_margin + 1;
+    switch (number->type) {
+        case JSON_INTEGER:
+            return json_make_integer(number->integer);
+        case JSON_UNSIGNED:
+            return json_make_unsigned(number->u_integer);
+        default:
+            return json_make_float(number->real);
     }
-    encode_char('}', q, end);
-    count++;
-    return count;
 }
 
-static size_t prettyprint_raw(json_thing_t *thing, char **q, char *end,
-                              unsigned left_margin, unsigned indentation)
+static double number_value(const number_t *number)
 {
-    switch (thing->type) {
-        case JSON_ARRAY:
-            return prettyprint_array(thing, q, end, left_margin, indentation);
-        case JSON_OBJECT:
-            return prettyprint_object(thing, q, end, left_margin, indentation);
-        case JSON_STRING:
-            return encode_string(thing, q, end);
+    switch (number->type) {
         case JSON_INTEGER:
-            return encode_integer(thing, q, end);
+            return number->integer;
         case JSON_UNSIGNED:
-            return encode_unsigned(thing, q, end);
-        case JSON_FLOAT:
-            return encode_float(thing, q, end);
-        case JSON_BOOLEAN:
-            return encode_repr(thing->boolean.value ? "true" : "false", q, end);
-        case JSON_NULL:
-            return encode_repr("null", q, end);
-        case JSON_RAW:
-            return encode_repr(thing->raw.repr, q, end);
+            return number->u_integer;
         default:
-            abort();
+            return number->real;
     }
 }
 
-size_t json_utf8_prettyprint(json_thing_t *thing, void *buffer, size_t size,
-                             unsigned left_margin, unsigned indentation)
+/* Give a packed array element nodes. Its remembered length and hash
+ * stay valid since the elements do not change. */
+static void unpack(json_thing_t *array)
 {
-    char *q = buffer;
-    if (!size)
-        return prettyprint_raw(thing, &q, q, left_margin, indentation);
-    size_t count =
-        prettyprint_raw(thing, &q, q + size - 1, left_margin, indentation);
-    *q = '\0';
-    return count;
+    number_t *numbers = array->array.numbers;
+    size_t count = array->array.count;
+    json_thing_t **elements = fsalloc((count + 1) * sizeof elements[0]);
+    size_t i;
+    for (i = 0; i < count; i++)
+        elements[i] = make_number(&numbers[i]);
+    elements[count] = NULL;
+    fsfree(numbers);
+    array->array.elements = elements;
+    array->array.capacity = count;
+    array->flags &= ~THING_PACKED;
 }
 
-static const char *skip_ws(const char *p, const char *end)
+static json_thing_t *copy_packed(json_thing_t *array)
 {
-    if (!p)
-        return p;
-    while (p < end)
-        switch (*p) {
-            case ' ':
-            case '\t':
-            case '\r':
-            case '\n':
-                p++;
-                break;
-            default:
-                return p;
-        }
-    return p;
+    json_thing_t *copy = json_make_array();
+    size_t size = array->array.count * sizeof array->array.numbers[0];
+    copy->flags |= THING_PACKED;
+    copy->array.numbers = fsalloc(size);
+    memcpy(copy->array.numbers, array->array.numbers, size);
+    copy->array.count = copy->array.capacity = array->array.count;
+    set_known_size(copy, known_size(array));
+    set_known_hash(copy, known_hash(array));
+    return copy;
 }
 
-static const char *skip(const char *p, const char *end, char c)
+json_thing_t *json_make_object(void)
 {
-    if (!p || exhausted(p, end))
-        return NULL;
-    if (*p != c) {
-        json_error();
-        return NULL;
-    }
-    return p + 1;
+    json_thing_t *thing = make_thing(JSON_OBJECT);
+    thing->object.fields = NULL;
+    thing->object.count = thing->object.capacity = 0;
+    thing->object.link = (tree_link_t) { NULL, 0, 0 };
+    thing->object.random_access_counter = 0;
+    thing->object.index = NULL;
+    return thing;
 }
 
-static const char *decode_array(const char *p, const char *end,
-                                json_thing_t **thing, unsigned levels)
+static void clobber_object(json_thing_t *object)
 {
-    json_thing_t *array;
-    *thing = array = json_make_array();
-    p = skip_ws(skip(p, end, '['), end);
-    if (!p || exhausted(p, end)) {
-        json_destroy_thing(array);
-        return NULL;
+    if (!object->object.index)
+        return;
+    fsfree(object->object.index);
+    object->object.random_access_counter = 0;
+    object->object.index = NULL;
+}
+
+json_thing_t *json_add_to_object(json_thing_t *object, const char *field,
+                                 json_thing_t *value)
+{
+    assert(!(object->flags & (THING_IN_ARENA | THING_FROZEN)));
+    assert(!shared(object));
+    append_field(NULL, expand(object), charstr_dupstr(field), strlen(field), 0,
+                 value);
+    return object;
+}
+
+/* Drop a reference to the thing. Return true if it was the last one.
+ * Only a holder of a reference can add another, so a thing that is
+ * not shared cannot become shared behind our back. */
+static bool release(json_thing_t *thing)
+{
+    return !shared(thing) ||
+        !atomic_fetch_sub_explicit(&thing->shares, 1, memory_order_acq_rel);
+}
+
+/* Release the thing itself but not the elements or values in it,
+ * keeping the memory in the decoder context if given. */
+static void destroy_node(json_thing_t *thing, json_decoder_t *pools)
+{
+    if (thing->flags & THING_LAZY) {
+        fsfree(thing);
+        return;
     }
-    if (*p == ']') {
-        p = skip(p, end, ']');
-        if (!p) {
-            json_destroy_thing(array);
-            return NULL;
-        }
-        return p;
+    switch (thing->type) {
+        case JSON_ARRAY:
+            if (thing->flags & THING_PACKED)
+                fsfree(thing->array.numbers);
+            else
+                give_vector(pools, pools ? pools->elements : NULL,
+                            thing->array.elements, thing->array.capacity);
+            break;
+        case JSON_OBJECT:
+            clobber_object(thing);
+            give_vector(pools, pools ? pools->fields : NULL,
+                        thing->object.fields, thing->object.capacity);
+            break;
+        case JSON_STRING:
+            /* an adopted string may lack the NUL terminator */
+            if (!(thing->flags & (THING_BORROWED | THING_INLINE)))
+                give_string(pools, thing->string.utf8, thing->string.len);
+            break;
+        case JSON_INTEGER:
+        case JSON_UNSIGNED:
+        case JSON_FLOAT:
+        case JSON_BOOLEAN:
+        case JSON_NULL:
+            break;
+        case JSON_RAW:
+            fsfree(thing->raw.repr);
+            break;
+        default:
+            assert(0);
     }
-    for (;;) {
-        json_thing_t *element;
-        p = decode(p, end, &element, levels - 1);
-        if (!p) {
-            json_destroy_thing(array);
-            return NULL;
-        }
-        if (!json_add_to_array(array, element)) {
-            json_destroy_thing(array);
-            json_destroy_thing(element);
-            return NULL;
-        }
-        p = skip_ws(p, end);
-        if (!p || exhausted(p, end)) {
-            json_destroy_thing(array);
-            return NULL;
-        }
-        if (*p == ']') {
-            p = skip(p, end, ']');
-            if (!p) {
-                json_destroy_thing(array);
-                return NULL;
+    if (pools)
+        pool_give(&pools->nodes[thing->type], thing);
+    else
+        fsfree(thing);
+}
+
+static bool has_children(json_thing_t *thing)
+{
+    return !(thing->flags & (THING_LAZY | THING_PACKED)) &&
+        (thing->type == JSON_ARRAY || thing->type == JSON_OBJECT);
+}
+
+/* The tree is released without recursion, each container after its
+ * contents. Things that are shared (see json_share()) are left for
+ * their last holder to release. */
+static void destroy_tree(json_thing_t *thing, json_decoder_t *pools)
+{
+    if (thing->flags & THING_STATIC)
+        return;
+    assert(!(thing->flags & (THING_IN_ARENA | THING_FROZEN)));
+    if (!release(thing))
+        return;
+    if (!has_children(thing)) {
+        destroy_node(thing, pools);
+        return;
+    }
+    work_stack_t stack;
+    stack_init(&stack, sizeof(walk_frame_t));
+    *(walk_frame_t *) stack_push(&stack) = (walk_frame_t) { thing, 0 };
+    while (stack.depth) {
+        walk_frame_t *frame = stack_top(&stack);
+        json_thing_t *container = frame->container;
+        json_thing_t *child;
+        if (container->type == JSON_ARRAY) {
+            if (frame->next == container->array.count) {
+                destroy_node(container, pools);
+                stack_pop(&stack);
+                continue;
             }
-            return p;
-        }
-        p = skip_ws(skip(p, end, ','), end);
-        if (!p) {
-            json_destroy_thing(array);
-            return NULL;
+            child = container->array.elements[frame->next++];
+        } else {
+            if (frame->next == container->object.count) {
+                destroy_node(container, pools);
+                stack_pop(&stack);
+                continue;
+            }
+            pair_t *f = &container->object.fields[frame->next++];
+            if (!(f->flags & THING_BORROWED))
+                give_string(pools, f->name, f->name_len + 1);
+            child = f->value;
         }
+        if (child->flags & THING_STATIC || !release(child))
+            continue;
+        if (has_children(child))
+            *(walk_frame_t *) stack_push(&stack) = (walk_frame_t) { child, 0 };
+        else
+            destroy_node(child, pools);
     }
+    stack_release(&stack);
 }
 
-static const char *decode_object(const char *p, const char *end,
-                                 json_thing_t **thing, unsigned levels)
+void json_destroy_thing(json_thing_t *thing)
 {
-    json_thing_t *object;
-    *thing = object = json_make_object();
-    p = skip_ws(skip(p, end, '{'), end);
-    if (!p || exhausted(p, end)) {
-        json_destroy_thing(object);
-        return NULL;
+    destroy_tree(thing, NULL);
+}
+
+void json_decoder_release(json_decoder_t *decoder, json_thing_t *thing)
+{
+    destroy_tree(thing, decoder);
+}
+
+/* Return a NUL-terminated copy of a field name. */
+static char *copy_name(const char *name, size_t len)
+{
+    char *copy = fsalloc(len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* Copy the thing but not the elements or values in it. */
+static json_thing_t *clone_node(json_thing_t *thing)
+{
+    switch (thing->type) {
+        case JSON_ARRAY:
+            if (thing->flags & THING_PACKED)
+                return copy_packed(thing);
+            return json_make_array();
+        case JSON_OBJECT:
+            return json_make_object();
+        case JSON_STRING:
+            return json_make_bounded_string(string_utf8(thing),
+                                            string_len(thing));
+        case JSON_INTEGER:
+            return json_make_integer(thing->integer.value);
+        case JSON_UNSIGNED:
+            return json_make_unsigned(thing->u_integer.value);
+        case JSON_FLOAT:
+            return json_make_float(thing->real.value);
+        case JSON_BOOLEAN:
+            return json_make_boolean(thing->boolean.value);
+        case JSON_NULL:
+            return json_make_null();
+        case JSON_RAW:
+            return json_make_raw(raw_repr(thing));
+        default:
+            abort();
     }
-    if (*p == '}') {
-        p = skip(p, end, '}');
-        if (!p) {
-            json_destroy_thing(object);
-            return NULL;
+}
+
+/* An array or object being cloned: the original, the copy and the
+ * position of the next element or field to copy. */
+typedef struct {
+    json_thing_t *original, *copy;
+    size_t next;
+} clone_frame_t;
+
+json_thing_t *json_clone(json_thing_t *thing)
+{
+    json_thing_t *root = clone_node(thing);
+    if (!has_children(root))
+        return root;
+    work_stack_t stack;
+    stack_init(&stack, sizeof(clone_frame_t));
+    *(clone_frame_t *) stack_push(&stack) =
+        (clone_frame_t) { expand(thing), root, 0 };
+    while (stack.depth) {
+        clone_frame_t *frame = stack_top(&stack);
+        json_thing_t *original = frame->original;
+        json_thing_t *child, *child_copy;
+        if (original->type == JSON_ARRAY) {
+            if (frame->next == original->array.count) {
+                stack_pop(&stack);
+                continue;
+            }
+            child = element_at(original, frame->next++);
+            child_copy = clone_node(child);
+            append_element(NULL, frame->copy, child_copy);
+        } else {
+            if (frame->next == original->object.count) {
+                stack_pop(&stack);
+                continue;
+            }
+            pair_t f = field_at(original, frame->next++);
+            child = f.value;
+            child_copy = clone_node(child);
+            append_field(NULL, frame->copy, copy_name(f.name, f.name_len),
+                         f.name_len, 0, child_copy);
         }
-        return p;
+        if (has_children(child_copy))
+            *(clone_frame_t *) stack_push(&stack) =
+                (clone_frame_t) { expand(child), child_copy, 0 };
     }
-    for (;;) {
-        char *key;
-        size_t len;
-        p = decode_string_value(p, end, &key, &len);
-        if (!p) {
-            json_destroy_thing(object);
-            return NULL;
-        }
-        p = skip_ws(skip(skip_ws(p, end), end, ':'), end);
-        json_thing_t *value;
-        p = decode(p, end, &value, levels - 1);
-        if (!p) {
-            json_destroy_thing(object);
-            fsfree(key);
-            return NULL;
-        }
-        add_to_object(object, key, value);
-        p = skip_ws(p, end);
-        if (!p || exhausted(p, end)) {
-            json_destroy_thing(object);
-            return NULL;
+    stack_release(&stack);
+    return root;
+}
+
+/* Structural sharing. A thing that is referred to from more than one
+ * place is never modified. Instead, when a shared array or object is
+ * about to be handed out of an array or object, it is replaced there
+ * with a private copy of its top level, which refers to the things
+ * in the original in turn. Arrays and objects that may contain shared
+ * arrays or objects are marked THING_SHALLOW.
+ *
+ * A shared array or object has no parent. It gets one again when it
+ * is handed out after the other references are gone.
+ *
+ * Lazy arrays and objects are not shared since expanding them
+ * modifies them; each reference gets a lazy node of its own. The same
+ * goes for packed arrays. */
+
+static json_thing_t *copy_lazy(json_thing_t *thing)
+{
+    json_thing_t *copy = make_thing(thing->type);
+    copy->flags = thing->flags;
+    *link_of(copy) = (tree_link_t) { NULL, 0, 0 };
+    copy->lazy = thing->lazy;
+    return copy;
+}
+
+/* Return another reference to the thing for the container. */
+static json_thing_t *refer(json_thing_t *container, json_thing_t *thing)
+{
+    assert(!(thing->flags & (THING_IN_ARENA | THING_FROZEN)));
+    if (thing->flags & THING_STATIC)
+        return thing;
+    if (thing->flags & (THING_LAZY | THING_PACKED)) {
+        json_thing_t *copy = thing->flags & THING_LAZY ? copy_lazy(thing)
+                                                       : copy_packed(thing);
+        adopt(container, copy);
+        return copy;
+    }
+    /* Seeing no shares means every other holder has released the
+     * thing; acquire their releases before taking over the link. */
+    if (!atomic_fetch_add_explicit(&thing->shares, 1, memory_order_acquire) &&
+        is_container(thing))
+        link_of(thing)->parent = NULL;
+    return thing;
+}
+
+/* Copy an array or object, referring to the things in it. The copy
+ * has no parent. */
+static json_thing_t *copy_top(json_thing_t *thing)
+{
+    json_thing_t *copy;
+    size_t i, count;
+    if (thing->type == JSON_ARRAY) {
+        copy = json_make_array();
+        count = thing->array.count;
+        if (count) {
+            copy->array.elements =
+                fsalloc((count + 1) * sizeof copy->array.elements[0]);
+            for (i = 0; i < count; i++)
+                copy->array.elements[i] =
+                    refer(copy, thing->array.elements[i]);
+            copy->array.elements[count] = NULL;
+            copy->array.count = copy->array.capacity = count;
         }
-        if (*p == '}') {
-            p = skip(p, end, '}');
-            if (!p) {
-                json_destroy_thing(object);
-                return NULL;
+    } else {
+        copy = json_make_object();
+        count = thing->object.count;
+        if (count) {
+            copy->object.fields =
+                fsalloc((count + 1) * sizeof copy->object.fields[0]);
+            for (i = 0; i < count; i++) {
+                pair_t *f = &thing->object.fields[i];
+                copy->object.fields[i] = *f;
+                if (!(f->flags & THING_BORROWED))
+                    copy->object.fields[i].name =
+                        copy_name(f->name, f->name_len);
+                copy->object.fields[i].value = refer(copy, f->value);
             }
-            return p;
-        }
-        p = skip_ws(skip(p, end, ','), end);
-        if (!p) {
-            json_destroy_thing(object);
-            return NULL;
+            copy->object.fields[count].name = NULL;
+            copy->object.count = copy->object.capacity = count;
         }
     }
+    if (count)
+        copy->flags |= THING_SHALLOW;
+    set_known_size(copy, known_size(thing));
+    set_known_hash(copy, known_hash(thing));
+    return copy;
 }
 
-static const char *scan_hex_digit(const char *p, const char *end, int *digit)
+/* Make the array or object in a slot of the container private to the
+ * container. */
+static json_thing_t *unshare(json_thing_t *container, json_thing_t **slot)
 {
-    if (!p || exhausted(p, end)) {
-        *digit = -1; /* don't-care to avoid compiler warnings */
-        return NULL;
-    }
-    *digit = charstr_digit_value(*p);
-    if (*digit == -1) {
-        json_error();
-        return NULL;
+    json_thing_t *thing = *slot;
+    if (!is_container(thing))
+        return thing;
+    if (shared(thing)) {
+        *slot = copy_top(thing);
+        json_destroy_thing(thing); /* drops our reference */
+    } else {
+        /* It is ours now, but it may have been copied while it was
+         * shared, in which case the things in it are shared. */
+        thing->flags |= THING_SHALLOW;
     }
-    return skip(p, end, *p);
+    adopt(container, *slot);
+    /* meanwhile, expanding something lazy inside it may have made its
+     * length or hash unknown */
+    if (!known_size(*slot) || !known_hash(*slot))
+        forget_memos(container);
+    return *slot;
 }
 
-static const char *scan_ucs2(const char *p, const char *end, int *value)
+/* Return the thing in a slot of the container, which is about to be
+ * handed out. */
+static json_thing_t *hand_out(json_thing_t *container, json_thing_t **slot)
 {
-    int d0, d1, d2, d3;
-    p = scan_hex_digit(p, end, &d0);
-    p = scan_hex_digit(p, end, &d1);
-    p = scan_hex_digit(p, end, &d2);
-    p = scan_hex_digit(p, end, &d3);
-    *value = d0 << 12 | d1 << 8 | d2 << 4 | d3;
-    return p;
+    if (container->flags & THING_SHALLOW)
+        return unshare(container, slot);
+    return *slot;
 }
 
-static bool high_surrogate(int ucs2)
+static json_thing_t *hand_out_element(json_thing_t *array, size_t i)
 {
-    return ucs2 >= 0xd800 && ucs2 <= 0xdbff;
+    if (array->flags & THING_FROZEN)
+        return element_at(array, i);
+    return hand_out(array, &array->array.elements[i]);
 }
 
-static bool low_surrogate(int ucs2)
+/* Make sure an array or object is decoded and that the things in it
+ * can be handed out one by one. */
+static json_thing_t *claim(json_thing_t *thing)
 {
-    return ucs2 >= 0xdc00 && ucs2 <= 0xdfff;
+    expand(thing);
+    if (!(thing->flags & THING_SHALLOW))
+        return thing;
+    size_t i;
+    if (thing->type == JSON_ARRAY)
+        for (i = 0; i < thing->array.count; i++)
+            unshare(thing, &thing->array.elements[i]);
+    else
+        for (i = 0; i < thing->object.count; i++)
+            unshare(thing, &thing->object.fields[i].value);
+    thing->flags &= ~THING_SHALLOW;
+    return thing;
 }
 
-static bool valid_unicode(int unic)
+json_thing_t *json_share(json_thing_t *thing)
 {
-    return (unic >= 0 && unic <= 0xd7ff) ||
-        (unic >= 0xe000 && unic <= 0x10ffff);
+    assert(!(thing->flags & (THING_IN_ARENA | THING_FROZEN)));
+    assert(!shared(thing));
+    if (!is_container(thing) || thing->flags & THING_PACKED)
+        return json_clone(thing);
+    json_thing_t *copy = copy_top(expand(thing));
+    if (copy->flags & THING_SHALLOW)
+        thing->flags |= THING_SHALLOW;
+    return copy;
 }
 
-static size_t utf8_length(int unic)
+json_thing_type_t json_thing_type(json_thing_t *thing)
 {
-    if (unic < 0x80)
-        return 1;
-    if (unic < 0x800)
-        return 2;
-    if (unic < 0x10000)
-        return 3;
-    return 4;
+    return thing->type;
 }
 
-static char *utf8_encode(char *q, int unic)
+long long json_integer_value(json_thing_t *thing)
 {
-    if (unic < 0x80)
-        *q++ = unic;
-    else if (unic < 0x800) {
-        *q++ = 0xc0 | unic >> 6;
-        *q++ = 0x80 | (unic & 0x3f);
-    } else if (unic < 0x10000) {
-        *q++ = 0xe0 | unic >> 12;
-        *q++ = 0x80 | (unic >> 6 & 0x3f);
-        *q++ = 0x80 | (unic & 0x3f);
-    } else {
-        *q++ = 0xf0 | unic >> 18;
-        *q++ = 0x80 | (unic >> 12 & 0x3f);
-        *q++ = 0x80 | (unic >> 6 & 0x3f);
-        *q++ = 0x80 | (unic & 0x3f);
-    }
-    return q;
+    assert(thing->type == JSON_INTEGER);
+    return thing->integer.value;
 }
 
-static const char *scan_utf16(const char *p, const char *end, int *value)
+unsigned long long json_unsigned_value(json_thing_t *thing)
 {
-    /* Scanning begins after the initial \u */
-    int ucs2;
-    p = scan_ucs2(p, end, &ucs2);
-    if (!p)
-        return NULL;
-    if (low_surrogate(ucs2)) {
-        json_error();
-        return NULL;
-    }
-    if (!high_surrogate(ucs2)) {
-        *value = ucs2;
-        return p;
-    }
-    p = skip(p, end, '\\');
-    p = skip(p, end, 'u');
-    int low;
-    p = scan_ucs2(p, end, &low);
-    if (!p)
-        return NULL;
-    if (!low_surrogate(low)) {
-        json_error();
-        return NULL;
-    }
-    *value = 0x10000 + ((ucs2 - 0xd800) << 10 | (low - 0xdc00));
-    if (!valid_unicode(*value)) {
-        json_error();
-        return NULL;
-    }
-    return p;
+    assert(thing->type == JSON_UNSIGNED);
+    return thing->u_integer.value;
 }
 
-static const char *skip_utf8(const char *p, const char *end)
+double json_double_value(json_thing_t *thing)
 {
-    if (!p || exhausted(p, end))
-        return NULL;
-    char c0 = *p;
-    p = skip(p, end, *p);
-    if (!(c0 & 0x80))
-        return p;
-    if (!(c0 & 0x40)) {
-        json_error();
+    assert(thing->type == JSON_FLOAT);
+    return thing->real.value;
+}
+
+bool json_boolean_value(json_thing_t *thing)
+{
+    assert(thing->type == JSON_BOOLEAN);
+    return thing->boolean.value;
+}
+
+const char *json_string_value(json_thing_t *thing)
+{
+    assert(thing->type == JSON_STRING);
+    return string_utf8(thing);
+}
+
+size_t json_string_length(json_thing_t *thing)
+{
+    assert(thing->type == JSON_STRING);
+    return string_len(thing);
+}
+
+const char *json_raw_encoding(json_thing_t *thing)
+{
+    assert(thing->type == JSON_RAW);
+    return raw_repr(thing);
+}
+
+json_element_t *json_array_first(json_thing_t *array)
+{
+    assert(array->type == JSON_ARRAY);
+    claim(array);
+    if (!array->array.count)
+        return NULL;
+    if (array->flags & THING_FROZEN)
+        return (json_element_t *) ((uintptr_t) follow(&array->frozen.items) |
+                                   FROZEN_HANDLE);
+    return (json_element_t *) array->array.elements;
+}
+
+json_element_t *json_element_next(json_element_t *element)
+{
+    if ((uintptr_t) element & FROZEN_HANDLE) {
+        int64_t *slot = (int64_t *) ((uintptr_t) element & ~FROZEN_HANDLE) + 1;
+        return *slot ? (json_element_t *) ((uintptr_t) slot | FROZEN_HANDLE)
+                     : NULL;
+    }
+    json_thing_t **slot = (json_thing_t **) element + 1;
+    return *slot ? (json_element_t *) slot : NULL;
+}
+
+json_thing_t *json_element_value(json_element_t *element)
+{
+    if ((uintptr_t) element & FROZEN_HANDLE)
+        return follow((int64_t *) ((uintptr_t) element & ~FROZEN_HANDLE));
+    return *(json_thing_t **) element;
+}
+
+json_thing_t *json_array_get(json_thing_t *array, unsigned n)
+{
+    assert(array->type == JSON_ARRAY);
+    expand(array);
+    if (n >= array->array.count)
+        return NULL;
+    return hand_out_element(array, n);
+}
+
+bool json_array_get_array(json_thing_t *thing, unsigned n, json_thing_t **value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_thing_type(field) == JSON_ARRAY) {
+        *value = field;
+        return true;
+    }
+    return false;
+}
+
+bool json_array_get_object(json_thing_t *thing, unsigned n,
+                           json_thing_t **value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_thing_type(field) == JSON_OBJECT) {
+        *value = field;
+        return true;
+    }
+    return false;
+}
+
+bool json_array_get_string(json_thing_t *thing, unsigned n, const char **value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_thing_type(field) == JSON_STRING) {
+        *value = string_utf8(field);
+        return true;
+    }
+    return false;
+}
+
+bool json_array_get_integer(json_thing_t *thing, unsigned n, long long *value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_cast_to_integer(field, value))
+        return true;
+    return false;
+}
+
+bool json_array_get_unsigned(json_thing_t *thing, unsigned n,
+                             unsigned long long *value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_cast_to_unsigned(field, value))
+        return true;
+    return false;
+}
+
+bool json_array_get_double(json_thing_t *thing, unsigned n, double *value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_cast_to_double(field, value))
+        return true;
+    return false;
+}
+
+bool json_array_get_boolean(json_thing_t *thing, unsigned n, bool *value)
+{
+    json_thing_t *field = json_array_get(thing, n);
+    if (field && json_thing_type(field) == JSON_BOOLEAN) {
+        *value = field->boolean.value;
+        return true;
+    }
+    return false;
+}
+
+size_t json_array_size(json_thing_t *array)
+{
+    assert(array->type == JSON_ARRAY);
+    decoded(array);
+    return array->array.count;
+}
+
+/* Return the element at the given position for a bulk cast. A number
+ * in a packed array is put in a scratch node. */
+static json_thing_t *number_at(json_thing_t *array, size_t i,
+                               json_thing_t *scratch)
+{
+    if (!(array->flags & THING_PACKED))
+        return element_at(array, i);
+    const number_t *number = &array->array.numbers[i];
+    scratch->type = number->type;
+    switch (number->type) {
+        case JSON_INTEGER:
+            scratch->integer.value = number->integer;
+            break;
+        case JSON_UNSIGNED:
+            scratch->u_integer.value = number->u_integer;
+            break;
+        default:
+            scratch->real.value = number->real;
+    }
+    return scratch;
+}
+
+static size_t bulk_count(json_thing_t *array, size_t count)
+{
+    assert(array->type == JSON_ARRAY);
+    decoded(array);
+    return count < array->array.count ? count : array->array.count;
+}
+
+size_t json_array_to_doubles(json_thing_t *array, double *values,
+                             size_t count)
+{
+    size_t n = bulk_count(array, count), i;
+    if (array->flags & THING_PACKED) {
+        /* any number can be cast to a double */
+        for (i = 0; i < n; i++)
+            values[i] = number_value(&array->array.numbers[i]);
+        return n;
+    }
+    for (i = 0; i < n; i++)
+        if (!json_cast_to_double(element_at(array, i), &values[i]))
+            break;
+    return i;
+}
+
+size_t json_array_to_int64s(json_thing_t *array, int64_t *values,
+                            size_t count)
+{
+    size_t n = bulk_count(array, count), i;
+    json_thing_t scratch;
+    for (i = 0; i < n; i++) {
+        long long value;
+        if (!json_cast_to_integer(number_at(array, i, &scratch), &value))
+            break;
+        values[i] = value;
+    }
+    return i;
+}
+
+size_t json_array_to_uint64s(json_thing_t *array, uint64_t *values,
+                             size_t count)
+{
+    size_t n = bulk_count(array, count), i;
+    json_thing_t scratch;
+    for (i = 0; i < n; i++) {
+        unsigned long long value;
+        if (!json_cast_to_unsigned(number_at(array, i, &scratch), &value))
+            break;
+        values[i] = value;
+    }
+    return i;
+}
+
+json_field_t *json_object_first(json_thing_t *object)
+{
+    assert(object->type == JSON_OBJECT);
+    claim(object);
+    if (!object->object.count)
+        return NULL;
+    if (object->flags & THING_FROZEN)
+        return (json_field_t *) ((uintptr_t) follow(&object->frozen.items) |
+                                 FROZEN_HANDLE);
+    return (json_field_t *) object->object.fields;
+}
+
+static frozen_pair_t *frozen_field(json_field_t *field)
+{
+    if (!((uintptr_t) field & FROZEN_HANDLE))
+        return NULL;
+    return (frozen_pair_t *) ((uintptr_t) field & ~FROZEN_HANDLE);
+}
+
+json_field_t *json_field_next(json_field_t *field)
+{
+    frozen_pair_t *ff = frozen_field(field);
+    if (ff) {
+        ff++;
+        return ff->name ? (json_field_t *) ((uintptr_t) ff | FROZEN_HANDLE)
+                        : NULL;
+    }
+    pair_t *f = (pair_t *) field + 1;
+    return f->name ? (json_field_t *) f : NULL;
+}
+
+const char *json_field_name(json_field_t *field)
+{
+    frozen_pair_t *ff = frozen_field(field);
+    if (ff)
+        return follow(&ff->name);
+    return ((pair_t *) field)->name;
+}
+
+size_t json_field_name_length(json_field_t *field)
+{
+    frozen_pair_t *ff = frozen_field(field);
+    if (ff)
+        return ff->name_len;
+    return ((pair_t *) field)->name_len;
+}
+
+json_thing_t *json_field_value(json_field_t *field)
+{
+    frozen_pair_t *ff = frozen_field(field);
+    if (ff)
+        return follow(&ff->value);
+    return ((pair_t *) field)->value;
+}
+
+static bool name_is(const pair_t *f, const char *key, size_t len)
+{
+    return f->name_len == len && !memcmp(f->name, key, len);
+}
+
+static bool frozen_name_is(frozen_pair_t *f, const char *key, size_t len,
+                           uint32_t hash)
+{
+    return f->hash == hash && f->name_len == len &&
+        !memcmp(follow(&f->name), key, len);
+}
+
+static json_thing_t *frozen_object_get(json_thing_t *object, const char *key,
+                                       size_t len, uint32_t hash)
+{
+    frozen_pair_t *fields = follow(&object->frozen.items);
+    if (object->frozen.index) {
+        object_index_t *index = follow(&object->frozen.index);
+        size_t slot = hash & index->mask;
+        for (; index->slots[slot]; slot = (slot + 1) & index->mask) {
+            frozen_pair_t *f = &fields[index->slots[slot] - 1];
+            if (frozen_name_is(f, key, len, hash))
+                return follow(&f->value);
+        }
+        return NULL;
+    }
+    frozen_pair_t *f, *end = fields + object->frozen.count;
+    for (f = fields; f < end; f++)
+        if (frozen_name_is(f, key, len, hash))
+            return follow(&f->value);
+    return NULL;
+}
+
+/* Return the first field with the given name using the index if one
+ * is given. */
+static pair_t *find_field(pair_t *fields, size_t count,
+                          const object_index_t *index, const char *key,
+                          size_t len, uint32_t hash)
+{
+    if (index) {
+        size_t slot = hash & index->mask;
+        for (; index->slots[slot]; slot = (slot + 1) & index->mask) {
+            pair_t *f = &fields[index->slots[slot] - 1];
+            if (f->hash == hash && name_is(f, key, len))
+                return f;
+        }
+        return NULL;
+    }
+    pair_t *f, *end = fields + count;
+    for (f = fields; f < end; f++)
+        if (f->hash == hash && name_is(f, key, len))
+            return f;
+    return NULL;
+}
+
+static json_thing_t *object_get(json_thing_t *object, const char *key,
+                                size_t len, uint32_t hash)
+{
+    assert(object->type == JSON_OBJECT);
+    if (object->flags & THING_FROZEN)
+        return frozen_object_get(object, key, len, hash);
+    expand(object);
+    if (!object->object.index && object->object.count >= JIT_SIZE_LIMIT &&
+        (object->object.random_access_counter += object->object.count) >=
+            JIT_ACCESS_LIMIT)
+        index_object(object);
+    pair_t *f = find_field(object->object.fields, object->object.count,
+                           object->object.index, key, len, hash);
+    return f ? hand_out(object, &f->value) : NULL;
+}
+
+struct json_key {
+    uint32_t hash;
+    size_t len;
+    char name[];
+};
+
+/* All interned keys in an open-addressing hash table */
+static struct {
+    pthread_mutex_t lock;
+    struct json_key **keys;
+    size_t count, mask;
+} interned = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void intern_insert(struct json_key *key)
+{
+    size_t slot = key->hash & interned.mask;
+    while (interned.keys[slot])
+        slot = (slot + 1) & interned.mask;
+    interned.keys[slot] = key;
+}
+
+json_key_t json_intern(const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    pthread_mutex_lock(&interned.lock);
+    struct json_key *key;
+    size_t slot = interned.keys ? hash & interned.mask : 0;
+    for (; interned.keys && (key = interned.keys[slot]);
+         slot = (slot + 1) & interned.mask)
+        if (key->hash == hash && key->len == len &&
+            !memcmp(key->name, name, len)) {
+            pthread_mutex_unlock(&interned.lock);
+            return key;
+        }
+    if (2 * (interned.count + 1) > interned.mask) {
+        struct json_key **old_keys = interned.keys;
+        size_t old_size = old_keys ? interned.mask + 1 : 0;
+        size_t size = old_size ? 2 * old_size : 64;
+        /* the table and the keys live as long as the process */
+        interned.keys = fsalloc(size * sizeof interned.keys[0]);
+        fs_reallocator_skew(-1);
+        memset(interned.keys, 0, size * sizeof interned.keys[0]);
+        interned.mask = size - 1;
+        for (slot = 0; slot < old_size; slot++)
+            if (old_keys[slot])
+                intern_insert(old_keys[slot]);
+        if (old_keys) {
+            fs_reallocator_skew(1);
+            fsfree(old_keys);
+        }
+    }
+    key = fsalloc(sizeof *key + len + 1);
+    fs_reallocator_skew(-1);
+    key->hash = hash;
+    key->len = len;
+    memcpy(key->name, name, len + 1);
+    intern_insert(key);
+    interned.count++;
+    pthread_mutex_unlock(&interned.lock);
+    return key;
+}
+
+json_thing_t *json_object_get_key(json_thing_t *object, json_key_t key)
+{
+    return object_get(object, key->name, key->len, key->hash);
+}
+
+json_thing_t *json_object_get(json_thing_t *object, const char *key)
+{
+    size_t len = strlen(key);
+    return object_get(object, key, len, hash_name(key, len));
+}
+
+json_thing_t *json_object_dig(json_thing_t *thing, const char *const *keys,
+                              size_t num_keys)
+{
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        if (!thing || json_thing_type(thing) != JSON_OBJECT)
+            return NULL;
+        thing = json_object_get(thing, keys[i]);
+    }
+    return thing;
+}
+
+json_thing_t *json_object_fetch_func(json_thing_t *thing, const char *key, ...)
+{
+    va_list ap;
+    va_start(ap, key);
+    while (key) {
+        if (!thing || json_thing_type(thing) != JSON_OBJECT) {
+            va_end(ap);
+            return NULL;
+        }
+        thing = json_object_get(thing, key);
+        key = va_arg(ap, const char *);
+    }
+    va_end(ap);
+    return thing;
+}
+
+typedef struct {
+    char *name; /* NULL for an array index */
+    size_t len;
+    uint32_t hash;
+    size_t index;
+} path_step_t;
+
+struct json_path {
+    size_t count;
+    path_step_t steps[];
+};
+
+static bool steps_equal(const path_step_t *a, const path_step_t *b)
+{
+    if (!a->name || !b->name)
+        return !a->name && !b->name && a->index == b->index;
+    return a->hash == b->hash && a->len == b->len &&
+        !memcmp(a->name, b->name, a->len);
+}
+
+static json_thing_t *follow_step(const path_step_t *step, json_thing_t *thing)
+{
+    if (!step->name) {
+        if (thing->type != JSON_ARRAY ||
+            step->index >= expand(thing)->array.count)
+            return NULL;
+        return hand_out_element(thing, step->index);
+    }
+    if (thing->type != JSON_OBJECT)
+        return NULL;
+    return object_get(thing, step->name, step->len, step->hash);
+}
+
+static bool parse_path_step(const char **expr, path_step_t *step)
+{
+    const char *p = *expr;
+    if (*p == '[') {
+        p++;
+        if (*p < '0' || *p > '9')
+            return false;
+        size_t index = 0;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (index > ((size_t) -1 - 9) / 10)
+                return false;
+            index = index * 10 + (*p - '0');
+        }
+        if (*p++ != ']')
+            return false;
+        step->name = NULL;
+        step->index = index;
+    } else {
+        size_t len = strcspn(p, ".[");
+        if (!len)
+            return false;
+        step->name = copy_name(p, len);
+        step->len = len;
+        step->hash = hash_name(p, len);
+        p += len;
+    }
+    *expr = p;
+    return true;
+}
+
+json_path_t *json_path_compile(const char *expr)
+{
+    /* every step takes at least one character */
+    json_path_t *path =
+        fsalloc(sizeof *path + strlen(expr) * sizeof path->steps[0]);
+    path->count = 0;
+    const char *p = expr;
+    while (*p) {
+        path_step_t *step = &path->steps[path->count];
+        bool ok = p == expr || *p == '['
+            ? parse_path_step(&p, step)
+            : *p++ == '.' && parse_path_step(&p, step);
+        if (!ok) {
+            json_destroy_path(path);
+            errno = EINVAL;
+            return NULL;
+        }
+        path->count++;
+    }
+    return path;
+}
+
+json_thing_t *json_path_eval(const json_path_t *path, json_thing_t *thing)
+{
+    size_t i;
+    for (i = 0; thing && i < path->count; i++)
+        thing = follow_step(&path->steps[i], thing);
+    return thing;
+}
+
+void json_destroy_path(json_path_t *path)
+{
+    size_t i;
+    for (i = 0; i < path->count; i++)
+        fsfree(path->steps[i].name);
+    fsfree(path);
+}
+
+/* A path set is a trie of steps. Each node lists the paths that end
+ * at it. */
+typedef struct path_node {
+    path_step_t step; /* unused in the root */
+    struct path_node **children;
+    size_t num_children;
+    size_t *paths;
+    size_t num_paths;
+} path_node_t;
+
+struct json_path_set {
+    path_node_t root;
+    size_t count; /* of paths */
+};
+
+static path_node_t *path_child(path_node_t *node, const path_step_t *step)
+{
+    size_t i;
+    for (i = 0; i < node->num_children; i++)
+        if (steps_equal(&node->children[i]->step, step))
+            return node->children[i];
+    path_node_t *child = fsalloc(sizeof *child);
+    child->step = *step;
+    if (step->name)
+        child->step.name = copy_name(step->name, step->len);
+    child->children = NULL;
+    child->num_children = 0;
+    child->paths = NULL;
+    child->num_paths = 0;
+    node->children = fsrealloc(node->children, (node->num_children + 1) *
+                                                   sizeof node->children[0]);
+    node->children[node->num_children++] = child;
+    return child;
+}
+
+json_path_set_t *json_make_path_set(json_path_t *const *paths, size_t count)
+{
+    json_path_set_t *set = fsalloc(sizeof *set);
+    set->root = (path_node_t) { 0 };
+    set->count = count;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        path_node_t *node = &set->root;
+        size_t j;
+        for (j = 0; j < paths[i]->count; j++)
+            node = path_child(node, &paths[i]->steps[j]);
+        node->paths = fsrealloc(node->paths,
+                                (node->num_paths + 1) * sizeof node->paths[0]);
+        node->paths[node->num_paths++] = i;
+    }
+    return set;
+}
+
+static void eval_path_node(const path_node_t *node, json_thing_t *thing,
+                           json_thing_t **results)
+{
+    size_t i;
+    for (i = 0; i < node->num_paths; i++)
+        results[node->paths[i]] = thing;
+    for (i = 0; i < node->num_children; i++) {
+        const path_node_t *child = node->children[i];
+        json_thing_t *value = follow_step(&child->step, thing);
+        if (value)
+            eval_path_node(child, value, results);
+    }
+}
+
+void json_path_set_eval(const json_path_set_t *set, json_thing_t *thing,
+                        json_thing_t **results)
+{
+    size_t i;
+    for (i = 0; i < set->count; i++)
+        results[i] = NULL;
+    eval_path_node(&set->root, thing, results);
+}
+
+static void destroy_path_node(path_node_t *node)
+{
+    size_t i;
+    for (i = 0; i < node->num_children; i++) {
+        destroy_path_node(node->children[i]);
+        fsfree(node->children[i]);
+    }
+    fsfree(node->children);
+    fsfree(node->paths);
+    fsfree(node->step.name);
+}
+
+void json_destroy_path_set(json_path_set_t *set)
+{
+    destroy_path_node(&set->root);
+    fsfree(set);
+}
+
+bool json_object_get_array(json_thing_t *thing, const char *key,
+                           json_thing_t **value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_thing_type(field) == JSON_ARRAY) {
+        *value = field;
+        return true;
+    }
+    return false;
+}
+
+bool json_object_get_object(json_thing_t *thing, const char *key,
+                            json_thing_t **value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_thing_type(field) == JSON_OBJECT) {
+        *value = field;
+        return true;
+    }
+    return false;
+}
+
+bool json_object_get_string(json_thing_t *thing, const char *key,
+                            const char **value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_thing_type(field) == JSON_STRING) {
+        *value = string_utf8(field);
+        return true;
+    }
+    return false;
+}
+
+bool json_object_get_integer(json_thing_t *thing, const char *key,
+                             long long *value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_cast_to_integer(field, value))
+        return true;
+    return false;
+}
+
+bool json_object_get_unsigned(json_thing_t *thing, const char *key,
+                              unsigned long long *value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_cast_to_unsigned(field, value))
+        return true;
+    return false;
+}
+
+bool json_object_get_double(json_thing_t *thing, const char *key, double *value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_cast_to_double(field, value))
+        return true;
+    return false;
+}
+
+bool json_object_get_boolean(json_thing_t *thing, const char *key, bool *value)
+{
+    json_thing_t *field = json_object_get(thing, key);
+    if (field && json_thing_type(field) == JSON_BOOLEAN) {
+        *value = field->boolean.value;
+        return true;
+    }
+    return false;
+}
+
+json_thing_t *json_object_pop(json_thing_t *object, const char *key)
+{
+    assert(object->type == JSON_OBJECT);
+    assert(!(object->flags & (THING_IN_ARENA | THING_FROZEN)));
+    assert(!shared(object));
+    expand(object);
+    size_t len = strlen(key);
+    uint32_t hash = hash_name(key, len);
+    size_t i;
+    for (i = 0; i < object->object.count; i++) {
+        pair_t *f = &object->object.fields[i];
+        if (f->hash == hash && name_is(f, key, len)) {
+            if (object->object.index)
+                index_remove(object->object.index, object->object.fields, i);
+            if (!(f->flags & THING_BORROWED))
+                fsfree(f->name);
+            json_thing_t *value = hand_out(object, &f->value);
+            /* move the sentinel, too */
+            memmove(f, f + 1, (object->object.count - i) * sizeof *f);
+            object->object.count--;
+            forget_memos(object);
+            if (is_container(value))
+                link_of(value)->parent = NULL;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/* All encoders write through an emitter. The emitter fills a window
+ * of memory; when the window is full, the refill function makes more
+ * room, by growing the buffer or by handing the contents to a sink.
+ * Without a refill function the excess is dropped but still counted,
+ * which gives json_utf8_encode() its snprintf(3) semantics. Once the
+ * emitter has failed, the encoders stop visiting further elements. */
+typedef struct emitter {
+    char *base, *q, *end; /* the window */
+    size_t flushed;       /* bytes emitted before the window */
+    size_t dropped;       /* bytes that did not fit */
+    bool (*refill)(struct emitter *em); /* may be NULL */
+    json_sink_t *sink;
+    bool failed; /* the sink failed or the output was cut short */
+} emitter_t;
+
+static size_t emitted(emitter_t *em)
+{
+    return em->flushed + (em->q - em->base) + em->dropped;
+}
+
+static void emit_slowly(emitter_t *em, const char *p, size_t n)
+{
+    for (;;) {
+        size_t room = em->end - em->q;
+        if (n <= room) {
+            memcpy(em->q, p, n);
+            em->q += n;
+            return;
+        }
+        memcpy(em->q, p, room);
+        em->q += room;
+        p += room;
+        n -= room;
+        if (!em->refill || !em->refill(em)) {
+            em->dropped += n;
+            return;
+        }
+    }
+}
+
+static void emit_bytes(emitter_t *em, const char *p, size_t n)
+{
+    if (n <= em->end - em->q) {
+        memcpy(em->q, p, n);
+        em->q += n;
+    } else
+        emit_slowly(em, p, n);
+}
+
+static void emit_char(emitter_t *em, char c)
+{
+    if (em->q < em->end)
+        *em->q++ = c;
+    else
+        emit_slowly(em, &c, 1);
+}
+
+static void emit_repr(emitter_t *em, const char *repr)
+{
+    emit_bytes(em, repr, strlen(repr));
+}
+
+/* Emit the window into the sink and start over. */
+static bool drain(emitter_t *em)
+{
+    size_t n = em->q - em->base;
+    if (em->failed || (n && !em->sink->write(em->sink->obj, em->base, n))) {
+        em->failed = true;
+        return false;
+    }
+    em->flushed += n;
+    em->q = em->base;
+    return true;
+}
+
+/* Double the size of the fsalloc()'ed window. One byte beyond the
+ * window is reserved for a NUL terminator. */
+static bool grow(emitter_t *em)
+{
+    size_t used = em->q - em->base;
+    size_t size = 2 * (em->end - em->base + 1);
+    em->base = fsrealloc(em->base, size);
+    em->q = em->base + used;
+    em->end = em->base + size - 1;
+    return true;
+}
+
+
+/* How each byte is encoded inside a string: 0 means as is, 'u' means
+ * as a \u escape, LATIN_LEAD means it may start a Latin-1
+ * supplement control character (U+0080..U+009F), which is \u-escaped
+ * as well, and anything else is the letter of a short escape. */
+enum {
+    LATIN_LEAD = 1,
+};
+
+static const unsigned char escape_class[256] = {
+    ['\0'] = 'u',   [0x01] = 'u',    [0x02] = 'u', [0x03] = 'u',
+    [0x04] = 'u',   [0x05] = 'u',    [0x06] = 'u', [0x07] = 'u',
+    ['\b'] = 'b',   ['\t'] = 't',    ['\n'] = 'n', [0x0b] = 'u',
+    ['\f'] = 'f',   ['\r'] = 'r',    [0x0e] = 'u', [0x0f] = 'u',
+    [0x10] = 'u',   [0x11] = 'u',    [0x12] = 'u', [0x13] = 'u',
+    [0x14] = 'u',   [0x15] = 'u',    [0x16] = 'u', [0x17] = 'u',
+    [0x18] = 'u',   [0x19] = 'u',    [0x1a] = 'u', [0x1b] = 'u',
+    [0x1c] = 'u',   [0x1d] = 'u',    [0x1e] = 'u', [0x1f] = 'u',
+    ['"'] = '"',    ['\\'] = '\\',   [0x7f] = 'u', [0xc2] = LATIN_LEAD,
+};
+
+/* Return a pointer to the first byte in [p, end) whose escape class
+ * is not 0, or end. */
+static const char *skip_unescaped(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i latin_lead = _mm_set1_epi8((char) 0xc2);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        __m128i stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control),
+                         _mm_cmpeq_epi8(chunk, quote)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, backslash),
+                                      _mm_cmpeq_epi8(chunk, del)),
+                         _mm_cmpeq_epi8(chunk, latin_lead)));
+        unsigned mask = _mm_movemask_epi8(stop);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+    const uint8x16_t latin_lead = vdupq_n_u8(0xc2);
+    while (end - p >= 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *) p);
+        uint8x16_t stop =
+            vorrq_u8(vorrq_u8(vcltq_u8(chunk, space), vceqq_u8(chunk, quote)),
+                     vorrq_u8(vorrq_u8(vceqq_u8(chunk, backslash),
+                                       vceqq_u8(chunk, del)),
+                              vceqq_u8(chunk, latin_lead)));
+        if (vmaxvq_u8(stop))
+            break;
+        p += 16;
+    }
+#endif
+    while (p < end && !escape_class[(unsigned char) *p])
+        p++;
+    return p;
+}
+
+static void emit_unicode_escape(emitter_t *em, unsigned code_point)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[6] = {
+        '\\', 'u', '0', '0', hex[code_point >> 4 & 0xf], hex[code_point & 0xf],
+    };
+    emit_bytes(em, buf, sizeof buf);
+}
+
+static void encode_string_value(emitter_t *em, const char *value, size_t len)
+{
+    emit_char(em, '"');
+    const char *p = value;
+    const char *value_end = value + len;
+    for (;;) {
+        const char *run = p;
+        p = skip_unescaped(p, value_end);
+        emit_bytes(em, run, p - run);
+        if (p == value_end)
+            break;
+        unsigned char c = *p++;
+        switch (escape_class[c]) {
+            case 'u':
+                emit_unicode_escape(em, c);
+                break;
+            case LATIN_LEAD:
+                if (p < value_end && (*p & 0xe0) == 0x80)
+                    emit_unicode_escape(em, (c & 0x1f) << 6 | (*p++ & 0x3f));
+                else
+                    emit_char(em, c);
+                break;
+            default: {
+                char buf[2] = { '\\', escape_class[c] };
+                emit_bytes(em, buf, sizeof buf);
+            }
+        }
+    }
+    emit_char(em, '"');
+}
+
+static const char digit_pairs[200] = {
+    '0', '0', '0', '1', '0', '2', '0', '3', '0', '4', '0', '5', '0', '6',
+    '0', '7', '0', '8', '0', '9', '1', '0', '1', '1', '1', '2', '1', '3',
+    '1', '4', '1', '5', '1', '6', '1', '7', '1', '8', '1', '9', '2', '0',
+    '2', '1', '2', '2', '2', '3', '2', '4', '2', '5', '2', '6', '2', '7',
+    '2', '8', '2', '9', '3', '0', '3', '1', '3', '2', '3', '3', '3', '4',
+    '3', '5', '3', '6', '3', '7', '3', '8', '3', '9', '4', '0', '4', '1',
+    '4', '2', '4', '3', '4', '4', '4', '5', '4', '6', '4', '7', '4', '8',
+    '4', '9', '5', '0', '5', '1', '5', '2', '5', '3', '5', '4', '5', '5',
+    '5', '6', '5', '7', '5', '8', '5', '9', '6', '0', '6', '1', '6', '2',
+    '6', '3', '6', '4', '6', '5', '6', '6', '6', '7', '6', '8', '6', '9',
+    '7', '0', '7', '1', '7', '2', '7', '3', '7', '4', '7', '5', '7', '6',
+    '7', '7', '7', '8', '7', '9', '8', '0', '8', '1', '8', '2', '8', '3',
+    '8', '4', '8', '5', '8', '6', '8', '7', '8', '8', '8', '9', '9', '0',
+    '9', '1', '9', '2', '9', '3', '9', '4', '9', '5', '9', '6', '9', '7',
+    '9', '8', '9', '9',
+};
+
+/* Format n in decimal so that the last digit is right before end.
+ * Two digits at a time are looked up in digit_pairs. Return a pointer
+ * to the first digit. */
+static char *format_decimal(unsigned long long n, char *end)
+{
+    char *p = end;
+    while (n >= 100) {
+        unsigned pair = n % 100;
+        n /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * pair, 2);
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * n, 2);
+    } else
+        *--p = '0' + n;
+    return p;
+}
+
+static void encode_integer(emitter_t *em, long long value)
+{
+    char buf[4 * sizeof value];
+    char *end = buf + sizeof buf;
+    char *p;
+    if (value < 0) {
+        p = format_decimal(0 - (unsigned long long) value, end);
+        *--p = '-';
+    } else
+        p = format_decimal(value, end);
+    emit_bytes(em, p, end - p);
+}
+
+static void encode_unsigned(emitter_t *em, unsigned long long value)
+{
+    char buf[4 * sizeof value];
+    char *end = buf + sizeof buf;
+    char *p = format_decimal(value, end);
+    emit_bytes(em, p, end - p);
+}
+
+static void encode_float(emitter_t *em, double real)
+{
+    bin64_t value = { .f = real };
+    if (em->end - em->q >= BINARY64_MAX_FORMAT_SPACE) {
+        /* format straight into the window; the NUL terminator is
+         * overwritten later */
+        (void) binary64_format(value.i, em->q);
+        em->q += strlen(em->q);
+        return;
+    }
+    char buf[BINARY64_MAX_FORMAT_SPACE];
+    (void) binary64_format(value.i, buf);
+    emit_repr(em, buf);
+}
+
+static void encode_number(emitter_t *em, const number_t *number)
+{
+    switch (number->type) {
+        case JSON_INTEGER:
+            encode_integer(em, number->integer);
+            break;
+        case JSON_UNSIGNED:
+            encode_unsigned(em, number->u_integer);
+            break;
+        default:
+            encode_float(em, number->real);
+    }
+}
+
+/* Encode anything but a container. */
+static void encode_scalar(emitter_t *em, json_thing_t *thing)
+{
+    switch (thing->type) {
+        case JSON_STRING:
+            encode_string_value(em, string_utf8(thing), string_len(thing));
+            break;
+        case JSON_INTEGER:
+            encode_integer(em, thing->integer.value);
+            break;
+        case JSON_UNSIGNED:
+            encode_unsigned(em, thing->u_integer.value);
+            break;
+        case JSON_FLOAT:
+            encode_float(em, thing->real.value);
+            break;
+        case JSON_BOOLEAN:
+            emit_repr(em, thing->boolean.value ? "true" : "false");
+            break;
+        case JSON_NULL:
+            emit_repr(em, "null");
+            break;
+        case JSON_RAW:
+            emit_repr(em, raw_repr(thing));
+            break;
+        default:
+            abort();
+    }
+}
+
+/* Emit the validated encoding of an array or object that has not been
+ * decoded (THING_LAZY) as is, except for whitespace outside strings. */
+static void encode_lazy(emitter_t *em, json_thing_t *thing)
+{
+    const char *p = thing->lazy.start;
+    const char *end = p + thing->lazy.len;
+    const char *run = p;
+    bool in_string = false;
+    for (; p < end; p++)
+        if (in_string) {
+            if (*p == '\\')
+                p++;
+            else if (*p == '"')
+                in_string = false;
+        } else
+            switch (*p) {
+                case '"':
+                    in_string = true;
+                    break;
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\n':
+                    emit_bytes(em, run, p - run);
+                    run = p + 1;
+                    break;
+                default:;
+            }
+    emit_bytes(em, run, end - run);
+}
+
+static void indent(emitter_t *em, unsigned left_margin)
+{
+    static const char spaces[64] = "                                "
+                                   "                                ";
+    while (left_margin > sizeof spaces) {
+        emit_bytes(em, spaces, sizeof spaces);
+        left_margin -= sizeof spaces;
+    }
+    emit_bytes(em, spaces, left_margin);
+}
+
+/* These are the parameters of an encoding: compact if indentation is
+ * negative. */
+typedef struct {
+    unsigned left_margin;
+    int indentation;
+} layout_t;
+
+/* An array or object being encoded, the position of the next element
+ * or field in it and the output position where it started. */
+typedef struct {
+    json_thing_t *container;
+    size_t next, start;
+} encode_frame_t;
+
+/* Emit what follows a complete value up to the start of the next one.
+ * Return the next value or NULL if the encoding is complete. The
+ * length of a compact encoding is remembered as it is completed. */
+static json_thing_t *emit_between(emitter_t *em, work_stack_t *stack,
+                                  layout_t layout)
+{
+    bool pretty = layout.indentation >= 0;
+    while (stack->depth) {
+        encode_frame_t *frame = stack_top(stack);
+        json_thing_t *container = frame->container;
+        bool array = container->type == JSON_ARRAY;
+        size_t count = array ? container->array.count : container->object.count;
+        if (frame->next < count && !em->failed) {
+            if (frame->next)
+                emit_char(em, ',');
+            if (pretty) {
+                emit_char(em, '\n');
+                indent(em, layout.left_margin +
+                               stack->depth * layout.indentation);
+            }
+            size_t i = frame->next++;
+            if (container->flags & THING_PACKED) {
+                encode_number(em, &container->array.numbers[i]);
+                continue;
+            }
+            if (array)
+                return element_at(container, i);
+            pair_t f = field_at(container, i);
+            encode_string_value(em, f.name, f.name_len);
+            if (pretty)
+                emit_bytes(em, ": ", 2);
+            else
+                emit_char(em, ':');
+            return f.value;
+        }
+        if (pretty && count) {
+            emit_char(em, '\n');
+            indent(em, layout.left_margin +
+                           (stack->depth - 1) * layout.indentation);
+        }
+        emit_char(em, array ? ']' : '}');
+        if (!pretty && !em->failed && !(container->flags & THING_FROZEN))
+            set_known_size(container, emitted(em) - frame->start);
+        stack_pop(stack);
+    }
+    return NULL;
+}
+
+/* When the output is only counted, an array or object whose length is
+ * known need not be visited. */
+static bool skip_known(emitter_t *em, json_thing_t *thing, layout_t layout)
+{
+    if (layout.indentation >= 0 || em->q != em->end || em->refill ||
+        thing->flags & THING_FROZEN)
+        return false;
+    size_t size = known_size(thing);
+    em->dropped += size;
+    return size != 0;
+}
+
+/* Encode the thing without recursion. The compact encoding of a lazy
+ * array or object is taken from its original encoding. */
+static void emit_thing(emitter_t *em, json_thing_t *thing, layout_t layout)
+{
+    work_stack_t stack;
+    stack_init(&stack, sizeof(encode_frame_t));
+    do {
+        if (thing->flags & THING_LAZY && layout.indentation < 0)
+            encode_lazy(em, thing);
+        else if (!is_container(thing))
+            encode_scalar(em, thing);
+        else if (!skip_known(em, thing, layout)) {
+            encode_frame_t *frame = stack_push(&stack);
+            frame->container = decoded(thing);
+            frame->next = 0;
+            frame->start = emitted(em);
+            emit_char(em, thing->type == JSON_ARRAY ? '[' : '{');
+        }
+        thing = emit_between(em, &stack, layout);
+    } while (thing);
+    stack_release(&stack);
+}
+
+static void encode_thing(emitter_t *em, json_thing_t *thing)
+{
+    layout_t layout = { .indentation = -1 };
+    emit_thing(em, thing, layout);
+}
+
+static size_t encode_into(json_thing_t *thing, void *buffer, size_t size,
+                          layout_t layout)
+{
+    char dummy;
+    emitter_t em = {
+        .refill = NULL,
+    };
+    if (size)
+        em.base = em.q = buffer, em.end = em.base + size - 1;
+    else
+        em.base = em.q = em.end = &dummy;
+    uint64_t t0 = STAT_CLOCK();
+    emit_thing(&em, thing, layout);
+    if (size)
+        *em.q = '\0';
+    count_encode(emitted(&em), t0);
+    return emitted(&em);
+}
+
+static bool encode_staged(json_thing_t *thing, json_sink_t *sink,
+                          layout_t layout, bool newline, char *buffer,
+                          size_t size)
+{
+    emitter_t em = {
+        .base = buffer,
+        .q = buffer,
+        .end = buffer + size,
+        .refill = drain,
+        .sink = sink,
+        .failed = false,
+    };
+    uint64_t t0 = STAT_CLOCK();
+    emit_thing(&em, thing, layout);
+    if (newline)
+        emit_char(&em, '\n');
+    count_encode(emitted(&em), t0);
+    return drain(&em);
+}
+
+static bool encode_to_sink(json_thing_t *thing, json_sink_t *sink,
+                           layout_t layout)
+{
+    char buffer[4096];
+    return encode_staged(thing, sink, layout, false, buffer, sizeof buffer);
+}
+
+static char *encode_alloc(json_thing_t *thing, size_t *size, layout_t layout)
+{
+    enum { INITIAL_SIZE = 256 };
+    emitter_t em = {
+        .refill = grow,
+    };
+    em.base = em.q = fsalloc(INITIAL_SIZE);
+    em.end = em.base + INITIAL_SIZE - 1;
+    uint64_t t0 = STAT_CLOCK();
+    emit_thing(&em, thing, layout);
+    count_encode(emitted(&em), t0);
+    *em.q = '\0';
+    if (size)
+        *size = em.q - em.base;
+    return em.base;
+}
+
+size_t json_utf8_encode(json_thing_t *thing, void *buffer, size_t size)
+{
+    layout_t layout = { .indentation = -1 };
+    return encode_into(thing, buffer, size, layout);
+}
+
+bool json_utf8_encode_to(json_thing_t *thing, json_sink_t *sink)
+{
+    layout_t layout = { .indentation = -1 };
+    return encode_to_sink(thing, sink, layout);
+}
+
+char *json_utf8_encode_alloc(json_thing_t *thing, size_t *size)
+{
+    layout_t layout = { .indentation = -1 };
+    return encode_alloc(thing, size, layout);
+}
+
+/* The indentation is limited by the layout type, not that it would
+ * matter in practice. */
+static layout_t pretty_layout(unsigned left_margin, unsigned indentation)
+{
+    layout_t layout = {
+        .left_margin = left_margin,
+        .indentation = indentation > INT_MAX ? INT_MAX : indentation,
+    };
+    return layout;
+}
+
+size_t json_utf8_prettyprint(json_thing_t *thing, void *buffer, size_t size,
+                             unsigned left_margin, unsigned indentation)
+{
+    return encode_into(thing, buffer, size,
+                       pretty_layout(left_margin, indentation));
+}
+
+bool json_utf8_prettyprint_to(json_thing_t *thing, json_sink_t *sink,
+                              unsigned left_margin, unsigned indentation)
+{
+    return encode_to_sink(thing, sink, pretty_layout(left_margin, indentation));
+}
+
+char *json_utf8_prettyprint_alloc(json_thing_t *thing, size_t *size,
+                                  unsigned left_margin, unsigned indentation)
+{
+    return encode_alloc(thing, size, pretty_layout(left_margin, indentation));
+}
+
+/* A large array or object is encoded in parallel in pieces, each a
+ * range of its elements or fields with the separators in between.
+ * The pieces are written to the sink in order as they complete. */
+enum {
+    PARALLEL_MIN_CHILDREN = 256,
+    PARALLEL_PIECES_PER_WORKER = 4,
+    PARALLEL_MAX_DESCENT = 8
+};
+
+typedef struct {
+    size_t start, end; /* the range of elements or fields */
+    char *encoding;
+    size_t size;
+    bool done;
+} encode_piece_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    json_thing_t *container;
+    encode_piece_t *pieces;
+    size_t num_pieces, next_piece;
+    bool failed; /* the sink failed; start no more pieces */
+} encode_pool_t;
+
+static void encode_piece(json_thing_t *container, encode_piece_t *piece)
+{
+    enum { INITIAL_SIZE = 4096 };
+    emitter_t em = {
+        .refill = grow,
+    };
+    em.base = em.q = fsalloc(INITIAL_SIZE);
+    em.end = em.base + INITIAL_SIZE - 1;
+    size_t i;
+    for (i = piece->start; i < piece->end; i++) {
+        if (i)
+            emit_char(&em, ',');
+        if (container->type == JSON_ARRAY)
+            encode_thing(&em, element_at(container, i));
+        else {
+            pair_t f = field_at(container, i);
+            encode_string_value(&em, f.name, f.name_len);
+            emit_char(&em, ':');
+            encode_thing(&em, f.value);
+        }
+    }
+    piece->encoding = em.base;
+    piece->size = em.q - em.base;
+}
+
+static void *encode_worker(void *arg)
+{
+    encode_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->failed && pool->next_piece < pool->num_pieces) {
+        encode_piece_t *piece = &pool->pieces[pool->next_piece++];
+        pthread_mutex_unlock(&pool->lock);
+        encode_piece(pool->container, piece);
+        pthread_mutex_lock(&pool->lock);
+        piece->done = true;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Hand a piece straight to the sink unless it fits in the window. */
+static void emit_piece(emitter_t *em, const char *p, size_t n)
+{
+    if (n <= em->end - em->q)
+        emit_bytes(em, p, n);
+    else if (drain(em)) {
+        if (em->sink->write(em->sink->obj, p, n))
+            em->flushed += n;
+        else
+            em->failed = true;
+    }
+}
+
+static void encode_children_in_parallel(emitter_t *em, json_thing_t *container,
+                                        size_t count, unsigned nthreads)
+{
+    encode_pool_t pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.container = container;
+    pool.num_pieces = nthreads * PARALLEL_PIECES_PER_WORKER;
+    if (pool.num_pieces > count)
+        pool.num_pieces = count;
+    pool.pieces = fsalloc(pool.num_pieces * sizeof pool.pieces[0]);
+    pool.next_piece = 0;
+    pool.failed = em->failed;
+    size_t i;
+    for (i = 0; i < pool.num_pieces; i++)
+        pool.pieces[i] = (encode_piece_t) {
+            .start = count * i / pool.num_pieces,
+            .end = count * (i + 1) / pool.num_pieces,
+            .done = false,
+        };
+    pthread_t *workers = fsalloc(nthreads * sizeof workers[0]);
+    unsigned num_workers;
+    for (num_workers = 0; num_workers < nthreads; num_workers++)
+        if (pthread_create(&workers[num_workers], NULL, encode_worker, &pool))
+            break;
+    if (!num_workers)
+        encode_worker(&pool);
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < pool.num_pieces; i++) {
+        /* after a failure, only the pieces already started remain */
+        if (pool.failed && i >= pool.next_piece)
+            break;
+        encode_piece_t *piece = &pool.pieces[i];
+        while (!piece->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+        if (!em->failed)
+            emit_piece(em, piece->encoding, piece->size);
+        fsfree(piece->encoding);
+        pthread_mutex_lock(&pool.lock);
+        if (em->failed)
+            pool.failed = true;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    fsfree(workers);
+    fsfree(pool.pieces);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/* Look for large arrays and objects near the top of the tree and
+ * encode their contents in parallel. */
+static void encode_parallel(emitter_t *em, json_thing_t *thing,
+                            unsigned nthreads, unsigned levels)
+{
+    if (!levels || thing->flags & (THING_LAZY | THING_PACKED) ||
+        (thing->type != JSON_ARRAY && thing->type != JSON_OBJECT)) {
+        encode_thing(em, thing);
+        return;
+    }
+    bool array = thing->type == JSON_ARRAY;
+    size_t count = array ? thing->array.count : thing->object.count;
+    emit_char(em, array ? '[' : '{');
+    if (count >= PARALLEL_MIN_CHILDREN)
+        encode_children_in_parallel(em, thing, count, nthreads);
+    else {
+        size_t i;
+        for (i = 0; i < count && !em->failed; i++) {
+            if (i)
+                emit_char(em, ',');
+            if (array)
+                encode_parallel(em, element_at(thing, i), nthreads,
+                                levels - 1);
+            else {
+                pair_t f = field_at(thing, i);
+                encode_string_value(em, f.name, f.name_len);
+                emit_char(em, ':');
+                encode_parallel(em, f.value, nthreads, levels - 1);
+            }
+        }
+    }
+    emit_char(em, array ? ']' : '}');
+}
+
+bool json_utf8_encode_parallel(json_thing_t *thing, unsigned nthreads,
+                               json_sink_t *sink)
+{
+    if (nthreads <= 1)
+        return json_utf8_encode_to(thing, sink);
+    char buffer[4096];
+    emitter_t em = {
+        .base = buffer,
+        .q = buffer,
+        .end = buffer + sizeof buffer,
+        .refill = drain,
+        .sink = sink,
+        .failed = false,
+    };
+    uint64_t t0 = STAT_CLOCK();
+    encode_parallel(&em, thing, nthreads, PARALLEL_MAX_DESCENT);
+    count_encode(emitted(&em), t0);
+    return drain(&em);
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    if (!p)
+        return p;
+    while (p < end)
+        switch (*p) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                p++;
+                break;
+            default:
+                return p;
+        }
+    return p;
+}
+
+static const char *skip(const char *p, const char *end, char c)
+{
+    if (!p || exhausted(p, end))
+        return NULL;
+    if (*p != c) {
+        json_error();
+        return NULL;
+    }
+    return p + 1;
+}
+
+static const char *scan_hex_digit(const char *p, const char *end, int *digit)
+{
+    if (!p || exhausted(p, end)) {
+        *digit = -1; /* don't-care to avoid compiler warnings */
+        return NULL;
+    }
+    *digit = charstr_digit_value(*p);
+    if (*digit == -1) {
+        json_error();
+        return NULL;
+    }
+    return skip(p, end, *p);
+}
+
+static const char *scan_ucs2(const char *p, const char *end, int *value)
+{
+    int d0, d1, d2, d3;
+    p = scan_hex_digit(p, end, &d0);
+    p = scan_hex_digit(p, end, &d1);
+    p = scan_hex_digit(p, end, &d2);
+    p = scan_hex_digit(p, end, &d3);
+    *value = d0 << 12 | d1 << 8 | d2 << 4 | d3;
+    return p;
+}
+
+static bool high_surrogate(int ucs2)
+{
+    return ucs2 >= 0xd800 && ucs2 <= 0xdbff;
+}
+
+static bool low_surrogate(int ucs2)
+{
+    return ucs2 >= 0xdc00 && ucs2 <= 0xdfff;
+}
+
+static bool valid_unicode(int unic)
+{
+    return (unic >= 0 && unic <= 0xd7ff) ||
+        (unic >= 0xe000 && unic <= 0x10ffff);
+}
+
+static size_t utf8_length(int unic)
+{
+    if (unic < 0x80)
+        return 1;
+    if (unic < 0x800)
+        return 2;
+    if (unic < 0x10000)
+        return 3;
+    return 4;
+}
+
+static char *utf8_encode(char *q, int unic)
+{
+    if (unic < 0x80)
+        *q++ = unic;
+    else if (unic < 0x800) {
+        *q++ = 0xc0 | unic >> 6;
+        *q++ = 0x80 | (unic & 0x3f);
+    } else if (unic < 0x10000) {
+        *q++ = 0xe0 | unic >> 12;
+        *q++ = 0x80 | (unic >> 6 & 0x3f);
+        *q++ = 0x80 | (unic & 0x3f);
+    } else {
+        *q++ = 0xf0 | unic >> 18;
+        *q++ = 0x80 | (unic >> 12 & 0x3f);
+        *q++ = 0x80 | (unic >> 6 & 0x3f);
+        *q++ = 0x80 | (unic & 0x3f);
+    }
+    return q;
+}
+
+static const char *scan_utf16(const char *p, const char *end, int *value)
+{
+    /* Scanning begins after the initial \u */
+    int ucs2;
+    p = scan_ucs2(p, end, &ucs2);
+    if (!p)
+        return NULL;
+    if (low_surrogate(ucs2)) {
+        json_error();
+        return NULL;
+    }
+    if (!high_surrogate(ucs2)) {
+        *value = ucs2;
+        return p;
+    }
+    p = skip(p, end, '\\');
+    p = skip(p, end, 'u');
+    int low;
+    p = scan_ucs2(p, end, &low);
+    if (!p)
+        return NULL;
+    if (!low_surrogate(low)) {
+        json_error();
+        return NULL;
+    }
+    *value = 0x10000 + ((ucs2 - 0xd800) << 10 | (low - 0xdc00));
+    if (!valid_unicode(*value)) {
+        json_error();
+        return NULL;
+    }
+    return p;
+}
+
+static const char *skip_utf8(const char *p, const char *end)
+{
+    if (!p || exhausted(p, end))
+        return NULL;
+    char c0 = *p;
+    p = skip(p, end, *p);
+    if (!(c0 & 0x80))
+        return p;
+    if (!(c0 & 0x40)) {
+        json_error();
+        return NULL;
+    }
+    if (!p || exhausted(p, end))
+        return NULL;
+    if ((*p & 0xc0) != 0x80) {
+        json_error();
+        return NULL;
+    }
+    p = skip(p, end, *p);
+    if (!(c0 & 0x20))
+        return p;
+    if (!p || exhausted(p, end))
+        return NULL;
+    if ((*p & 0xc0) != 0x80) {
+        json_error();
+        return NULL;
+    }
+    p = skip(p, end, *p);
+    if (!(c0 & 0x10))
+        return p;
+    if (c0 & 0x08) {
+        json_error();
+        return NULL;
+    }
+    if (!p || exhausted(p, end))
+        return NULL;
+    if ((*p & 0xc0) != 0x80) {
+        json_error();
+        return NULL;
+    }
+    return skip(p, end, *p);
+}
+
+static bool is_clean_string_char(char c)
+{
+    return c != '"' && c != '\\' && (unsigned char) c >= 0x20 &&
+        (unsigned char) c < 0x80;
+}
+
+#if !defined(__SSE2__) && !(defined(__ARM_NEON) && defined(__aarch64__))
+static uint64_t swar_has_less(uint64_t word, unsigned char n)
+{
+    const uint64_t ones = (uint64_t) -1 / 0xff;
+    return (word - ones * n) & ~word & ones * 0x80;
+}
+
+static uint64_t swar_has_byte(uint64_t word, unsigned char c)
+{
+    const uint64_t ones = (uint64_t) -1 / 0xff;
+    return swar_has_less(word ^ ones * c, 1);
+}
+#endif
+
+/* Return the length of the run of bytes at p that need no special
+ * treatment inside a string: no quotes, backslashes, control
+ * characters or non-ASCII bytes. */
+static size_t clean_run_length(const char *p, const char *end)
+{
+    const char *start = p;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        /* the signed comparison catches non-ASCII bytes, too */
+        __m128i special =
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                      _mm_cmpeq_epi8(chunk, backslash)),
+                         _mm_cmplt_epi8(chunk, space));
+        int mask = _mm_movemask_epi8(special);
+        if (mask)
+            return p - start + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    while (end - p >= 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *) p);
+        uint8x16_t special =
+            vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+                     vorrq_u8(vcltq_u8(chunk, space), vcgeq_u8(chunk, high)));
+        /* narrow each byte of the comparison into a nibble */
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)),
+            0);
+        if (mask)
+            return p - start + __builtin_ctzll(mask) / 4;
+        p += 16;
+    }
+#else
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+        if (swar_has_byte(word, '"') || swar_has_byte(word, '\\') ||
+            swar_has_less(word, 0x20) || word & (uint64_t) -1 / 0xff * 0x80)
+            break;
+        p += 8;
+    }
+#endif
+    while (p < end && is_clean_string_char(*p))
+        p++;
+    return p - start;
+}
+
+/* On success, *closing is set to point to the closing quote. */
+static ssize_t scan_string_repr(const char *p, const char *end,
+                                const char **closing)
+{
+    size_t count = 0;
+    p = skip(p, end, '"');
+    while (p && !exhausted(p, end))
+        switch (*p) {
+            case '\\':
+                p = skip(p, end, '\\');
+                if (!p || exhausted(p, end))
+                    return -1;
+                if (*p & 0x80) {
+                    json_error();
+                    return -1;
+                }
+                if (*p != 'u') {
+                    count++;
+                    p = skip(p, end, *p);
+                } else {
+                    p = skip(p, end, 'u');
+                    int unic;
+                    p = scan_utf16(p, end, &unic);
+                    if (!p)
+                        return -1;
+                    count += utf8_length(unic);
+                }
+                break;
+            case '"':
+                *closing = p;
+                /* Theoretically, count might have overflowed the signed
+                 * range. That works perfectly. */
+                return count;
+            default: {
+                size_t n = clean_run_length(p, end);
+                if (n) {
+                    p += n;
+                    count += n;
+                    break;
+                }
+                const char *p0 = p;
+                p = skip_utf8(p, end);
+                count += p - p0;
+            }
+        }
+    return -1;
+}
+
+static const char *unescape_string(const char *p, const char *end, char *q);
+
+static const char *decode_string_value(decoder_t *dec, const char *p,
+                                       const char *end, char **value,
+                                       size_t *len, unsigned *flags)
+{
+    const char *closing;
+    ssize_t size = scan_string_repr(p, end, &closing);
+    if (size < 0)
+        return NULL;
+    *len = size;
+    /* every escape sequence is longer than what it stands for */
+    if (dec->flags & JSON_DECODE_ZERO_COPY && closing - p - 1 == size) {
+        *value = (char *) p + 1;
+        *flags = THING_BORROWED;
+        return closing + 1;
+    }
+    *flags = 0;
+    *value = decoder_alloc(dec, size + 1);
+    return unescape_string(p, end, *value);
+}
+
+/* Copy the value of the string whose encoding starts at p into q,
+ * which must have room for the value as reported by
+ * scan_string_repr() and a NUL terminator. Return the position right
+ * after the encoding. */
+static const char *unescape_string(const char *p, const char *end, char *q)
+{
+    p = skip(p, end, '"');
+    /* scan_string_repr() has already validated the string; no need to
+     * do bounds or error checking */
+    for (;;) {
+        size_t n = clean_run_length(p, end);
+        memcpy(q, p, n);
+        p += n;
+        q += n;
+        if (*p == '"')
+            break;
+        if (*p != '\\')
+            *q++ = *p++;
+        else {
+            p++;
+            switch (*p) {
+                case 'b':
+                    *q++ = '\b', p++;
+                    break;
+                case 'f':
+                    *q++ = '\f', p++;
+                    break;
+                case 'n':
+                    *q++ = '\n', p++;
+                    break;
+                case 'r':
+                    *q++ = '\r', p++;
+                    break;
+                case 't':
+                    *q++ = '\t', p++;
+                    break;
+                case 'u': {
+                    int unic;
+                    p = scan_utf16(p + 1, end, &unic);
+                    q = utf8_encode(q, unic);
+                } break;
+                default:
+                    *q++ = *p++;
+            }
+        }
+    }
+    *q = '\0';
+    return p + 1;
+}
+
+static const char *decode_string(decoder_t *dec, const char *p,
+                                 const char *end, json_thing_t **thing)
+{
+    const char *closing;
+    ssize_t size = scan_string_repr(p, end, &closing);
+    if (size < 0)
+        return NULL;
+    json_thing_t *string = decoder_make_thing(dec, JSON_STRING);
+    *thing = string;
+    /* every escape sequence is longer than what it stands for */
+    if (dec->flags & JSON_DECODE_ZERO_COPY && closing - p - 1 == size) {
+        string->flags |= THING_BORROWED;
+        string->string.utf8 = (char *) p + 1;
+        string->string.len = size;
+        return closing + 1;
+    }
+    if (size <= INLINE_STRING_MAX) {
+        string->flags |= THING_INLINE;
+        string->short_len = size;
+        return unescape_string(p, end, string->short_string);
+    }
+    string->string.utf8 = decoder_alloc(dec, size + 1);
+    string->string.len = size;
+    return unescape_string(p, end, string->string.utf8);
+}
+
+static json_thing_t *decode_integer(decoder_t *dec, long long n)
+{
+    json_thing_t *thing = decoder_make_thing(dec, JSON_INTEGER);
+    thing->integer.value = n;
+    return thing;
+}
+
+static json_thing_t *decode_unsigned(decoder_t *dec, unsigned long long n)
+{
+    json_thing_t *thing = decoder_make_thing(dec, JSON_UNSIGNED);
+    thing->u_integer.value = n;
+    return thing;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* If the eight bytes at p are all decimal digits, store their value
+ * in *value and return true. */
+static bool lex_eight_digits(const char *p, uint64_t *value)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    if ((v & 0xf0f0f0f0f0f0f0f0) != 0x3030303030303030 ||
+        ((v + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) !=
+            0x3030303030303030)
+        return false;
+    v -= 0x3030303030303030;
+    v = v * 10 + (v >> 8); /* pairs of digits in every other byte */
+    v = ((v & 0x000000ff000000ff) * (100 + (1000000ULL << 32)) +
+         (v >> 16 & 0x000000ff000000ff) * (1 + (10000ULL << 32))) >>
+        32;
+    *value = v;
+    return true;
+}
+#endif
+
+/* Lex an integer of at most 19 digits without going through
+ * binary64_parse_decimal(). Return NULL if the number is anything
+ * else; the general path then takes over. */
+static const char *lex_small_integer(const char *start, const char *end,
+                                     number_t *number)
+{
+    enum { MAX_DIGITS = 19 }; /* 10^19 - 1 < 2^64 */
+    const char *p = start;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return NULL;
+    uint64_t value = 0;
+    if (*p == '0')
+        p++;
+    else {
+        const char *limit = end - p > MAX_DIGITS ? p + MAX_DIGITS : end;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        uint64_t eight;
+        while (limit - p >= 8 && lex_eight_digits(p, &eight)) {
+            value = value * 100000000 + eight;
+            p += 8;
+        }
+#endif
+        while (p < limit && *p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+    }
+    if (p < end &&
+        ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E'))
+        return NULL; /* a leading zero, too many digits or a fraction */
+    if (!negative || !value) {
+        number->type = JSON_UNSIGNED; /* no negative zero */
+        number->u_integer = value;
+    } else {
+        if (value > ((uint64_t) -1 >> 1) + 1)
+            return NULL;
+        number->type = JSON_INTEGER;
+        number->integer = -(long long) (value - 1) - 1;
+    }
+    return p;
+}
+
+static const char *lex_number(const char *start, const char *end,
+                              number_t *number)
+{
+    const char *p = lex_small_integer(start, end, number);
+    if (p)
+        return p;
+    size_t size = end - start;
+    binary64_float_t decimal;
+    bool exact;
+    ssize_t count = binary64_parse_decimal(start, size, &decimal, &exact);
+    if (count < 0) {
+        json_error();
+        return NULL;
+    }
+    const char *good = start + count;
+    if (decimal.type == BINARY64_TYPE_ZERO) {
+        number->type = JSON_UNSIGNED; /* no negative zero */
+        number->u_integer = 0;
+        return good;
+    }
+    if (decimal.type != BINARY64_TYPE_NORMAL) {
+        json_error(); /* no special values in JSON */
+        return NULL;
+    }
+    if (exact && decimal.exponent >= 0) {
+        uint64_t significand = decimal.significand;
+        int32_t exponent = decimal.exponent;
+        while (exponent-- && significand <= (uint64_t) -1 / 10)
+            significand *= 10;
+        if (exponent == -1) {
+            if (!decimal.negative) {
+                number->type = JSON_UNSIGNED;
+                number->u_integer = significand;
+                return good;
+            }
+            if (significand <= ((uint64_t) -1 >> 1) + 1) {
+                number->type = JSON_INTEGER;
+                number->integer = -(int64_t) (significand - 1) - 1;
+                return good;
+            }
+        }
+    }
+    bin64_t value;
+    if (!binary64_from_decimal(&decimal, &value.i))
+        return NULL;
+    number->type = JSON_FLOAT;
+    number->real = value.f;
+    return good;
+}
+
+static const char *decode_number(decoder_t *dec, const char *start,
+                                 const char *end, json_thing_t **thing)
+{
+    number_t number;
+    const char *p = lex_number(start, end, &number);
+    if (!p)
+        return NULL;
+    switch (number.type) {
+        case JSON_INTEGER:
+            *thing = decode_integer(dec, number.integer);
+            break;
+        case JSON_UNSIGNED:
+            *thing = decode_unsigned(dec, number.u_integer);
+            break;
+        default:
+            *thing = decoder_make_thing(dec, JSON_FLOAT);
+            (*thing)->real.value = number.real;
+    }
+    return p;
+}
+
+static bool packs_numbers(decoder_t *dec)
+{
+    return dec->flags & JSON_DECODE_PACK_NUMBERS && !dec->arena;
+}
+
+/* Decode a nonempty array of nothing but numbers into a packed array.
+ * Return NULL if the array is anything else, including invalid or too
+ * deep for its elements (the array is at the given depth); the caller
+ * then decodes it the usual way. */
+static const char *decode_packed(const char *p, const char *end,
+                                 size_t depth, json_thing_t **thing)
+{
+    assert(*p == '[');
+    if (depth + 1 >= depth_limit())
+        return NULL;
+    number_t *numbers = NULL;
+    size_t count = 0, capacity = 0;
+    p++;
+    for (;;) {
+        p = skip_ws(p, end);
+        if (p == end || (*p != '-' && (*p < '0' || *p > '9')))
+            break;
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : VECTOR_INITIAL_CAPACITY;
+            numbers = fsrealloc(numbers, capacity * sizeof numbers[0]);
+        }
+        p = skip_ws(lex_number(p, end, &numbers[count]), end);
+        if (!p || p == end)
+            break;
+        count++;
+        if (*p == ']') {
+            json_thing_t *array = json_make_array();
+            array->flags |= THING_PACKED;
+            array->array.numbers = numbers;
+            array->array.count = count;
+            array->array.capacity = capacity;
+            *thing = array;
+            return p + 1;
+        }
+        if (*p++ != ',')
+            break;
+    }
+    fsfree(numbers);
+    return NULL;
+}
+
+static const char *skip_literal(const char *p, const char *end,
+                               const char *literal)
+{
+    while (*literal)
+        p = skip(p, end, *literal++);
+    return p;
+}
+
+static const char *decode_true(decoder_t *dec, const char *p,
+                               const char *end, json_thing_t **thing)
+{
+    p = skip_literal(p, end, "true");
+    if (!p)
+        return NULL;
+    *thing = json_make_boolean(true);
+    return p;
+}
+
+static const char *decode_false(decoder_t *dec, const char *p,
+                                const char *end, json_thing_t **thing)
+{
+    p = skip_literal(p, end, "false");
+    if (!p)
+        return NULL;
+    *thing = json_make_boolean(false);
+    return p;
+}
+
+static const char *decode_null(decoder_t *dec, const char *p,
+                               const char *end, json_thing_t **thing)
+{
+    p = skip_literal(p, end, "null");
+    if (!p)
+        return NULL;
+    *thing = json_make_null();
+    return p;
+}
+
+/* Leave a nested array or object of a validated encoding for
+ * expand_lazy() to decode. The top-level container is decoded with
+ * the full nesting level budget; it is the only one decoded eagerly.
+ * Return the position right after the container. */
+static const char *decode_lazy(decoder_t *dec, const char *p,
+                               const char *end, json_thing_t **thing)
+{
+    json_thing_t *lazy =
+        decoder_make_thing(dec, *p == '[' ? JSON_ARRAY : JSON_OBJECT);
+    lazy->flags |= THING_LAZY;
+    *link_of(lazy) = (tree_link_t) { NULL, 0, 0 };
+    lazy->lazy.start = p;
+    size_t depth = 0;
+    bool in_string = false;
+    for (;; p++)
+        if (in_string) {
+            if (*p == '\\')
+                p++;
+            else if (*p == '"')
+                in_string = false;
+        } else if (*p == '"')
+            in_string = true;
+        else if (*p == '[' || *p == '{')
+            depth++;
+        else if ((*p == ']' || *p == '}') && !--depth)
+            break;
+    lazy->lazy.len = p + 1 - lazy->lazy.start;
+    *thing = lazy;
+    return p + 1;
+}
+
+static void expand_lazy(json_thing_t *thing)
+{
+    decoder_t dec = {
+        .arena = NULL,
+        .flags = JSON_DECODE_ZERO_COPY | DECODE_LAZY | DECODE_EXPANSION,
+    };
+    const char *start = thing->lazy.start;
+    const char *end = start + thing->lazy.len;
+    json_thing_t *expansion;
+    /* The span has been validated, so this should never fail; if it
+     * does anyway, the array or object is left empty rather than
+     * half-decoded. */
+    if (decode(&dec, start, end, &expansion) != end)
+        expansion = thing->type == JSON_ARRAY ? json_make_array()
+                                              : json_make_object();
+    tree_link_t link = *link_of(thing);
+    size_t i;
+    if (thing->type == JSON_ARRAY) {
+        thing->array = expansion->array;
+        for (i = 0; i < thing->array.count; i++)
+            adopt(thing, thing->array.elements[i]);
+    } else {
+        thing->object = expansion->object;
+        for (i = 0; i < thing->object.count; i++)
+            adopt(thing, thing->object.fields[i].value);
+    }
+    *link_of(thing) = link;
+    thing->flags &= ~THING_LAZY;
+    fsfree(expansion);
+    /* The length and hash of a lazy array or object are never recorded
+     * although its parent's may be. Now that it can be modified, its
+     * ancestors must forget theirs. */
+    json_thing_t *ancestor;
+    for (ancestor = link.parent; ancestor;
+         ancestor = link_of(ancestor)->parent) {
+        set_known_size(ancestor, 0);
+        set_known_hash(ancestor, 0);
+    }
+}
+
+/* An array or object being decoded. An object may have a field name
+ * waiting for its value. */
+typedef struct {
+    json_thing_t *container;
+    char *key;
+    size_t len;
+    unsigned key_flags;
+} decode_frame_t;
+
+static void discard_frames(decoder_t *dec, work_stack_t *stack)
+{
+    while (stack->depth) {
+        decode_frame_t *frame = stack_top(stack);
+        if (frame->key && !(frame->key_flags & THING_BORROWED))
+            decoder_free(dec, frame->key, frame->len + 1);
+        decoder_discard(dec, frame->container);
+        stack_pop(stack);
+    }
+    stack_release(stack);
+}
+
+/* With a decoder context, the vectors of arrays and objects being
+ * decoded grow through its free lists. */
+static void take_room(json_decoder_t *pools, json_thing_t *container)
+{
+    if (container->type == JSON_ARRAY)
+        container->array.elements =
+            take_vector(pools, pools->elements, container->array.elements,
+                        container->array.count, &container->array.capacity,
+                        sizeof container->array.elements[0]);
+    else
+        container->object.fields =
+            take_vector(pools, pools->fields, container->object.fields,
+                        container->object.count, &container->object.capacity,
+                        sizeof container->object.fields[0]);
+}
+
+static void attach_decoded(decoder_t *dec, decode_frame_t *frame,
+                           json_thing_t *value)
+{
+    if (dec->pools)
+        take_room(dec->pools, frame->container);
+    if (frame->container->type == JSON_ARRAY)
+        append_element(dec->arena, frame->container, value);
+    else {
+        append_field(dec->arena, frame->container, frame->key, frame->len,
+                     frame->key_flags, value);
+        frame->key = NULL;
+    }
+}
+
+/* Decode a field name and the colon after it. */
+static const char *decode_key(decoder_t *dec, const char *p, const char *end,
+                              decode_frame_t *frame)
+{
+    char *key;
+    p = decode_string_value(dec, p, end, &key, &frame->len, &frame->key_flags);
+    if (!p)
+        return NULL;
+    frame->key = key;
+    return skip_ws(skip(skip_ws(p, end), end, ':'), end);
+}
+
+static const char *decode_scalar(decoder_t *dec, const char *p,
+                                 const char *end, json_thing_t **thing)
+{
+    switch (*p) {
+        case '"':
+            return decode_string(dec, p, end, thing);
+        case '-':
+            return decode_number(dec, p, end, thing);
+        case 't':
+            return decode_true(dec, p, end, thing);
+        case 'f':
+            return decode_false(dec, p, end, thing);
+        case 'n':
+            return decode_null(dec, p, end, thing);
+        default:
+            if (*p >= '0' && *p <= '9')
+                return decode_number(dec, p, end, thing);
+            json_error();
+            return NULL;
+    }
+}
+
+/* Decode a value without recursion: the arrays and objects being
+ * decoded are kept in a work stack. In lazy mode, only the outermost
+ * array or object is decoded right away. */
+static const char *decode(decoder_t *dec, const char *p, const char *end,
+                          json_thing_t **thing)
+{
+    unsigned limit =
+        dec->flags & DECODE_EXPANSION ? UINT_MAX : depth_limit();
+    work_stack_t stack;
+    stack_init(&stack, sizeof(decode_frame_t));
+    for (;;) {
+        json_thing_t *value;
+        p = skip_ws(p, end);
+        if (!p || exhausted(p, end))
+            break;
+        if (stack.depth >= limit) {
+            json_error();
+            break;
+        }
+        const char *packed;
+        if (*p != '[' && *p != '{')
+            p = decode_scalar(dec, p, end, &value);
+        else if (dec->flags & DECODE_LAZY && stack.depth)
+            p = decode_lazy(dec, p, end, &value);
+        else if (*p == '[' && packs_numbers(dec) &&
+                 (packed = decode_packed(p, end, stack.depth, &value)))
+            p = packed;
+        else {
+            char closing = *p == '[' ? ']' : '}';
+            value = closing == ']' ? decoder_make_array(dec)
+                                   : decoder_make_object(dec);
+            p = skip_ws(p + 1, end);
+            if (!p || exhausted(p, end)) {
+                decoder_discard(dec, value);
+                break;
+            }
+            if (*p == closing)
+                p++;
+            else {
+                decode_frame_t *frame = stack_push(&stack);
+                STAT_MAX(max_depth, stack.depth);
+                frame->container = value;
+                frame->key = NULL;
+                if (closing == ']')
+                    continue;
+                p = decode_key(dec, p, end, frame);
+                if (!p)
+                    break;
+                continue;
+            }
+        }
+        if (!p)
+            break;
+        /* the value is complete; close the containers it completes */
+        for (;;) {
+            if (!stack.depth) {
+                stack_release(&stack);
+                *thing = value;
+                return p;
+            }
+            decode_frame_t *frame = stack_top(&stack);
+            attach_decoded(dec, frame, value);
+            p = skip_ws(p, end);
+            if (!p || exhausted(p, end)) {
+                p = NULL;
+                break;
+            }
+            char closing = frame->container->type == JSON_ARRAY ? ']' : '}';
+            if (*p != closing)
+                break;
+            p++;
+            value = frame->container;
+            stack_pop(&stack);
+        }
+        if (!p)
+            break;
+        decode_frame_t *frame = stack_top(&stack);
+        p = skip_ws(skip(p, end, ','), end);
+        if (p && frame->container->type == JSON_OBJECT)
+            p = decode_key(dec, p, end, frame);
+        if (!p)
+            break;
+    }
+    discard_frames(dec, &stack);
+    return NULL;
+}
+
+/* The structural index decoder works in two stages like simdjson.
+ * Stage 1 classifies the input 64 bytes at a time into bit masks,
+ * works out which bytes are inside strings and records the offsets of
+ * all structural characters outside strings, all opening quotes and
+ * the first bytes of all scalars. Stage 2 then walks the index and
+ * reuses the ordinary lexers for the tokens. Whitespace is never
+ * looked at again, and anything stage 1 misjudges in an invalid
+ * encoding is caught by the lexers or by the grammar of stage 2. */
+
+enum {
+    INDEX_BLOCK_SIZE = 64,
+};
+
+typedef struct {
+    uint64_t quote, backslash, whitespace, op;
+} block_masks_t;
+
+#if defined(__SSE2__)
+static void classify_block(const char *p, block_masks_t *masks)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lower_case = _mm_set1_epi8(0x20);
+    const __m128i open_brace = _mm_set1_epi8('{');
+    const __m128i close_brace = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    *masks = (block_masks_t) { 0 };
+    for (int i = 0; i < INDEX_BLOCK_SIZE / 16; i++) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+        /* '[' and ']' differ from '{' and '}' by 0x20 only */
+        __m128i folded = _mm_or_si128(chunk, lower_case);
+        __m128i ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                         _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, cr)));
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, open_brace),
+                         _mm_cmpeq_epi8(folded, close_brace)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, colon),
+                         _mm_cmpeq_epi8(chunk, comma)));
+        unsigned shift = 16 * i;
+        masks->quote |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                            _mm_cmpeq_epi8(chunk, quote))
+            << shift;
+        masks->backslash |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                                _mm_cmpeq_epi8(chunk, backslash))
+            << shift;
+        masks->whitespace |= (uint64_t) (uint16_t) _mm_movemask_epi8(ws)
+            << shift;
+        masks->op |= (uint64_t) (uint16_t) _mm_movemask_epi8(op) << shift;
+    }
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static uint64_t neon_bitmask(const uint8x16_t m[4])
+{
+    const uint8x16_t bits = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                              0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
+    uint8x16_t sum0 = vpaddq_u8(vandq_u8(m[0], bits), vandq_u8(m[1], bits));
+    uint8x16_t sum1 = vpaddq_u8(vandq_u8(m[2], bits), vandq_u8(m[3], bits));
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+static void classify_block(const char *p, block_masks_t *masks)
+{
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lower_case = vdupq_n_u8(0x20);
+    const uint8x16_t open_brace = vdupq_n_u8('{');
+    const uint8x16_t close_brace = vdupq_n_u8('}');
+    const uint8x16_t colon = vdupq_n_u8(':');
+    const uint8x16_t comma = vdupq_n_u8(',');
+    uint8x16_t q[4], b[4], w[4], o[4];
+    for (int i = 0; i < INDEX_BLOCK_SIZE / 16; i++) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *) p + 16 * i);
+        /* '[' and ']' differ from '{' and '}' by 0x20 only */
+        uint8x16_t folded = vorrq_u8(chunk, lower_case);
+        q[i] = vceqq_u8(chunk, quote);
+        b[i] = vceqq_u8(chunk, backslash);
+        w[i] = vorrq_u8(vorrq_u8(vceqq_u8(chunk, space), vceqq_u8(chunk, tab)),
+                        vorrq_u8(vceqq_u8(chunk, lf), vceqq_u8(chunk, cr)));
+        o[i] = vorrq_u8(vorrq_u8(vceqq_u8(folded, open_brace),
+                                 vceqq_u8(folded, close_brace)),
+                        vorrq_u8(vceqq_u8(chunk, colon),
+                                 vceqq_u8(chunk, comma)));
+    }
+    masks->quote = neon_bitmask(q);
+    masks->backslash = neon_bitmask(b);
+    masks->whitespace = neon_bitmask(w);
+    masks->op = neon_bitmask(o);
+}
+#else
+static void classify_block(const char *p, block_masks_t *masks)
+{
+    *masks = (block_masks_t) { 0 };
+    for (int i = 0; i < INDEX_BLOCK_SIZE; i++) {
+        uint64_t bit = (uint64_t) 1 << i;
+        switch (p[i]) {
+            case '"':
+                masks->quote |= bit;
+                break;
+            case '\\':
+                masks->backslash |= bit;
+                break;
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                masks->whitespace |= bit;
+                break;
+            case '[':
+            case ']':
+            case '{':
+            case '}':
+            case ':':
+            case ',':
+                masks->op |= bit;
+                break;
+            default:
+                ;
+        }
+    }
+}
+#endif
+
+/* Return the mask of the bytes that are escaped by a backslash. Bit 0
+ * of *carry tells whether the first byte is escaped by a backslash at
+ * the end of the previous block; it is updated for the next block.
+ * Backslashes are rare enough to be handled one by one. */
+static uint64_t find_escaped(uint64_t backslash, uint64_t *carry)
+{
+    uint64_t escaped = *carry;
+    backslash &= ~escaped;
+    *carry = 0;
+    while (backslash) {
+        int i = __builtin_ctzll(backslash);
+        if (i == INDEX_BLOCK_SIZE - 1) {
+            *carry = 1;
+            break;
+        }
+        escaped |= (uint64_t) 2 << i;
+        backslash &= ~((uint64_t) 3 << i);
+    }
+    return escaped;
+}
+
+/* Bit i of the result is the parity of bits 0..i of x. */
+static uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+typedef struct {
+    uint32_t *offsets;
+    size_t count, capacity;
+} structural_index_t;
+
+static void build_structural_index(const char *buffer, size_t size,
+                                   structural_index_t *index)
+{
+    index->capacity = size / 8 + INDEX_BLOCK_SIZE;
+    index->offsets = fsalloc(index->capacity * sizeof *index->offsets);
+    index->count = 0;
+    uint64_t escape_carry = 0, string_carry = 0, scalar_carry = 0;
+    for (size_t base = 0; base < size; base += INDEX_BLOCK_SIZE) {
+        block_masks_t masks;
+        if (size - base >= INDEX_BLOCK_SIZE)
+            classify_block(buffer + base, &masks);
+        else {
+            char tail[INDEX_BLOCK_SIZE];
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, buffer + base, size - base);
+            classify_block(tail, &masks);
+        }
+        uint64_t escaped = find_escaped(masks.backslash, &escape_carry);
+        uint64_t quotes = masks.quote & ~escaped;
+        /* opening quotes and string contents but not closing quotes */
+        uint64_t in_string = prefix_xor(quotes) ^ string_carry;
+        string_carry = (uint64_t) -(in_string >> 63);
+        uint64_t scalar =
+            ~(masks.whitespace | masks.op | masks.quote | in_string);
+        uint64_t scalar_starts = scalar & ~(scalar << 1 | scalar_carry);
+        scalar_carry = scalar >> 63;
+        uint64_t structurals =
+            (masks.op & ~in_string) | (quotes & in_string) | scalar_starts;
+        if (index->capacity - index->count < INDEX_BLOCK_SIZE) {
+            index->capacity *= 2;
+            index->offsets = fsrealloc(index->offsets,
+                                       index->capacity *
+                                           sizeof *index->offsets);
+        }
+        while (structurals) {
+            index->offsets[index->count++] =
+                base + __builtin_ctzll(structurals);
+            structurals &= structurals - 1;
+        }
+    }
+}
+
+typedef struct {
+    decoder_t *dec;
+    const char *buffer, *end;
+    const uint32_t *offsets;
+    size_t count, next;
+} index_walk_t;
+
+/* Return the next token without consuming it, or NUL at the end. */
+static char peek_token(index_walk_t *walk)
+{
+    if (walk->next >= walk->count)
+        return '\0';
+    return walk->buffer[walk->offsets[walk->next]];
+}
+
+/* A token may not overlap the one that follows it. A scalar must in
+ * addition be followed by whitespace, a structural character or the
+ * end of the input. */
+static bool token_ends_at(index_walk_t *walk, const char *p, bool scalar)
+{
+    if (walk->next < walk->count &&
+        walk->buffer + walk->offsets[walk->next] < p) {
+        json_error();
+        return false;
+    }
+    if (!scalar || p == walk->end)
+        return true;
+    switch (*p) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+        case '[':
+        case ']':
+        case '{':
+        case '}':
+        case ':':
+        case ',':
+            return true;
+        default:
+            json_error();
+            return false;
+    }
+}
+
+/* Decode a field name and step over the colon after it. */
+static bool decode_indexed_key(index_walk_t *walk, decode_frame_t *frame)
+{
+    if (peek_token(walk) != '"') {
+        json_error();
+        return false;
+    }
+    const char *p = walk->buffer + walk->offsets[walk->next++];
+    char *key;
+    p = decode_string_value(walk->dec, p, walk->end, &key, &frame->len,
+                            &frame->key_flags);
+    if (!p)
+        return false;
+    frame->key = key;
+    if (!token_ends_at(walk, p, false) || peek_token(walk) != ':') {
+        json_error();
+        return false;
+    }
+    walk->next++;
+    return true;
+}
+
+static bool decode_indexed_scalar(index_walk_t *walk, const char *p,
+                                  json_thing_t **thing)
+{
+    p = decode_scalar(walk->dec, p, walk->end, thing);
+    if (!p)
+        return false;
+    if (!token_ends_at(walk, p, (*thing)->type != JSON_STRING)) {
+        decoder_discard(walk->dec, *thing);
+        return false;
+    }
+    return true;
+}
+
+/* Like decode() but walk the structural index. */
+static bool decode_indexed(index_walk_t *walk, json_thing_t **thing)
+{
+    unsigned limit = depth_limit();
+    work_stack_t stack;
+    stack_init(&stack, sizeof(decode_frame_t));
+    for (;;) {
+        json_thing_t *value;
+        if (stack.depth >= limit || walk->next >= walk->count) {
+            json_error();
+            break;
+        }
+        const char *p = walk->buffer + walk->offsets[walk->next++];
+        const char *packed;
+        if (*p == '[' && packs_numbers(walk->dec) &&
+            (packed = decode_packed(p, walk->end, stack.depth, &value))) {
+            /* step over the tokens inside */
+            while (walk->next < walk->count &&
+                   walk->buffer + walk->offsets[walk->next] < packed)
+                walk->next++;
+        } else if (*p == '[' || *p == '{') {
+            char closing = *p == '[' ? ']' : '}';
+            value = closing == ']' ? decoder_make_array(walk->dec)
+                                   : decoder_make_object(walk->dec);
+            if (peek_token(walk) == closing)
+                walk->next++;
+            else {
+                decode_frame_t *frame = stack_push(&stack);
+                STAT_MAX(max_depth, stack.depth);
+                frame->container = value;
+                frame->key = NULL;
+                if (closing == '}' && !decode_indexed_key(walk, frame))
+                    break;
+                continue;
+            }
+        } else if (!decode_indexed_scalar(walk, p, &value))
+            break;
+        /* the value is complete; close the containers it completes */
+        char token;
+        for (;;) {
+            if (!stack.depth) {
+                stack_release(&stack);
+                *thing = value;
+                return true;
+            }
+            decode_frame_t *frame = stack_top(&stack);
+            attach_decoded(walk->dec, frame, value);
+            char closing = frame->container->type == JSON_ARRAY ? ']' : '}';
+            token = peek_token(walk);
+            if (token != closing)
+                break;
+            walk->next++;
+            value = frame->container;
+            stack_pop(&stack);
+        }
+        if (token != ',') {
+            json_error();
+            break;
+        }
+        walk->next++;
+        decode_frame_t *frame = stack_top(&stack);
+        if (frame->container->type == JSON_OBJECT &&
+            !decode_indexed_key(walk, frame))
+            break;
+    }
+    discard_frames(walk->dec, &stack);
+    return false;
+}
+
+static json_thing_t *decode_indexed_document(decoder_t *dec,
+                                             const char *buffer, size_t size)
+{
+    structural_index_t index;
+    build_structural_index(buffer, size, &index);
+    index_walk_t walk = {
+        .dec = dec,
+        .buffer = buffer,
+        .end = buffer + size,
+        .offsets = index.offsets,
+        .count = index.count,
+        .next = 0,
+    };
+    json_thing_t *thing;
+    if (!decode_indexed(&walk, &thing))
+        thing = NULL;
+    else if (walk.next != walk.count) {
+        json_error();
+        decoder_discard(dec, thing);
+        thing = NULL;
+    }
+    fsfree(index.offsets);
+    return thing;
+}
+
+static json_thing_t *decode_text_document(decoder_t *dec, const char *buffer,
+                                          size_t size)
+{
+    const char *p = buffer;
+    const char *end = p + size;
+    json_thing_t *thing;
+    p = decode(dec, p, end, &thing);
+    if (!p)
+        return NULL;
+    p = skip_ws(p, end);
+    if (p != end) {
+        decoder_discard(dec, thing);
+        return NULL;
+    }
+    return thing;
+}
+
+static json_thing_t *decode_document(decoder_t *dec, const void *buffer,
+                                     size_t size)
+{
+    uint64_t t0 = STAT_CLOCK();
+    json_thing_t *thing;
+    /* the offsets in a structural index are 32 bits wide */
+    if (dec->flags & JSON_DECODE_STRUCTURAL_INDEX && size <= UINT32_MAX)
+        thing = decode_indexed_document(dec, buffer, size);
+    else
+        thing = decode_text_document(dec, buffer, size);
+    STAT_ADD(decode_calls, 1);
+    STAT_ADD(decoded_bytes, size);
+    STAT_ADD(decode_nanoseconds, STAT_CLOCK() - t0);
+    return thing;
+}
+
+json_thing_t *json_utf8_decode(const void *buffer, size_t size)
+{
+    decoder_t dec = { .arena = NULL, .flags = 0 };
+    return decode_document(&dec, buffer, size);
+}
+
+json_thing_t *json_utf8_decode_ex(const void *buffer, size_t size,
+                                  unsigned flags)
+{
+    decoder_t dec = { .arena = NULL, .flags = flags };
+    return decode_document(&dec, buffer, size);
+}
+
+json_thing_t *json_decoder_decode(json_decoder_t *decoder,
+                                  const void *buffer, size_t size,
+                                  unsigned flags)
+{
+    decoder_t dec = { .arena = NULL, .pools = decoder, .flags = flags };
+    return decode_document(&dec, buffer, size);
+}
+
+json_thing_t *json_utf8_decode_in_arena(json_arena_t *arena,
+                                        const void *buffer, size_t size)
+{
+    decoder_t dec = { .arena = arena, .flags = 0 };
+    return decode_document(&dec, buffer, size);
+}
+
+json_thing_t *json_utf8_decode_string(const char *encoding)
+{
+    return json_utf8_decode(encoding, strlen(encoding));
+}
+
+/* The push parser is a state machine over bytes. Containers are
+ * attached to their parents as soon as they are opened so that the
+ * partial decoding is always a single tree. Scalar tokens are lexed
+ * with the ordinary lexers once they are complete; a token that
+ * straddles chunks is collected into a buffer first. */
+
+enum {
+    PARSER_VALUE,        /* expecting a value */
+    PARSER_ARRAY_START,  /* expecting a value or ']' */
+    PARSER_OBJECT_START, /* expecting a field name or '}' */
+    PARSER_NAME,         /* expecting a field name */
+    PARSER_COLON,        /* expecting ':' */
+    PARSER_NEXT,         /* expecting ',' or the end of the container */
+    PARSER_DONE,         /* expecting nothing but whitespace */
+    PARSER_STRING,       /* inside a string value or field name */
+    PARSER_NUMBER,       /* inside a number */
+    PARSER_LITERAL,      /* inside true, false or null */
+    PARSER_ERROR
+};
+
+typedef struct {
+    json_thing_t *container;
+    char *name; /* the pending field name of an object, or NULL */
+    size_t name_len;
+} parser_frame_t;
+
+struct json_parser {
+    decoder_t dec;
+    int state;
+    json_thing_t *root; /* NULL until the first value is started */
+    parser_frame_t *stack;
+    size_t depth, stack_capacity;
+    bool name;   /* the string token is a field name */
+    bool escape; /* the string token ends with an active backslash */
+    char *token; /* the part of the token in the previous chunks */
+    size_t token_size, token_capacity;
+};
+
+static void reset_parser(json_parser_t *parser)
+{
+    parser->state = PARSER_VALUE;
+    parser->root = NULL;
+    parser->depth = 0;
+    parser->token_size = 0;
+}
+
+json_parser_t *json_make_parser(void)
+{
+    json_parser_t *parser = fsalloc(sizeof *parser);
+    parser->dec = (decoder_t) { .arena = NULL, .flags = 0 };
+    parser->stack = NULL;
+    parser->stack_capacity = 0;
+    parser->token = NULL;
+    parser->token_capacity = 0;
+    reset_parser(parser);
+    return parser;
+}
+
+static void discard_parse(json_parser_t *parser)
+{
+    size_t i;
+    for (i = 0; i < parser->depth; i++)
+        fsfree(parser->stack[i].name);
+    if (parser->root)
+        json_destroy_thing(parser->root);
+    reset_parser(parser);
+}
+
+void json_destroy_parser(json_parser_t *parser)
+{
+    discard_parse(parser);
+    fsfree(parser->stack);
+    fsfree(parser->token);
+    fsfree(parser);
+}
+
+static bool parser_fail(json_parser_t *parser)
+{
+    json_error();
+    discard_parse(parser);
+    parser->state = PARSER_ERROR;
+    return false;
+}
+
+static void append_token(json_parser_t *parser, const char *p, size_t size)
+{
+    if (parser->token_capacity - parser->token_size < size) {
+        while (parser->token_capacity - parser->token_size < size)
+            parser->token_capacity = parser->token_capacity
+                ? 2 * parser->token_capacity
+                : 64;
+        parser->token = fsrealloc(parser->token, parser->token_capacity);
+    }
+    memcpy(parser->token + parser->token_size, p, size);
+    parser->token_size += size;
+}
+
+/* Add a complete value or a freshly opened container to the parse. */
+static void attach_value(json_parser_t *parser, json_thing_t *thing)
+{
+    if (!parser->depth) {
+        parser->root = thing;
+        parser->state = PARSER_DONE;
+        return;
+    }
+    parser_frame_t *top = &parser->stack[parser->depth - 1];
+    if (top->container->type == JSON_ARRAY)
+        append_element(NULL, top->container, thing);
+    else {
+        append_field(NULL, top->container, top->name, top->name_len, 0,
+                     thing);
+        top->name = NULL;
+    }
+    parser->state = PARSER_NEXT;
+}
+
+static bool open_container(json_parser_t *parser, json_thing_t *container)
+{
+    attach_value(parser, container);
+    if (parser->depth == parser->stack_capacity) {
+        parser->stack_capacity = parser->stack_capacity
+            ? 2 * parser->stack_capacity
+            : 16;
+        parser->stack = fsrealloc(parser->stack,
+                                  parser->stack_capacity *
+                                      sizeof parser->stack[0]);
+    }
+    parser->stack[parser->depth++] = (parser_frame_t) {
+        .container = container,
+        .name = NULL,
+    };
+    STAT_MAX(max_depth, parser->depth);
+    parser->state = container->type == JSON_ARRAY ? PARSER_ARRAY_START
+                                                  : PARSER_OBJECT_START;
+    return true;
+}
+
+static void close_container(json_parser_t *parser)
+{
+    parser->depth--;
+    parser->state = parser->depth ? PARSER_NEXT : PARSER_DONE;
+}
+
+/* Handle the first byte of a value. Return the position where the
+ * token continues or NULL in case of an error. */
+static const char *start_value(json_parser_t *parser, const char *p)
+{
+    if (parser->depth >= depth_limit())
+        return NULL;
+    switch (*p) {
+        case '[':
+            open_container(parser, json_make_array());
+            return p + 1;
+        case '{':
+            open_container(parser, json_make_object());
+            return p + 1;
+        case '"':
+            parser->state = PARSER_STRING;
+            parser->name = false;
+            parser->escape = false;
+            return p + 1;
+        case '-':
+            parser->state = PARSER_NUMBER;
+            return p;
+        case 't':
+        case 'f':
+        case 'n':
+            parser->state = PARSER_LITERAL;
+            return p;
+        default:
+            if (*p >= '0' && *p <= '9') {
+                parser->state = PARSER_NUMBER;
+                return p;
+            }
+            return NULL;
+    }
+}
+
+/* Handle a byte other than whitespace outside tokens. Return the
+ * position of the next byte or NULL in case of an error. */
+static const char *parse_structure(json_parser_t *parser, const char *p)
+{
+    parser_frame_t *top = parser->depth ? &parser->stack[parser->depth - 1]
+                                        : NULL;
+    switch (parser->state) {
+        case PARSER_ARRAY_START:
+            if (*p == ']') {
+                close_container(parser);
+                return p + 1;
+            }
+            return start_value(parser, p);
+        case PARSER_VALUE:
+            return start_value(parser, p);
+        case PARSER_OBJECT_START:
+            if (*p == '}') {
+                close_container(parser);
+                return p + 1;
+            }
+            /* fall through */
+        case PARSER_NAME:
+            if (*p != '"')
+                return NULL;
+            parser->state = PARSER_STRING;
+            parser->name = true;
+            parser->escape = false;
+            return p + 1;
+        case PARSER_COLON:
+            if (*p != ':')
+                return NULL;
+            parser->state = PARSER_VALUE;
+            return p + 1;
+        case PARSER_NEXT:
+            if (*p == ',') {
+                parser->state = top->container->type == JSON_ARRAY
+                    ? PARSER_VALUE
+                    : PARSER_NAME;
+                return p + 1;
+            }
+            if (*p != (top->container->type == JSON_ARRAY ? ']' : '}'))
+                return NULL;
+            close_container(parser);
+            return p + 1;
+        default:
+            return NULL;
+    }
+}
+
+static bool is_number_char(char c)
+{
+    switch (c) {
+        case '-':
+        case '+':
+        case '.':
+        case 'e':
+        case 'E':
+            return true;
+        default:
+            return c >= '0' && c <= '9';
+    }
+}
+
+/* Advance *p over the token. Return true if the token ends within the
+ * chunk, in which case *p points right after it. */
+static bool scan_token(json_parser_t *parser, const char **p, const char *end)
+{
+    const char *q = *p;
+    switch (parser->state) {
+        case PARSER_STRING:
+            while (q < end) {
+                if (parser->escape) {
+                    parser->escape = false;
+                    q++;
+                    continue;
+                }
+                q += clean_run_length(q, end);
+                if (q == end)
+                    break;
+                if (*q == '"') {
+                    *p = q + 1;
+                    return true;
+                }
+                if (*q == '\\')
+                    parser->escape = true;
+                q++;
+            }
+            break;
+        case PARSER_NUMBER:
+            while (q < end && is_number_char(*q))
+                q++;
+            break;
+        default:
+            while (q < end && *q >= 'a' && *q <= 'z')
+                q++;
+    }
+    *p = q;
+    return q < end;
+}
+
+/* Lex the complete token between start and end. */
+static bool finish_token(json_parser_t *parser, const char *start,
+                         const char *end)
+{
+    json_thing_t *thing;
+    const char *q;
+    switch (parser->state) {
+        case PARSER_STRING:
+            if (parser->name) {
+                parser_frame_t *top = &parser->stack[parser->depth - 1];
+                unsigned flags;
+                if (!decode_string_value(&parser->dec, start, end, &top->name,
+                                         &top->name_len, &flags))
+                    return false;
+                parser->state = PARSER_COLON;
+                return true;
+            }
+            q = decode_string(&parser->dec, start, end, &thing);
+            break;
+        case PARSER_NUMBER:
+            q = decode_number(&parser->dec, start, end, &thing);
+            break;
+        default:
+            switch (*start) {
+                case 't':
+                    q = decode_true(&parser->dec, start, end, &thing);
+                    break;
+                case 'f':
+                    q = decode_false(&parser->dec, start, end, &thing);
+                    break;
+                default:
+                    q = decode_null(&parser->dec, start, end, &thing);
+            }
+    }
+    if (!q)
+        return false;
+    if (q != end) {
+        json_destroy_thing(thing);
+        return false;
+    }
+    attach_value(parser, thing);
+    return true;
+}
+
+static bool is_token_state(int state)
+{
+    return state == PARSER_STRING || state == PARSER_NUMBER ||
+        state == PARSER_LITERAL;
+}
+
+static bool parse_chunk(json_parser_t *parser, const char *chunk,
+                        size_t size)
+{
+    const char *p = chunk;
+    const char *end = p + size;
+    const char *token = p; /* where the current token starts in the chunk */
+    for (;;) {
+        if (parser->state == PARSER_ERROR)
+            return false;
+        if (is_token_state(parser->state)) {
+            if (!scan_token(parser, &p, end)) {
+                append_token(parser, token, end - token);
+                return true;
+            }
+            bool ok;
+            if (parser->token_size) {
+                append_token(parser, token, p - token);
+                ok = finish_token(parser, parser->token,
+                                  parser->token + parser->token_size);
+                parser->token_size = 0;
+            } else
+                ok = finish_token(parser, token, p);
+            if (!ok)
+                return parser_fail(parser);
+            continue;
+        }
+        p = skip_ws(p, end);
+        if (p == end)
+            return true;
+        token = p;
+        p = parse_structure(parser, p);
+        if (!p)
+            return parser_fail(parser);
+    }
+}
+
+static json_thing_t *finish_parse(json_parser_t *parser)
+{
+    /* a number or a literal may end with the input */
+    if (parser->state == PARSER_NUMBER || parser->state == PARSER_LITERAL) {
+        bool ok = finish_token(parser, parser->token,
+                               parser->token + parser->token_size);
+        parser->token_size = 0;
+        if (!ok)
+            parser_fail(parser);
+    }
+    if (parser->state != PARSER_DONE) {
+        if (parser->state != PARSER_ERROR)
+            json_error();
+        discard_parse(parser);
         return NULL;
     }
-    if (!p || exhausted(p, end))
+    json_thing_t *thing = parser->root;
+    reset_parser(parser);
+    return thing;
+}
+
+bool json_parser_feed(json_parser_t *parser, const void *chunk, size_t size)
+{
+    uint64_t t0 = STAT_CLOCK();
+    bool ok = parse_chunk(parser, chunk, size);
+    STAT_ADD(decoded_bytes, size);
+    STAT_ADD(decode_nanoseconds, STAT_CLOCK() - t0);
+    return ok;
+}
+
+json_thing_t *json_parser_finish(json_parser_t *parser)
+{
+    uint64_t t0 = STAT_CLOCK();
+    json_thing_t *thing = finish_parse(parser);
+    STAT_ADD(decode_calls, 1);
+    STAT_ADD(decode_nanoseconds, STAT_CLOCK() - t0);
+    return thing;
+}
+
+/* The event scanner validates the encoding exactly like the tree
+ * decoder but only reports what it sees. Strings without escape
+ * sequences are reported straight from the buffer; the others are
+ * unescaped into a scratch buffer that is reused for the whole scan.
+ * The nesting of containers is tracked in a work stack, which keeps
+ * the C stack flat however deep the input is nested. */
+
+typedef struct {
+    const json_callbacks_t *cb;
+    void *ctx;
+    bool aborted; /* a callback returned false */
+    char *scratch;
+    size_t scratch_size;
+} scanner_t;
+
+static bool scan_event(scanner_t *scanner, bool outcome)
+{
+    if (!outcome)
+        scanner->aborted = true;
+    return outcome;
+}
+
+static const char *scan_string_event(scanner_t *scanner, const char *p,
+                                     const char *end, bool key)
+{
+    const char *closing;
+    ssize_t size = scan_string_repr(p, end, &closing);
+    if (size < 0)
         return NULL;
-    if ((*p & 0xc0) != 0x80) {
+    bool (*cb)(void *, const char *, size_t) =
+        key ? scanner->cb->key : scanner->cb->string;
+    if (!cb)
+        return closing + 1;
+    const char *value = p + 1;
+    if (closing - p - 1 != size) {
+        if (scanner->scratch_size < size + 1) {
+            scanner->scratch_size = size + 1;
+            scanner->scratch = fsrealloc(scanner->scratch, size + 1);
+        }
+        unescape_string(p, end, scanner->scratch);
+        value = scanner->scratch;
+    }
+    if (!scan_event(scanner, cb(scanner->ctx, value, size)))
+        return NULL;
+    return closing + 1;
+}
+
+/* Scan a field name and the colon after it. */
+static const char *scan_name(scanner_t *scanner, const char *p,
+                             const char *end)
+{
+    p = skip_ws(p, end);
+    if (exhausted(p, end))
+        return NULL;
+    if (*p != '"') {
         json_error();
         return NULL;
     }
-    p = skip(p, end, *p);
-    if (!(c0 & 0x20))
-        return p;
-    if (!p || exhausted(p, end))
+    p = scan_string_event(scanner, p, end, true);
+    return skip_ws(skip(skip_ws(p, end), end, ':'), end);
+}
+
+static const char *scan_scalar(scanner_t *scanner, const char *p,
+                               const char *end)
+{
+    const json_callbacks_t *cb = scanner->cb;
+    void *ctx = scanner->ctx;
+    number_t number;
+    switch (*p) {
+        case '"':
+            return scan_string_event(scanner, p, end, false);
+        case 't':
+        case 'f': {
+            bool truth_value = *p == 't';
+            p = skip_literal(p, end, truth_value ? "true" : "false");
+            if (p && cb->boolean &&
+                !scan_event(scanner, cb->boolean(ctx, truth_value)))
+                return NULL;
+            return p;
+        }
+        case 'n':
+            p = skip_literal(p, end, "null");
+            if (p && cb->null && !scan_event(scanner, cb->null(ctx)))
+                return NULL;
+            return p;
+        default:
+            if (*p != '-' && (*p < '0' || *p > '9')) {
+                json_error();
+                return NULL;
+            }
+            p = lex_number(p, end, &number);
+            if (!p)
+                return NULL;
+            switch (number.type) {
+                case JSON_INTEGER:
+                    if (cb->integer &&
+                        !scan_event(scanner, cb->integer(ctx, number.integer)))
+                        return NULL;
+                    break;
+                case JSON_UNSIGNED:
+                    if (cb->unsigned_integer &&
+                        !scan_event(scanner,
+                                    cb->unsigned_integer(ctx,
+                                                         number.u_integer)))
+                        return NULL;
+                    break;
+                default:
+                    if (cb->real &&
+                        !scan_event(scanner, cb->real(ctx, number.real)))
+                        return NULL;
+            }
+            return p;
+    }
+}
+
+/* The work stack tells for each open container whether it is an
+ * object. */
+static bool scan_values(scanner_t *scanner, const char *p, const char *end,
+                        work_stack_t *in_object)
+{
+    const json_callbacks_t *cb = scanner->cb;
+    void *ctx = scanner->ctx;
+    unsigned limit = depth_limit();
+    for (;;) {
+        /* a value is expected */
+        p = skip_ws(p, end);
+        if (exhausted(p, end))
+            return false;
+        if (in_object->depth >= limit) {
+            json_error();
+            return false;
+        }
+        switch (*p) {
+            case '[':
+                if (cb->start_array &&
+                    !scan_event(scanner, cb->start_array(ctx)))
+                    return false;
+                *(bool *) stack_push(in_object) = false;
+                STAT_MAX(max_depth, in_object->depth);
+                p = skip_ws(p + 1, end);
+                if (exhausted(p, end))
+                    return false;
+                if (*p != ']')
+                    continue;
+                break;
+            case '{':
+                if (cb->start_object &&
+                    !scan_event(scanner, cb->start_object(ctx)))
+                    return false;
+                *(bool *) stack_push(in_object) = true;
+                STAT_MAX(max_depth, in_object->depth);
+                p = skip_ws(p + 1, end);
+                if (exhausted(p, end))
+                    return false;
+                if (*p != '}') {
+                    p = scan_name(scanner, p, end);
+                    if (!p)
+                        return false;
+                    continue;
+                }
+                break;
+            default:
+                p = scan_scalar(scanner, p, end);
+                if (!p)
+                    return false;
+        }
+        /* a value is complete; close containers until another value
+         * is expected */
+        for (;;) {
+            p = skip_ws(p, end);
+            if (!in_object->depth) {
+                if (p == end)
+                    return true;
+                json_error();
+                return false;
+            }
+            if (exhausted(p, end))
+                return false;
+            bool object = *(bool *) stack_top(in_object);
+            if (*p == ',') {
+                p++;
+                if (object && !(p = scan_name(scanner, p, end)))
+                    return false;
+                break;
+            }
+            if (*p != (object ? '}' : ']')) {
+                json_error();
+                return false;
+            }
+            p++;
+            stack_pop(in_object);
+            bool (*end_cb)(void *) = object ? cb->end_object : cb->end_array;
+            if (end_cb && !scan_event(scanner, end_cb(ctx)))
+                return false;
+        }
+    }
+}
+
+static bool scan_document(scanner_t *scanner, const char *p, const char *end)
+{
+    work_stack_t in_object;
+    stack_init(&in_object, sizeof(bool));
+    bool ok = scan_values(scanner, p, end, &in_object);
+    stack_release(&in_object);
+    return ok;
+}
+
+bool json_utf8_scan(const void *buffer, size_t size,
+                    const json_callbacks_t *cb, void *ctx)
+{
+    scanner_t scanner = {
+        .cb = cb,
+        .ctx = ctx,
+        .aborted = false,
+        .scratch = NULL,
+        .scratch_size = 0,
+    };
+    uint64_t t0 = STAT_CLOCK();
+    const char *p = buffer;
+    bool ok = scan_document(&scanner, p, p + size);
+    fsfree(scanner.scratch);
+    if (!ok && !scanner.aborted)
+        errno = EINVAL;
+    STAT_ADD(decode_calls, 1);
+    STAT_ADD(decoded_bytes, size);
+    STAT_ADD(decode_nanoseconds, STAT_CLOCK() - t0);
+    return ok;
+}
+
+json_thing_t *json_utf8_decode_lazy(const void *buffer, size_t size)
+{
+    static const json_callbacks_t no_callbacks;
+    scanner_t scanner = {
+        .cb = &no_callbacks,
+        .scratch = NULL,
+    };
+    const char *p = buffer;
+    if (!scan_document(&scanner, p, p + size))
         return NULL;
-    if ((*p & 0xc0) != 0x80) {
-        json_error();
+    decoder_t dec = {
+        .arena = NULL,
+        .flags = JSON_DECODE_ZERO_COPY | DECODE_LAZY,
+    };
+    return decode_document(&dec, buffer, size);
+}
+
+static char *read_file(FILE *f, size_t max_size, size_t *size)
+{
+    size_t nbytes = 512;
+    char *buffer = fsalloc(nbytes);
+    *size = 0;
+    for (;;) {
+        char buf[4096];
+        size_t count = fread(buf, 1, sizeof buf, f);
+        if (ferror(f)) {
+            fsfree(buffer);
+            return NULL;
+        }
+        if (count == 0)
+            break;
+        if (count > max_size - *size) {
+            errno = ENOMEM;
+            fsfree(buffer);
+            return NULL;
+        }
+        size_t n = *size + count;
+        if (nbytes < n) {
+            if (n > max_size / 2)
+                nbytes = max_size;
+            else {
+                nbytes = 1;
+                while (nbytes < n)
+                    nbytes <<= 1;
+            }
+            char *ptr = fsrealloc(buffer, nbytes);
+            STAT_ADD(read_bytes, nbytes);
+            buffer = ptr;
+        }
+        memcpy(buffer + *size, buf, count);
+        *size += count;
+    }
+    return buffer;
+}
+
+json_thing_t *json_utf8_decode_file(FILE *f, size_t max_size)
+{
+    size_t size;
+    char *buffer = read_file(f, max_size, &size);
+    if (!buffer)
+        return NULL;
+    json_thing_t *thing = json_utf8_decode(buffer, size);
+    fsfree(buffer);
+    if (!thing) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return thing;
+}
+
+/* Read the rest of a pipe, a socket or the like directly into a
+ * growing buffer. */
+static char *read_fd(int fd, size_t max_size, size_t *size)
+{
+    size_t nbytes = 4096;
+    char *buffer = fsalloc(nbytes);
+    STAT_ADD(read_bytes, nbytes);
+    *size = 0;
+    for (;;) {
+        if (*size == nbytes) {
+            nbytes = nbytes <= max_size / 2 ? 2 * nbytes : max_size + 1;
+            buffer = fsrealloc(buffer, nbytes);
+            STAT_ADD(read_bytes, nbytes);
+        }
+        ssize_t count = read(fd, buffer + *size, nbytes - *size);
+        if (count < 0) {
+            fsfree(buffer);
+            return NULL;
+        }
+        if (count == 0)
+            return buffer;
+        if (count > max_size - *size) {
+            errno = ENOMEM;
+            fsfree(buffer);
+            return NULL;
+        }
+        *size += count;
+    }
+}
+
+static json_thing_t *decode_unmapped(int fd, size_t max_size)
+{
+    size_t size;
+    char *buffer = read_fd(fd, max_size, &size);
+    if (!buffer)
+        return NULL;
+    json_thing_t *thing = json_utf8_decode(buffer, size);
+    fsfree(buffer);
+    if (!thing) {
+        errno = EINVAL;
         return NULL;
     }
-    p = skip(p, end, *p);
-    if (!(c0 & 0x10))
-        return p;
-    if (c0 & 0x08) {
-        json_error();
+    return thing;
+}
+
+json_thing_t *json_utf8_decode_fd(int fd, size_t max_size)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
         return NULL;
-    }
-    if (!p || exhausted(p, end))
+    off_t offset = S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (offset < 0 || offset >= st.st_size)
+        return decode_unmapped(fd, max_size);
+    if ((uint64_t) (st.st_size - offset) > max_size) {
+        errno = ENOMEM;
         return NULL;
-    if ((*p & 0xc0) != 0x80) {
-        json_error();
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return decode_unmapped(fd, max_size);
+    (void) posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+    json_thing_t *thing = json_utf8_decode(map + offset, size - offset);
+    munmap(map, size);
+    /* leave the file offset where read(2) would have left it */
+    lseek(fd, st.st_size, SEEK_SET);
+    if (!thing) {
+        errno = EINVAL;
         return NULL;
     }
-    return skip(p, end, *p);
+    return thing;
 }
 
-static ssize_t scan_string_repr(const char *p, const char *end)
+json_thing_t *json_utf8_decode_path(const char *path, size_t max_size)
 {
-    size_t count = 0;
-    p = skip(p, end, '"');
-    while (p && !exhausted(p, end))
-        switch (*p) {
-            case '\\':
-                p = skip(p, end, '\\');
-                if (!p || exhausted(p, end))
-                    return -1;
-                if (*p & 0x80) {
-                    json_error();
-                    return -1;
-                }
-                if (*p != 'u') {
-                    count++;
-                    p = skip(p, end, *p);
-                } else {
-                    p = skip(p, end, 'u');
-                    int unic;
-                    p = scan_utf16(p, end, &unic);
-                    if (!p)
-                        return -1;
-                    count += utf8_length(unic);
-                }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    json_thing_t *thing = json_utf8_decode_fd(fd, max_size);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return thing;
+}
+
+/* NDJSON decoding splits the input into chunks that end at line
+ * boundaries. Each chunk is decoded into the arena of its work unit
+ * by a pool of worker threads while the calling thread reads ahead
+ * and delivers the records of finished units. Workers share nothing
+ * but the unit table. Everything a worker produces lives in the arena
+ * of the unit, and the arenas keep their chunks from one chunk of
+ * input to the next, so the workers hardly ever call the allocator. */
+
+enum {
+    NDJSON_DEFAULT_CHUNK_SIZE = 1 << 20,
+    NDJSON_UNITS_PER_WORKER = 2,
+};
+
+typedef enum {
+    UNIT_FREE,      /* owned by the calling thread */
+    UNIT_READY,     /* waiting for a worker */
+    UNIT_BUSY,      /* being decoded by a worker */
+    UNIT_DONE,      /* waiting for delivery */
+    UNIT_DELIVERING /* owned by the calling thread */
+} unit_state_t;
+
+typedef struct {
+    size_t offset;
+    json_thing_t *thing; /* NULL for a syntax error */
+} ndjson_record_t;
+
+typedef struct {
+    unit_state_t state;
+    size_t seq;
+    const char *start, *end;
+    size_t offset; /* of start in the input */
+    char *input;   /* a copy of the chunk when reading from a file */
+    size_t input_capacity;
+    json_arena_t *arena;
+    ndjson_record_t *records; /* in the arena */
+    size_t count, capacity;
+} ndjson_unit_t;
+
+typedef struct {
+    size_t chunk_size;
+    size_t offset; /* of the next chunk in the input */
+    const char *next, *end; /* for a buffer */
+    FILE *file;             /* or NULL */
+    char *carry;            /* a partial line read from the file */
+    size_t carry_size, carry_capacity;
+    bool error; /* reading the file failed */
+} ndjson_source_t;
+
+static void init_unit(ndjson_unit_t *unit)
+{
+    unit->state = UNIT_FREE;
+    unit->input = NULL;
+    unit->input_capacity = 0;
+    unit->arena = json_make_arena();
+    unit->records = NULL;
+    unit->count = unit->capacity = 0;
+}
+
+static void deinit_unit(ndjson_unit_t *unit)
+{
+    fsfree(unit->input);
+    json_destroy_arena(unit->arena);
+}
+
+static void ensure_capacity(char **buffer, size_t *capacity, size_t size)
+{
+    if (*capacity >= size)
+        return;
+    while (*capacity < size)
+        *capacity = *capacity ? 2 * *capacity : 4096;
+    *buffer = fsrealloc(*buffer, *capacity);
+    STAT_ADD(read_bytes, *capacity);
+}
+
+/* Prepend the carry to whatever else is read from the file into the
+ * unit until the unit holds at least one complete line or the file is
+ * exhausted. The incomplete last line is carried over to the next
+ * chunk. */
+static bool read_chunk(ndjson_source_t *source, ndjson_unit_t *unit)
+{
+    size_t size = source->carry_size;
+    ensure_capacity(&unit->input, &unit->input_capacity,
+                    size + source->chunk_size);
+    if (size)
+        memcpy(unit->input, source->carry, size);
+    const char *last_newline = NULL;
+    while (!last_newline) {
+        ensure_capacity(&unit->input, &unit->input_capacity,
+                        size + source->chunk_size);
+        size_t count =
+            fread(unit->input + size, 1, unit->input_capacity - size,
+                  source->file);
+        if (ferror(source->file)) {
+            source->error = true;
+            return false;
+        }
+        if (!count)
+            break;
+        const char *p;
+        for (p = unit->input + size + count; p > unit->input + size; p--)
+            if (p[-1] == '\n') {
+                last_newline = p - 1;
                 break;
-            case '"':
-                /* Theoretically, count might have overflowed the signed
-                 * range. That works perfectly. */
-                return count;
-            default: {
-                const char *p0 = p;
-                p = skip_utf8(p, end);
-                count += p - p0;
             }
+        size += count;
+    }
+    const char *end = last_newline ? last_newline + 1 : unit->input + size;
+    source->carry_size = unit->input + size - end;
+    ensure_capacity(&source->carry, &source->carry_capacity,
+                    source->carry_size);
+    if (source->carry_size)
+        memcpy(source->carry, end, source->carry_size);
+    if (end == unit->input)
+        return false;
+    unit->start = unit->input;
+    unit->end = end;
+    return true;
+}
+
+/* Assign the next chunk of the input to the unit. Return false at the
+ * end of the input. */
+static bool next_chunk(ndjson_source_t *source, ndjson_unit_t *unit)
+{
+    if (source->file) {
+        if (!read_chunk(source, unit))
+            return false;
+    } else {
+        const char *p = source->next;
+        if (p == source->end)
+            return false;
+        const char *end = source->end;
+        if (end - p > source->chunk_size) {
+            const char *newline = memchr(p + source->chunk_size - 1, '\n',
+                                         end - p - source->chunk_size + 1);
+            if (newline)
+                end = newline + 1;
         }
-    return -1;
+        unit->start = p;
+        unit->end = source->next = end;
+    }
+    unit->offset = source->offset;
+    source->offset += unit->end - unit->start;
+    return true;
 }
 
-static const char *decode_string_value(const char *p, const char *end,
-                                       char **value, size_t *len)
+static void decode_unit(ndjson_unit_t *unit, unsigned flags)
 {
-    ssize_t size = scan_string_repr(p, end);
-    if (size < 0)
-        return NULL;
-    *len = size;
-    char *buffer = *value = fsalloc(size + 1);
-    p = skip(p, end, '"');
-    char *q = buffer;
-    /* scan_string_repr() above has already validated the string; no
-     * need to do bounds or error checking */
-    while (*p != '"')
-        if (*p != '\\')
-            *q++ = *p++;
-        else {
-            p++;
-            switch (*p) {
-                case 'b':
-                    *q++ = '\b', p++;
-                    break;
-                case 'f':
-                    *q++ = '\f', p++;
-                    break;
-                case 'n':
-                    *q++ = '\n', p++;
-                    break;
-                case 'r':
-                    *q++ = '\r', p++;
-                    break;
-                case 't':
-                    *q++ = '\t', p++;
-                    break;
-                case 'u': {
-                    int unic;
-                    p = scan_utf16(p + 1, end, &unic);
-                    q = utf8_encode(q, unic);
-                } break;
-                default:
-                    *q++ = *p++;
+    decoder_t dec = { .arena = unit->arena, .flags = flags };
+    const char *p = unit->start;
+    while (p < unit->end) {
+        const char *end = memchr(p, '\n', unit->end - p);
+        if (!end)
+            end = unit->end;
+        if (skip_ws(p, end) != end) {
+            if (unit->count == unit->capacity) {
+                size_t capacity = unit->capacity ? 2 * unit->capacity : 64;
+                unit->records =
+                    arena_realloc(unit->arena, unit->records,
+                                  unit->capacity * sizeof unit->records[0],
+                                  capacity * sizeof unit->records[0]);
+                unit->capacity = capacity;
             }
+            ndjson_record_t *record = &unit->records[unit->count++];
+            record->offset = unit->offset + (p - unit->start);
+            record->thing = decode_document(&dec, p, end - p);
         }
-    *q = '\0';
-    return p + 1;
+        p = end + 1;
+    }
 }
 
-static const char *decode_string(const char *p, const char *end,
-                                 json_thing_t **thing)
+static bool deliver_unit(ndjson_unit_t *unit, json_record_cb_t record,
+                         void *ctx)
 {
-    char *value;
-    size_t len;
-    p = decode_string_value(p, end, &value, &len);
-    if (p)
-        *thing = json_adopt_bounded_string(value, len);
-    return p;
+    bool ok = true;
+    size_t i;
+    for (i = 0; ok && i < unit->count; i++)
+        ok = record(ctx, unit->records[i].offset, unit->records[i].thing);
+    unit->records = NULL;
+    unit->count = unit->capacity = 0;
+    json_clear_arena(unit->arena);
+    return ok;
 }
 
-static const char *decode_number(const char *start, const char *end,
-                                 json_thing_t **thing)
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    ndjson_unit_t *units;
+    size_t num_units;
+    unsigned flags;
+    bool quit;
+} ndjson_pool_t;
+
+/* Return the unit in the given state with the lowest sequence number
+ * or NULL. */
+static ndjson_unit_t *find_unit(ndjson_pool_t *pool, unit_state_t state)
 {
-    size_t size = end - start;
-    binary64_float_t dec;
-    bool exact;
-    ssize_t count = binary64_parse_decimal(start, size, &dec, &exact);
-    if (count < 0) {
-        json_error();
-        return NULL;
+    ndjson_unit_t *found = NULL;
+    size_t i;
+    for (i = 0; i < pool->num_units; i++) {
+        ndjson_unit_t *unit = &pool->units[i];
+        if (unit->state == state && (!found || unit->seq < found->seq))
+            found = unit;
     }
-    const char *good = start + count;
-    if (dec.type == BINARY64_TYPE_ZERO) {
-        *thing = json_make_unsigned(0); /* no negative zero */
-        return good;
+    return found;
+}
+
+static void *ndjson_worker(void *arg)
+{
+    ndjson_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        ndjson_unit_t *unit = find_unit(pool, UNIT_READY);
+        if (!unit) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        unit->state = UNIT_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+        decode_unit(unit, pool->flags);
+        pthread_mutex_lock(&pool->lock);
+        unit->state = UNIT_DONE;
+        pthread_cond_signal(&pool->done);
     }
-    if (dec.type != BINARY64_TYPE_NORMAL) {
-        json_error(); /* no special values in JSON */
-        return NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool ndjson_serially(ndjson_source_t *source, unsigned flags,
+                            json_record_cb_t record, void *ctx)
+{
+    ndjson_unit_t unit;
+    init_unit(&unit);
+    bool ok = true;
+    while (ok && next_chunk(source, &unit)) {
+        decode_unit(&unit, flags);
+        ok = deliver_unit(&unit, record, ctx);
     }
-    if (exact && dec.exponent >= 0) {
-        uint64_t significand = dec.significand;
-        int32_t exponent = dec.exponent;
-        while (exponent-- && significand <= (uint64_t) -1 / 10)
-            significand *= 10;
-        if (exponent == -1) {
-            if (!dec.negative) {
-                *thing = json_make_unsigned(significand);
-                return good;
+    deinit_unit(&unit);
+    return ok;
+}
+
+static bool ndjson_in_parallel(ndjson_source_t *source,
+                               const json_ndjson_options_t *options,
+                               json_record_cb_t record, void *ctx)
+{
+    ndjson_pool_t pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.num_units = NDJSON_UNITS_PER_WORKER * options->num_workers;
+    pool.units = fsalloc(pool.num_units * sizeof pool.units[0]);
+    size_t i;
+    for (i = 0; i < pool.num_units; i++)
+        init_unit(&pool.units[i]);
+    pool.flags = options->flags;
+    pool.quit = false;
+    pthread_t *workers = fsalloc(options->num_workers * sizeof workers[0]);
+    unsigned num_workers;
+    for (num_workers = 0; num_workers < options->num_workers; num_workers++)
+        if (pthread_create(&workers[num_workers], NULL, ndjson_worker, &pool))
+            break;
+    bool ok;
+    if (!num_workers)
+        ok = ndjson_serially(source, options->flags, record, ctx);
+    else {
+        size_t next_seq = 0, next_delivery = 0;
+        bool more = true;
+        ok = true;
+        pthread_mutex_lock(&pool.lock);
+        while (ok) {
+            ndjson_unit_t *unit;
+            while (more && (unit = find_unit(&pool, UNIT_FREE))) {
+                pthread_mutex_unlock(&pool.lock);
+                more = next_chunk(source, unit);
+                pthread_mutex_lock(&pool.lock);
+                if (more) {
+                    unit->seq = next_seq++;
+                    unit->state = UNIT_READY;
+                    pthread_cond_signal(&pool.work);
+                }
             }
-            if (significand <= ((uint64_t) -1 >> 1) + 1) {
-                *thing = json_make_integer(-(int64_t) significand);
-                return good;
+            if (next_delivery == next_seq)
+                break;
+            unit = find_unit(&pool, UNIT_DONE);
+            if (!unit || (options->ordered && unit->seq != next_delivery)) {
+                pthread_cond_wait(&pool.done, &pool.lock);
+                continue;
             }
+            unit->state = UNIT_DELIVERING;
+            pthread_mutex_unlock(&pool.lock);
+            ok = deliver_unit(unit, record, ctx);
+            pthread_mutex_lock(&pool.lock);
+            unit->state = UNIT_FREE;
+            next_delivery++;
+        }
+        pool.quit = true;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    fsfree(workers);
+    for (i = 0; i < pool.num_units; i++)
+        deinit_unit(&pool.units[i]);
+    fsfree(pool.units);
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+    return ok;
+}
+
+static bool ndjson_decode(ndjson_source_t *source,
+                          const json_ndjson_options_t *options,
+                          json_record_cb_t record, void *ctx)
+{
+    source->chunk_size =
+        options->chunk_size ? options->chunk_size : NDJSON_DEFAULT_CHUNK_SIZE;
+    source->offset = 0;
+    source->error = false;
+    if (options->num_workers <= 1)
+        return ndjson_serially(source, options->flags, record, ctx);
+    return ndjson_in_parallel(source, options, record, ctx);
+}
+
+bool json_ndjson_decode(const void *buffer, size_t size,
+                        const json_ndjson_options_t *options,
+                        json_record_cb_t record, void *ctx)
+{
+    ndjson_source_t source = {
+        .next = buffer,
+        .end = (const char *) buffer + size,
+        .file = NULL,
+    };
+    return ndjson_decode(&source, options, record, ctx);
+}
+
+bool json_ndjson_decode_file(FILE *f, const json_ndjson_options_t *options,
+                             json_record_cb_t record, void *ctx)
+{
+    ndjson_source_t source = {
+        .file = f,
+        .carry = NULL,
+        .carry_size = 0,
+        .carry_capacity = 0,
+    };
+    bool ok = ndjson_decode(&source, options, record, ctx);
+    fsfree(source.carry);
+    return ok && !source.error;
+}
+
+/* The binary encoding starts with BINARY_MAGIC and a version byte,
+ * followed by the root value. Every value starts with a tag byte:
+ *
+ *   BINARY_NULL, BINARY_FALSE, BINARY_TRUE   nothing else
+ *   BINARY_INTEGER                           zigzag varint
+ *   BINARY_UNSIGNED                          varint
+ *   BINARY_FLOAT                             64 bits
+ *   BINARY_STRING, BINARY_RAW                varint length, bytes, NUL
+ *   BINARY_ARRAY                             64-bit length of the rest,
+ *                                            varint count, elements
+ *   BINARY_OBJECT                            64-bit length of the rest,
+ *                                            varint count, and for each
+ *                                            field a name (varint
+ *                                            length, bytes, NUL) and a
+ *                                            value
+ *
+ * Varints are little-endian base-128 and other integers little-endian
+ * bytes, so nothing needs aligning. */
+
+static const char BINARY_MAGIC[4] = { 'E', 'J', 'S', 'B' };
+
+enum {
+    BINARY_VERSION = 1,
+};
+
+enum {
+    BINARY_NULL,
+    BINARY_FALSE,
+    BINARY_TRUE,
+    BINARY_INTEGER,
+    BINARY_UNSIGNED,
+    BINARY_FLOAT,
+    BINARY_STRING,
+    BINARY_RAW,
+    BINARY_ARRAY,
+    BINARY_OBJECT,
+};
+
+static void emit_varint(emitter_t *em, uint64_t n)
+{
+    char buf[10];
+    size_t i = 0;
+    while (n >= 0x80) {
+        buf[i++] = (char) (n | 0x80);
+        n >>= 7;
+    }
+    buf[i++] = (char) n;
+    emit_bytes(em, buf, i);
+}
+
+static void put_u64(char *p, uint64_t n)
+{
+    int i;
+    for (i = 0; i < 8; i++, n >>= 8)
+        p[i] = (char) n;
+}
+
+static void emit_u64(emitter_t *em, uint64_t n)
+{
+    char buf[8];
+    put_u64(buf, n);
+    emit_bytes(em, buf, sizeof buf);
+}
+
+static void emit_binary_string(emitter_t *em, const char *s, size_t len)
+{
+    emit_varint(em, len);
+    emit_bytes(em, s, len);
+    emit_char(em, '\0');
+}
+
+static void emit_binary(emitter_t *em, json_thing_t *thing)
+{
+    size_t i;
+    expand(thing);
+    switch (thing->type) {
+        case JSON_NULL:
+            emit_char(em, BINARY_NULL);
+            return;
+        case JSON_BOOLEAN:
+            emit_char(em, thing->boolean.value ? BINARY_TRUE : BINARY_FALSE);
+            return;
+        case JSON_INTEGER: {
+            long long n = thing->integer.value;
+            emit_char(em, BINARY_INTEGER);
+            emit_varint(em, (uint64_t) n << 1 ^ (n < 0 ? (uint64_t) -1 : 0));
+            return;
+        }
+        case JSON_UNSIGNED:
+            emit_char(em, BINARY_UNSIGNED);
+            emit_varint(em, thing->u_integer.value);
+            return;
+        case JSON_FLOAT: {
+            bin64_t value = { .f = thing->real.value };
+            emit_char(em, BINARY_FLOAT);
+            emit_u64(em, value.i);
+            return;
+        }
+        case JSON_STRING:
+            emit_char(em, BINARY_STRING);
+            emit_binary_string(em, string_utf8(thing), string_len(thing));
+            return;
+        case JSON_RAW:
+            emit_char(em, BINARY_RAW);
+            emit_binary_string(em, raw_repr(thing), strlen(raw_repr(thing)));
+            return;
+        default:
+            break;
+    }
+    /* the length is patched in once the contents have been emitted;
+     * the window of a growing emitter is never flushed */
+    emit_char(em, thing->type == JSON_ARRAY ? BINARY_ARRAY : BINARY_OBJECT);
+    size_t length_offset = em->q - em->base;
+    emit_u64(em, 0);
+    if (thing->type == JSON_ARRAY) {
+        emit_varint(em, thing->array.count);
+        for (i = 0; i < thing->array.count; i++)
+            emit_binary(em, element_at(thing, i));
+    } else {
+        emit_varint(em, thing->object.count);
+        for (i = 0; i < thing->object.count; i++) {
+            pair_t f = field_at(thing, i);
+            emit_binary_string(em, f.name, f.name_len);
+            emit_binary(em, f.value);
+        }
+    }
+    put_u64(em->base + length_offset, em->q - em->base - length_offset - 8);
+}
+
+char *json_binary_encode(json_thing_t *thing, size_t *size)
+{
+    enum { INITIAL_SIZE = 256 };
+    emitter_t em = {
+        .refill = grow,
+    };
+    em.base = em.q = fsalloc(INITIAL_SIZE);
+    em.end = em.base + INITIAL_SIZE - 1;
+    uint64_t t0 = STAT_CLOCK();
+    emit_bytes(&em, BINARY_MAGIC, sizeof BINARY_MAGIC);
+    emit_char(&em, BINARY_VERSION);
+    emit_binary(&em, thing);
+    count_encode(em.q - em.base, t0);
+    *size = em.q - em.base;
+    return em.base;
+}
+
+typedef struct {
+    const char *p, *end;
+    unsigned flags; /* JSON_DECODE_ZERO_COPY */
+    unsigned limit; /* the depth limit, for the statistics */
+} binary_reader_t;
+
+static bool read_varint(binary_reader_t *r, uint64_t *n)
+{
+    *n = 0;
+    unsigned shift;
+    for (shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        unsigned char byte = *r->p++;
+        *n |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return shift < 63 || byte <= 1;
+    }
+    return false;
+}
+
+static bool read_u64(binary_reader_t *r, uint64_t *n)
+{
+    if (r->end - r->p < 8)
+        return false;
+    *n = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+        *n = *n << 8 | (unsigned char) r->p[i];
+    r->p += 8;
+    return true;
+}
+
+/* Read a NUL-terminated UTF-8 string. */
+static const char *read_binary_string(binary_reader_t *r, size_t *len)
+{
+    uint64_t n;
+    if (!read_varint(r, &n) || n >= r->end - r->p || r->p[n] ||
+        !charstr_valid_utf8_bounded(r->p, r->p + n))
+        return NULL;
+    const char *s = r->p;
+    r->p += n + 1;
+    *len = n;
+    return s;
+}
+
+static json_thing_t *read_binary(binary_reader_t *r, unsigned levels);
+
+static json_thing_t *read_binary_container(binary_reader_t *r, int tag,
+                                           unsigned levels)
+{
+    uint64_t length, count;
+    if (!read_u64(r, &length) || length > r->end - r->p)
+        return NULL;
+    binary_reader_t body = { r->p, r->p + length, r->flags, r->limit };
+    /* every element or field takes at least a byte */
+    if (!read_varint(&body, &count) || count > body.end - body.p)
+        return NULL;
+    if (count)
+        STAT_MAX(max_depth, r->limit - levels + 1);
+    json_thing_t *container;
+    uint64_t i;
+    if (tag == BINARY_ARRAY) {
+        container = json_make_array();
+        for (i = 0; i < count; i++) {
+            json_thing_t *element = read_binary(&body, levels - 1);
+            if (!element)
+                break;
+            append_element(NULL, container, element);
+        }
+    } else {
+        container = json_make_object();
+        for (i = 0; i < count; i++) {
+            size_t len;
+            const char *name = read_binary_string(&body, &len);
+            json_thing_t *value = name ? read_binary(&body, levels - 1) : NULL;
+            if (!value)
+                break;
+            if (r->flags & JSON_DECODE_ZERO_COPY)
+                append_field(NULL, container, (char *) name, len,
+                             THING_BORROWED, value);
+            else
+                append_field(NULL, container, copy_name(name, len), len, 0,
+                             value);
+        }
+    }
+    if (i < count || body.p != body.end) {
+        json_destroy_thing(container);
+        return NULL;
+    }
+    r->p = body.end;
+    return container;
+}
+
+static json_thing_t *read_binary(binary_reader_t *r, unsigned levels)
+{
+    if (!levels || r->p >= r->end)
+        return NULL;
+    int tag = *r->p++;
+    uint64_t n;
+    const char *s;
+    size_t len;
+    switch (tag) {
+        case BINARY_NULL:
+            return json_make_null();
+        case BINARY_FALSE:
+            return json_make_boolean(false);
+        case BINARY_TRUE:
+            return json_make_boolean(true);
+        case BINARY_INTEGER:
+            if (!read_varint(r, &n))
+                return NULL;
+            return json_make_integer(n & 1 ? ~(n >> 1) : n >> 1);
+        case BINARY_UNSIGNED:
+            if (!read_varint(r, &n))
+                return NULL;
+            return json_make_unsigned(n);
+        case BINARY_FLOAT: {
+            bin64_t value;
+            if (!read_u64(r, &value.i))
+                return NULL;
+            return json_make_float(value.f);
         }
+        case BINARY_STRING:
+            s = read_binary_string(r, &len);
+            if (!s)
+                return NULL;
+            if (r->flags & JSON_DECODE_ZERO_COPY) {
+                json_thing_t *string = make_thing(JSON_STRING);
+                string->flags = THING_BORROWED;
+                string->string.utf8 = (char *) s;
+                string->string.len = len;
+                return string;
+            }
+            return json_make_bounded_string(s, len);
+        case BINARY_RAW:
+            s = read_binary_string(r, &len);
+            if (!s || strlen(s) != len)
+                return NULL;
+            return json_make_raw(s);
+        case BINARY_ARRAY:
+        case BINARY_OBJECT:
+            return read_binary_container(r, tag, levels);
+        default:
+            return NULL;
     }
-    bin64_t value;
-    if (!binary64_from_decimal(&dec, &value.i))
-        return NULL;
-    *thing = json_make_float(value.f);
-    return start + count;
 }
 
-static const char *decode_true(const char *p, const char *end,
-                               json_thing_t **thing)
+json_thing_t *json_binary_decode(const void *buffer, size_t size,
+                                 unsigned flags)
 {
-    p = skip(p, end, 't');
-    p = skip(p, end, 'r');
-    p = skip(p, end, 'u');
-    p = skip(p, end, 'e');
-    if (!p)
-        return NULL;
-    *thing = json_make_boolean(true);
-    return p;
+    uint64_t t0 = STAT_CLOCK();
+    binary_reader_t r = {
+        buffer, (const char *) buffer + size, flags, depth_limit()
+    };
+    json_thing_t *thing = NULL;
+    if (size > sizeof BINARY_MAGIC &&
+        !memcmp(r.p, BINARY_MAGIC, sizeof BINARY_MAGIC) &&
+        r.p[sizeof BINARY_MAGIC] == BINARY_VERSION) {
+        r.p += sizeof BINARY_MAGIC + 1;
+        thing = read_binary(&r, r.limit);
+        if (thing && r.p != r.end) {
+            json_destroy_thing(thing);
+            thing = NULL;
+        }
+    }
+    if (!thing)
+        errno = EINVAL;
+    STAT_ADD(decode_calls, 1);
+    STAT_ADD(decoded_bytes, size);
+    STAT_ADD(decode_nanoseconds, STAT_CLOCK() - t0);
+    return thing;
 }
 
-static const char *decode_false(const char *p, const char *end,
-                                json_thing_t **thing)
+/* A frozen block starts with a header and continues with the nodes
+ * and vectors of the tree, all 8-byte aligned. Every reference is an
+ * offset relative to its own location (see THING_FROZEN). Objects of
+ * more than FROZEN_INDEX_MIN fields come with a hash index. */
+
+static const char FROZEN_MAGIC[4] = { 'E', 'J', 'S', 'F' };
+
+enum {
+    FROZEN_VERSION = 1,
+    FROZEN_BYTE_ORDER = 0x01020304,
+    FROZEN_INDEX_MIN = 8,
+};
+
+typedef struct {
+    char magic[4];
+    uint32_t byte_order; /* FROZEN_BYTE_ORDER in the native byte order */
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t root;
+} frozen_header_t;
+
+typedef struct {
+    char *base;
+    size_t size, capacity;
+} freezer_t;
+
+/* Return the offset of a zeroed allocation in the block. The block
+ * may move, so nothing in it is referred to by pointer across an
+ * allocation. */
+static size_t freezer_alloc(freezer_t *fz, size_t size)
 {
-    p = skip(p, end, 'f');
-    p = skip(p, end, 'a');
-    p = skip(p, end, 'l');
-    p = skip(p, end, 's');
-    p = skip(p, end, 'e');
-    if (!p)
-        return NULL;
-    *thing = json_make_boolean(false);
-    return p;
+    size = arena_round(size);
+    if (size > fz->capacity - fz->size) {
+        while (size > fz->capacity - fz->size)
+            fz->capacity *= 2;
+        fz->base = fsrealloc(fz->base, fz->capacity);
+    }
+    size_t offset = fz->size;
+    memset(fz->base + offset, 0, size);
+    fz->size += size;
+    return offset;
 }
 
-static const char *decode_null(const char *p, const char *end,
-                               json_thing_t **thing)
+static void put_offset(freezer_t *fz, size_t at, size_t target)
 {
-    p = skip(p, end, 'n');
-    p = skip(p, end, 'u');
-    p = skip(p, end, 'l');
-    p = skip(p, end, 'l');
-    if (!p)
-        return NULL;
-    *thing = json_make_null();
-    return p;
+    int64_t offset = (int64_t) target - (int64_t) at;
+    memcpy(fz->base + at, &offset, sizeof offset);
 }
 
-static const char *decode(const char *p, const char *end, json_thing_t **thing,
-                          unsigned levels)
+static json_thing_t *frozen_node(freezer_t *fz, size_t node)
 {
-    if (!levels) {
-        json_error();
-        return NULL;
-    }
-    p = skip_ws(p, end);
-    if (!p || exhausted(p, end))
-        return NULL;
-    switch (*p) {
-        case '[':
-            return decode_array(p, end, thing, levels);
-        case '{':
-            return decode_object(p, end, thing, levels);
-        case '"':
-            return decode_string(p, end, thing);
-        case '-':
-            return decode_number(p, end, thing);
-        case 't':
-            return decode_true(p, end, thing);
-        case 'f':
-            return decode_false(p, end, thing);
-        case 'n':
-            return decode_null(p, end, thing);
-        default:
-            if (*p >= '0' && *p <= '9')
-                return decode_number(p, end, thing);
-            json_error();
-            return NULL;
-    }
+    return (json_thing_t *) (fz->base + node);
 }
 
-json_thing_t *json_utf8_decode(const void *buffer, size_t size)
+static size_t freeze_bytes(freezer_t *fz, const char *bytes, size_t len)
 {
-    const char *p = buffer;
-    const char *end = p + size;
-    json_thing_t *thing;
-    p = decode(p, end, &thing, MAX_DECODE_NESTING_LEVELS);
-    if (!p)
-        return NULL;
-    p = skip_ws(p, end);
-    if (p != end) {
-        json_destroy_thing(thing);
-        return NULL;
-    }
-    return thing;
+    size_t offset = freezer_alloc(fz, len + 1);
+    memcpy(fz->base + offset, bytes, len);
+    return offset;
 }
 
-json_thing_t *json_utf8_decode_string(const char *encoding)
+static size_t freeze_thing(freezer_t *fz, json_thing_t *thing);
+
+static void freeze_object(freezer_t *fz, size_t node, json_thing_t *object)
 {
-    return json_utf8_decode(encoding, strlen(encoding));
+    size_t count = object->object.count;
+    size_t fields = freezer_alloc(fz, (count + 1) * sizeof(frozen_pair_t));
+    size_t i;
+    for (i = 0; i < count; i++) {
+        pair_t f = field_at(object, i);
+        size_t at = fields + i * sizeof(frozen_pair_t);
+        put_offset(fz, at + offsetof(frozen_pair_t, name),
+                   freeze_bytes(fz, f.name, f.name_len));
+        put_offset(fz, at + offsetof(frozen_pair_t, value),
+                   freeze_thing(fz, f.value));
+        frozen_pair_t *ff = (frozen_pair_t *) (fz->base + at);
+        ff->name_len = f.name_len;
+        ff->hash = f.hash;
+    }
+    frozen_node(fz, node)->frozen.count = count;
+    put_offset(fz, node + offsetof(json_thing_t, frozen.items), fields);
+    if (count <= FROZEN_INDEX_MIN)
+        return;
+    size_t size = 16;
+    while (size < 2 * (count + 1))
+        size *= 2;
+    size_t at = freezer_alloc(fz, sizeof(object_index_t) +
+                                      size * sizeof(size_t));
+    object_index_t *index = (object_index_t *) (fz->base + at);
+    frozen_pair_t *ff = (frozen_pair_t *) (fz->base + fields);
+    index->mask = size - 1;
+    for (i = 0; i < count; i++) {
+        size_t slot = ff[i].hash & index->mask;
+        while (index->slots[slot])
+            slot = (slot + 1) & index->mask;
+        index->slots[slot] = i + 1;
+    }
+    put_offset(fz, node + offsetof(json_thing_t, frozen.index), at);
 }
 
-static char *read_file(FILE *f, size_t max_size, size_t *size)
+/* Return the offset of the frozen copy of the thing. */
+static size_t freeze_thing(freezer_t *fz, json_thing_t *thing)
 {
-    size_t nbytes = 512;
-    char *buffer = fsalloc(nbytes);
-    *size = 0;
-    for (;;) {
-        char buf[4096];
-        size_t count = fread(buf, 1, sizeof buf, f);
-        if (ferror(f)) {
-            fsfree(buffer);
-            return NULL;
-        }
-        if (count == 0)
+    expand(thing);
+    size_t node = freezer_alloc(fz, node_size(thing->type));
+    frozen_node(fz, node)->type = thing->type;
+    frozen_node(fz, node)->flags = THING_FROZEN;
+    size_t i, items;
+    switch (thing->type) {
+        case JSON_ARRAY:
+            items = freezer_alloc(fz, (thing->array.count + 1) *
+                                          sizeof(int64_t));
+            for (i = 0; i < thing->array.count; i++)
+                put_offset(fz, items + i * sizeof(int64_t),
+                           freeze_thing(fz, element_at(thing, i)));
+            frozen_node(fz, node)->frozen.count = thing->array.count;
+            put_offset(fz, node + offsetof(json_thing_t, frozen.items), items);
             break;
-        if (count > max_size - *size) {
-            errno = ENOMEM;
-            fsfree(buffer);
-            return NULL;
-        }
-        size_t n = *size + count;
-        if (nbytes < n) {
-            if (n > max_size / 2)
-                nbytes = max_size;
-            else {
-                nbytes = 1;
-                while (nbytes < n)
-                    nbytes <<= 1;
+        case JSON_OBJECT:
+            freeze_object(fz, node, thing);
+            break;
+        case JSON_STRING:
+            if (thing->flags & THING_INLINE) {
+                json_thing_t *frozen = frozen_node(fz, node);
+                frozen->flags |= THING_INLINE;
+                frozen->short_len = thing->short_len;
+                memcpy(frozen->short_string, thing->short_string,
+                       sizeof frozen->short_string);
+                break;
             }
-            char *ptr = fsrealloc(buffer, nbytes);
-            buffer = ptr;
-        }
-        memcpy(buffer + *size, buf, count);
-        *size += count;
+            items = freeze_bytes(fz, string_utf8(thing), string_len(thing));
+            frozen_node(fz, node)->frozen.count = string_len(thing);
+            put_offset(fz, node + offsetof(json_thing_t, frozen.items), items);
+            break;
+        case JSON_RAW:
+            items = freeze_bytes(fz, raw_repr(thing), strlen(raw_repr(thing)));
+            put_offset(fz, node + offsetof(json_thing_t, frozen.items), items);
+            break;
+        case JSON_INTEGER:
+            frozen_node(fz, node)->integer.value = thing->integer.value;
+            break;
+        case JSON_UNSIGNED:
+            frozen_node(fz, node)->u_integer.value = thing->u_integer.value;
+            break;
+        case JSON_FLOAT:
+            frozen_node(fz, node)->real.value = thing->real.value;
+            break;
+        case JSON_BOOLEAN:
+            frozen_node(fz, node)->boolean.value = thing->boolean.value;
+            break;
+        default:
+            break;
     }
-    return buffer;
+    return node;
 }
 
-json_thing_t *json_utf8_decode_file(FILE *f, size_t max_size)
+void *json_freeze(json_thing_t *thing, size_t *size)
 {
-    size_t size;
-    char *buffer = read_file(f, max_size, &size);
-    if (!buffer)
-        return NULL;
-    json_thing_t *thing = json_utf8_decode(buffer, size);
-    fsfree(buffer);
-    if (!thing) {
+    freezer_t fz = {
+        .base = fsalloc(4096),
+        .size = 0,
+        .capacity = 4096,
+    };
+    size_t header = freezer_alloc(&fz, sizeof(frozen_header_t));
+    size_t root = freeze_thing(&fz, thing);
+    frozen_header_t *h = (frozen_header_t *) (fz.base + header);
+    memcpy(h->magic, FROZEN_MAGIC, sizeof h->magic);
+    h->byte_order = FROZEN_BYTE_ORDER;
+    h->version = FROZEN_VERSION;
+    h->size = fz.size;
+    put_offset(&fz, header + offsetof(frozen_header_t, root), root);
+    *size = fz.size;
+    return fz.base;
+}
+
+json_thing_t *json_frozen_root(const void *block, size_t size)
+{
+    const frozen_header_t *h = block;
+    if (size < sizeof *h || (uintptr_t) block % ARENA_ALIGNMENT ||
+        memcmp(h->magic, FROZEN_MAGIC, sizeof h->magic) ||
+        h->byte_order != FROZEN_BYTE_ORDER || h->version != FROZEN_VERSION ||
+        h->size != size ||
+        h->root < (int64_t) (sizeof *h - offsetof(frozen_header_t, root)) ||
+        (uint64_t) h->root >= size - offsetof(frozen_header_t, root)) {
         errno = EINVAL;
         return NULL;
     }
-    return thing;
+    return follow(&h->root);
 }
 
 bool json_cast_to_integer(json_thing_t *thing, long long *n)
@@ -1586,46 +6186,147 @@ bool json_cast_to_double(json_thing_t *thing, double *n)
     }
 }
 
-int json_utf8_dump(json_thing_t *thing, FILE *f)
+static bool write_to_fd(void *obj, const void *data, size_t size)
+{
+    int fd = *(int *) obj;
+    const char *p = data;
+    while (size) {
+        ssize_t count = write(fd, p, size);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += count;
+        size -= count;
+    }
+    return true;
+}
+
+typedef struct {
+    FILE *f;
+    size_t count;
+} file_writer_t;
+
+static bool write_to_file(void *obj, const void *data, size_t size)
+{
+    file_writer_t *writer = obj;
+    if (fwrite(data, 1, size, writer->f) != size)
+        return false;
+    writer->count += size;
+    return true;
+}
+
+/* The output goes through a staging buffer of a fixed size, so the
+ * memory use does not depend on the size of the document. */
+enum {
+    WRITE_BUFFER_SIZE = 64 * 1024
+};
+
+static bool write_staged(json_thing_t *thing, json_sink_t *sink,
+                         unsigned flags)
 {
-    size_t size = json_utf8_prettyprint(thing, NULL, 0, 0, 2) + 1;
-    char *buffer = fsalloc(size);
-    json_utf8_prettyprint(thing, buffer, size, 0, 2);
-    int n = fprintf(f, "%s\n", buffer);
+    layout_t layout = { .indentation = -1 };
+    if (flags & JSON_WRITE_PRETTY)
+        layout = pretty_layout(0, 2);
+    char *buffer = fsalloc(WRITE_BUFFER_SIZE);
+    bool ok = encode_staged(thing, sink, layout, flags & JSON_WRITE_NEWLINE,
+                            buffer, WRITE_BUFFER_SIZE);
     fsfree(buffer);
-    return n;
+    return ok;
+}
+
+bool json_utf8_write(json_thing_t *thing, int fd, unsigned flags)
+{
+    json_sink_t sink = { &fd, write_to_fd };
+    return write_staged(thing, &sink, flags);
+}
+
+bool json_utf8_write_file(json_thing_t *thing, FILE *f, unsigned flags)
+{
+    file_writer_t writer = { f, 0 };
+    json_sink_t sink = { &writer, write_to_file };
+    return write_staged(thing, &sink, flags);
+}
+
+int json_utf8_dump(json_thing_t *thing, FILE *f)
+{
+    file_writer_t writer = { f, 0 };
+    json_sink_t sink = { &writer, write_to_file };
+    if (!write_staged(thing, &sink, JSON_WRITE_PRETTY | JSON_WRITE_NEWLINE))
+        return -1;
+    return writer.count > INT_MAX ? INT_MAX : writer.count;
 }
 
-/* This data structure is used by fstrace inside a safe critical
- * section. */
+/* Each thread has its own ring of trace slots, so tracing needs no
+ * lock. The slots are freed when the thread exits. */
 enum {
     TRACE_SLOTS = 4, /* power of two, please */
     TRACE_DEFAULT_SIZE = 2048
 };
 
-static struct {
+typedef struct {
     unsigned next_slot;
     char *slots[TRACE_SLOTS];
     size_t max_size;
-} trace_data = {
+} trace_data_t;
+
+static _Thread_local trace_data_t trace_data = {
     .max_size = TRACE_DEFAULT_SIZE,
 };
 
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+static void free_trace_slots(void *p)
+{
+    trace_data_t *data = p;
+    unsigned i;
+    for (i = 0; i < TRACE_SLOTS; i++)
+        if (data->slots[i]) {
+            fs_reallocator_skew(1);
+            fsfree(data->slots[i]);
+            data->slots[i] = NULL;
+        }
+}
+
+static void make_trace_key(void)
+{
+    pthread_key_create(&trace_key, free_trace_slots);
+}
+
+/* Stop the encoding when the slot is full. */
+static bool truncate_trace(emitter_t *em)
+{
+    em->failed = true;
+    return false;
+}
+
 const char *json_trace(void *p)
 {
     json_thing_t *thing = p;
-    size_t size = json_utf8_encode(thing, NULL, 0);
-    if (size > trace_data.max_size)
-        size = trace_data.max_size;
+    size_t size = trace_data.max_size;
     trace_data.max_size = TRACE_DEFAULT_SIZE;
-    char *slot = trace_data.slots[trace_data.next_slot % TRACE_SLOTS];
-    char *buf = fsrealloc(slot, size + 1);
+    char **slot = &trace_data.slots[trace_data.next_slot++ % TRACE_SLOTS];
+    char *buf = fsrealloc(*slot, size + 1);
     if (!buf)
         return "";
-    if (!slot)
+    if (!*slot) {
         fs_reallocator_skew(-1);
-    trace_data.slots[trace_data.next_slot++ % TRACE_SLOTS] = buf;
-    json_utf8_encode(thing, buf, size + 1);
+        pthread_once(&trace_once, make_trace_key);
+        pthread_setspecific(trace_key, &trace_data);
+    }
+    *slot = buf;
+    /* encode once, stopping at the maximum size */
+    emitter_t em = {
+        .base = buf,
+        .q = buf,
+        .end = buf + size,
+        .refill = truncate_trace,
+        .failed = false,
+    };
+    encode_thing(&em, thing);
+    *em.q = '\0';
     return buf;
 }
 
@@ -1663,40 +6364,199 @@ const char *json_trace_type(void /* json_thing_type_t */ *ptype)
 
 const char *json_trace_thing_type(void /* json_thing_t */ *thing)
 {
-    return json_trace_type(&((json_thing_t *) thing)->type);
+    json_thing_type_t type = ((json_thing_t *) thing)->type;
+    return json_trace_type(&type);
 }
 
-static bool equal_arrays(json_thing_t *a, json_thing_t *b, double tolerance)
+static json_thing_t *per_type(const uint64_t *values)
 {
-    if (list_size(a->array.elements) != list_size(b->array.elements))
-        return false;
-    json_element_t *ea = json_array_first(a);
-    json_element_t *eb = json_array_first(b);
-    for (;;) {
-        if (!ea)
-            return !eb;
-        if (!eb ||
-            !json_thing_equal(json_element_value(ea), json_element_value(eb),
-                              tolerance))
-            return false;
-        ea = json_element_next(ea);
-        eb = json_element_next(eb);
+    json_thing_t *counts = json_make_object();
+    json_thing_type_t type;
+    for (type = JSON_ARRAY; type <= JSON_RAW; type++)
+        json_add_to_object(counts, json_trace_type(&type),
+                           json_make_unsigned(values[type]));
+    return counts;
+}
+
+const char *json_trace_stats(void /* json_stats_t */ *p)
+{
+    const json_stats_t *stats = p;
+    json_thing_t *object = json_make_object();
+    json_add_to_object(object, "nodes", per_type(stats->nodes));
+    json_add_to_object(object, "node_bytes", per_type(stats->node_bytes));
+#define TRACE_STAT(field) \
+    json_add_to_object(object, #field, json_make_unsigned(stats->field))
+    TRACE_STAT(string_bytes);
+    TRACE_STAT(index_builds);
+    TRACE_STAT(decode_calls);
+    TRACE_STAT(decoded_bytes);
+    TRACE_STAT(decode_nanoseconds);
+    TRACE_STAT(encode_calls);
+    TRACE_STAT(encoded_bytes);
+    TRACE_STAT(encode_nanoseconds);
+    TRACE_STAT(read_bytes);
+    TRACE_STAT(max_depth);
+#undef TRACE_STAT
+    const char *trace = json_trace(object);
+    json_destroy_thing(object);
+    return trace;
+}
+
+/* Hashing. A number is hashed by its value as a double since that is
+ * how json_thing_equal() compares numbers of different types. An
+ * array hashes its elements in order, and an object sums up the
+ * hashes of its fields, which makes it independent of their order.
+ * Zero stands for an unknown hash and is never returned. */
+enum {
+    HASH_STRING = 1,
+    HASH_NUMBER,
+    HASH_TRUE,
+    HASH_FALSE,
+    HASH_NULL,
+    HASH_ARRAY,
+    HASH_OBJECT
+};
+
+/* the splitmix64 finalizer */
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111eb;
+    return h ^ h >> 31;
+}
+
+static uint64_t tag_hash(uint64_t h, unsigned tag)
+{
+    h = mix(h ^ (uint64_t) tag << 56);
+    return h ? h : 1;
+}
+
+static uint64_t hash_number(double value)
+{
+    bin64_t bits = { .f = value == 0 ? 0 : value }; /* -0 == 0 */
+    return tag_hash(bits.i, HASH_NUMBER);
+}
+
+static uint64_t hash_scalar(json_thing_t *thing)
+{
+    switch (thing->type) {
+        case JSON_STRING:
+            return tag_hash(hash_bytes(string_utf8(thing), string_len(thing)),
+                            HASH_STRING);
+        case JSON_INTEGER:
+            return hash_number(thing->integer.value);
+        case JSON_UNSIGNED:
+            return hash_number(thing->u_integer.value);
+        case JSON_FLOAT:
+            return hash_number(thing->real.value);
+        case JSON_BOOLEAN:
+            return tag_hash(0, thing->boolean.value ? HASH_TRUE : HASH_FALSE);
+        case JSON_NULL:
+            return tag_hash(0, HASH_NULL);
+        case JSON_RAW: {
+            json_thing_t *decoding = json_utf8_decode_string(raw_repr(thing));
+            if (!decoding)
+                return tag_hash(hash_bytes(raw_repr(thing),
+                                           strlen(raw_repr(thing))),
+                                HASH_STRING);
+            uint64_t hash = json_thing_hash(decoding);
+            json_destroy_thing(decoding);
+            return hash;
+        }
+        default:
+            abort();
     }
 }
 
-static bool equal_objects(json_thing_t *a, json_thing_t *b, double tolerance)
+/* An array or object being hashed, the position of the next element
+ * or field in it and the hash of its contents so far. */
+typedef struct {
+    json_thing_t *container;
+    size_t next;
+    uint64_t hash;
+    uint64_t name_hash; /* of the field being hashed */
+} hash_frame_t;
+
+/* Return the remembered hash of an array or object or 0. */
+static uint64_t hash_of(json_thing_t *container)
+{
+    if (container->flags & THING_FROZEN)
+        return 0;
+    return known_hash(decoded(container));
+}
+
+/* Hash a packed array the way json_thing_hash() would hash it if it
+ * had element nodes. */
+static uint64_t hash_packed(json_thing_t *array)
+{
+    uint64_t hash = 0;
+    size_t i;
+    for (i = 0; i < array->array.count; i++)
+        hash = mix(hash + hash_number(number_value(&array->array.numbers[i])));
+    hash = tag_hash(hash, HASH_ARRAY);
+    set_known_hash(array, hash);
+    return hash;
+}
+
+uint64_t json_thing_hash(json_thing_t *thing)
+{
+    work_stack_t stack;
+    stack_init(&stack, sizeof(hash_frame_t));
+    uint64_t hash;
+    do {
+        if (!is_container(thing))
+            hash = hash_scalar(thing);
+        else if (!(hash = hash_of(thing))) {
+            if (thing->flags & THING_PACKED)
+                hash = hash_packed(thing);
+            else
+                *(hash_frame_t *) stack_push(&stack) =
+                    (hash_frame_t) { thing, 0, 0, 0 };
+        }
+        /* absorb the hash and find the next thing to hash */
+        thing = NULL;
+        while (stack.depth) {
+            hash_frame_t *frame = stack_top(&stack);
+            json_thing_t *container = frame->container;
+            bool array = container->type == JSON_ARRAY;
+            if (hash)
+                frame->hash = array
+                    ? mix(frame->hash + hash)
+                    : frame->hash + mix(frame->name_hash ^ hash);
+            size_t count =
+                array ? container->array.count : container->object.count;
+            if (frame->next < count) {
+                size_t i = frame->next++;
+                if (array)
+                    thing = element_at(container, i);
+                else {
+                    pair_t f = field_at(container, i);
+                    frame->name_hash = mix(f.hash);
+                    thing = f.value;
+                }
+                break;
+            }
+            hash = tag_hash(frame->hash, array ? HASH_ARRAY : HASH_OBJECT);
+            if (!(container->flags & THING_FROZEN))
+                set_known_hash(container, hash);
+            stack_pop(&stack);
+        }
+    } while (thing);
+    stack_release(&stack);
+    return hash;
+}
+
+/* Two arrays or objects whose hashes are remembered and differ cannot
+ * be equal (but see json_thing_hash()). */
+static bool known_to_differ(json_thing_t *a, json_thing_t *b,
+                            double tolerance)
 {
-    if (list_size(a->object.fields) != list_size(b->object.fields))
+    if (tolerance != 0)
         return false;
-    if (!b->object.lookup_table)
-        optimize_object(b);
-    json_field_t *fa;
-    for (fa = json_object_first(a); fa; fa = json_field_next(fa)) {
-        json_thing_t *bval = json_object_get(b, json_field_name(fa));
-        if (!bval || !json_thing_equal(json_field_value(fa), bval, tolerance))
-            return false;
-    }
-    return true;
+    uint64_t ha = hash_of(a), hb = hash_of(b);
+    return ha && hb && ha != hb;
 }
 
 static bool equal_doubles(double a, double b, double tolerance)
@@ -1749,24 +6609,49 @@ static bool equal_to_float(double n, json_thing_t *b, double tolerance)
     }
 }
 
-bool json_thing_equal(json_thing_t *a, json_thing_t *b, double tolerance)
+static bool equal_raw(json_thing_t *a, json_thing_t *b, double tolerance)
 {
-    if (json_thing_type(b) == JSON_RAW) {
-        json_thing_t *b_dec = json_utf8_decode_string(json_raw_encoding(b));
-        bool result = json_thing_equal(a, b_dec, tolerance);
-        json_destroy_thing(b_dec);
-        return result;
-    }
+    if (json_thing_type(b) != JSON_RAW)
+        return equal_raw(b, a, tolerance);
+    json_thing_t *b_dec = json_utf8_decode_string(json_raw_encoding(b));
+    bool result = json_thing_equal(a, b_dec, tolerance);
+    json_destroy_thing(b_dec);
+    return result;
+}
+
+/* A pair of arrays or objects being compared. The fields of a large
+ * object b without a JIT index are looked up through a temporary
+ * index; b is left as it is. */
+typedef struct {
+    json_thing_t *a, *b;
+    size_t next;
+    object_index_t *index; /* temporary, may be NULL */
+} equal_frame_t;
+
+/* Compare the things themselves. The contents of arrays and objects
+ * are left to be compared from the work stack. */
+static bool equal_nodes(work_stack_t *stack, json_thing_t *a, json_thing_t *b,
+                        double tolerance)
+{
+    if (json_thing_type(a) == JSON_RAW || json_thing_type(b) == JSON_RAW)
+        return equal_raw(a, b, tolerance);
     switch (json_thing_type(a)) {
         case JSON_ARRAY:
-            return json_thing_type(b) == JSON_ARRAY &&
-                equal_arrays(a, b, tolerance);
+            if (json_thing_type(b) != JSON_ARRAY ||
+                expand(a)->array.count != expand(b)->array.count ||
+                known_to_differ(a, b, tolerance))
+                return false;
+            break;
         case JSON_OBJECT:
-            return json_thing_type(b) == JSON_OBJECT &&
-                equal_objects(a, b, tolerance);
+            if (json_thing_type(b) != JSON_OBJECT ||
+                expand(a)->object.count != expand(b)->object.count ||
+                known_to_differ(a, b, tolerance))
+                return false;
+            break;
         case JSON_STRING:
             return json_thing_type(b) == JSON_STRING &&
-                !strcmp(json_string_value(a), json_string_value(b));
+                string_len(a) == string_len(b) &&
+                !memcmp(string_utf8(a), string_utf8(b), string_len(a));
         case JSON_INTEGER:
             return equal_to_integer(json_integer_value(a), b, tolerance);
         case JSON_UNSIGNED:
@@ -1778,9 +6663,54 @@ bool json_thing_equal(json_thing_t *a, json_thing_t *b, double tolerance)
                 json_boolean_value(a) == json_boolean_value(b);
         case JSON_NULL:
             return json_thing_type(b) == JSON_NULL;
-        case JSON_RAW:
-            return json_thing_equal(b, a, tolerance);
         default:
             assert(false);
     }
+    object_index_t *index = NULL;
+    if (b->type == JSON_OBJECT && !(b->flags & THING_FROZEN) &&
+        !b->object.index && b->object.count >= JIT_SIZE_LIMIT)
+        index = make_index(b->object.fields, b->object.count);
+    *(equal_frame_t *) stack_push(stack) = (equal_frame_t) { a, b, 0, index };
+    return true;
+}
+
+/* Look up the value for a field of a in b. */
+static json_thing_t *counterpart(equal_frame_t *frame, const pair_t *fa)
+{
+    json_thing_t *b = frame->b;
+    if (b->flags & THING_FROZEN)
+        return frozen_object_get(b, fa->name, fa->name_len, fa->hash);
+    pair_t *fb =
+        find_field(b->object.fields, b->object.count,
+                   b->object.index ? b->object.index : frame->index,
+                   fa->name, fa->name_len, fa->hash);
+    return fb ? fb->value : NULL;
+}
+
+bool json_thing_equal(json_thing_t *a, json_thing_t *b, double tolerance)
+{
+    work_stack_t stack;
+    stack_init(&stack, sizeof(equal_frame_t));
+    bool equal = equal_nodes(&stack, a, b, tolerance);
+    while (stack.depth) {
+        equal_frame_t *frame = stack_top(&stack);
+        size_t i = frame->next++;
+        size_t count = frame->a->type == JSON_ARRAY ? frame->a->array.count
+                                                    : frame->a->object.count;
+        if (!equal || i == count) {
+            fsfree(frame->index);
+            stack_pop(&stack);
+            continue;
+        }
+        if (frame->a->type == JSON_ARRAY)
+            equal = equal_nodes(&stack, element_at(frame->a, i),
+                                element_at(frame->b, i), tolerance);
+        else {
+            pair_t fa = field_at(frame->a, i);
+            json_thing_t *bval = counterpart(frame, &fa);
+            equal = bval && equal_nodes(&stack, fa.value, bval, tolerance);
+        }
+    }
+    stack_release(&stack);
+    return equal;
 }
@@ -1,9 +1,18 @@
+/* for mkstemp(3) and pipe(2) */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <encjson.h>
 #include <fsdyn/charstr.h>
+#include <fsdyn/fsalloc.h>
 
 static const char *data = "\n"
                           "{\n"
@@ -269,6 +278,91 @@ static bool test_big_object()
     return true;
 }
 
+static bool test_long_strings()
+{
+    /* Place special characters at every offset of a string that spans
+     * several machine words and vector registers. */
+    static const struct {
+        const char *repr, *value;
+    } specials[] = { { "\\n", "\n" },       { "\\\"", "\"" },
+                     { "\\\\", "\\" },     { "\\u00e9", "é" },
+                     { "é", "é" },           { "\t", "\t" },
+                     { "\\uD852\\udf62", "𤭢" }, { NULL } };
+    char filler[71];
+    int i, n;
+    for (i = 0; i < 70; i++)
+        filler[i] = 'a' + i % 26;
+    filler[70] = '\0';
+    for (i = 0; specials[i].repr; i++)
+        for (n = 0; n < 70; n++) {
+            char repr[100], value[100];
+            sprintf(repr, "\"%.*s%s%s\"", n, filler, specials[i].repr,
+                    filler + n);
+            sprintf(value, "%.*s%s%s", n, filler, specials[i].value,
+                    filler + n);
+            json_thing_t *thing = json_utf8_decode_string(repr);
+            if (!thing || json_thing_type(thing) != JSON_STRING ||
+                json_string_length(thing) != strlen(value) ||
+                strcmp(json_string_value(thing), value)) {
+                fprintf(stderr, "Bad long string decoding: %s\n", repr);
+                return false;
+            }
+            json_destroy_thing(thing);
+            repr[strlen(repr) - 1] = '\0';
+            if (json_utf8_decode_string(repr)) {
+                fprintf(stderr, "Unterminated string accepted: %s\n", repr);
+                return false;
+            }
+        }
+    return true;
+}
+
+static bool test_iteration()
+{
+    json_thing_t *array = json_make_array();
+    json_thing_t *object = json_make_object();
+    int i;
+    for (i = 0; i < 10; i++) {
+        char buffer[20];
+        sprintf(buffer, "%d", i);
+        json_add_to_array(array, json_make_integer(i));
+        json_add_to_object(object, buffer, json_make_integer(i));
+    }
+    json_destroy_thing(json_object_pop(object, "0"));
+    json_destroy_thing(json_object_pop(object, "5"));
+    json_destroy_thing(json_object_pop(object, "9"));
+    if (json_object_pop(object, "5") || json_array_size(array) != 10) {
+        fprintf(stderr, "Bad pop\n");
+        return false;
+    }
+    json_element_t *e;
+    i = 0;
+    for (e = json_array_first(array); e; e = json_element_next(e))
+        if (json_integer_value(json_element_value(e)) != i++) {
+            fprintf(stderr, "Bad array iteration\n");
+            return false;
+        }
+    static const int remaining[] = { 1, 2, 3, 4, 6, 7, 8, -1 };
+    json_field_t *f;
+    i = 0;
+    for (f = json_object_first(object); f; f = json_field_next(f)) {
+        char buffer[20];
+        sprintf(buffer, "%d", remaining[i]);
+        if (strcmp(json_field_name(f), buffer) ||
+            json_integer_value(json_field_value(f)) != remaining[i++]) {
+            fprintf(stderr, "Bad object iteration\n");
+            return false;
+        }
+    }
+    if (remaining[i] != -1) {
+        fprintf(stderr, "Bad object iteration count\n");
+        return false;
+    }
+    json_destroy_thing(array);
+    json_destroy_thing(object);
+    return true;
+}
+
 static bool test_nested_object()
 {
     json_thing_t *it = json_make_object();
@@ -291,25 +385,2004 @@ static bool test_nested_object()
     return true;
 }
 
-int main()
+static bool test_arena()
 {
-    if (!test_simple())
-        return EXIT_FAILURE;
-    if (!test_simple2())
-        return EXIT_FAILURE;
-    if (!test_integers())
-        return EXIT_FAILURE;
-    if (!test_signed())
-        return EXIT_FAILURE;
-    if (!test_unsigned())
-        return EXIT_FAILURE;
-    if (!test_float())
-        return EXIT_FAILURE;
-    if (!test_big_array())
-        return EXIT_FAILURE;
-    if (!test_big_object())
-        return EXIT_FAILURE;
-    if (!test_nested_object())
+    json_thing_t *thing = json_utf8_decode_string(data);
+    size_t size = json_utf8_encode(thing, NULL, 0) + 1;
+    char expected[size];
+    (void) json_utf8_encode(thing, expected, size);
+    json_destroy_thing(thing);
+    json_arena_t *arena = json_make_arena();
+    int i;
+    for (i = 0; i < 3; i++) {
+        thing = json_utf8_decode_in_arena(arena, data, strlen(data));
+        if (!thing) {
+            fprintf(stderr, "Arena decoding failed\n");
+            return false;
+        }
+        char buffer[size];
+        if (json_utf8_encode(thing, buffer, size) != size - 1 ||
+            strcmp(buffer, expected)) {
+            fprintf(stderr, "Bad arena decoding: %s\n", buffer);
+            return false;
+        }
+        long long year;
+        if (!json_object_get_integer(thing, "year", &year) || year != 2017) {
+            fprintf(stderr, "Bad arena lookup\n");
+            return false;
+        }
+        json_thing_t *clone = json_clone(thing);
+        if (!json_thing_equal(clone, thing, 0)) {
+            fprintf(stderr, "Bad arena clone\n");
+            return false;
+        }
+        json_destroy_thing(clone);
+        if (json_utf8_decode_in_arena(arena, "[1, 2", 5)) {
+            fprintf(stderr, "Bad arena syntax error\n");
+            return false;
+        }
+        json_clear_arena(arena);
+    }
+    json_destroy_arena(arena);
+    return true;
+}
+
+static bool test_structural_index()
+{
+    /* Shift each document across the 64-byte blocks of the index and
+     * compare with the ordinary decoder. */
+    static const char *const docs[] = {
+        "[1, -2.5e3, \"a\\\\\", \"b\\\"]\", true, false, null]",
+        "{\"x\": {\"y\": [[], {}, \"\\u00e9\"]}, \"z\": 0}",
+        "\"\\\\\\\\\\\\\\\\\\\\\\\\\\\"\"", "123", "\"\"",
+        "[1 2]", "[1,]", "{\"a\" 1}", "{\"a\":}", "{1: 2}", "[truex]",
+        "[1\"a\"]", "\"a\"\"b\"", "[\"a\\\"]", "\"unterminated", "[",
+        "]", "", "   ", "1 2", "[nul]", "{\"a\":1,}", "[\\\"a\"]", "[-]",
+        "[01]", "\"\t\"", NULL
+    };
+    char buffer[200];
+    int i, shift;
+    for (i = 0; docs[i]; i++)
+        for (shift = 0; shift < 70; shift++) {
+            sprintf(buffer, "%*s%s", shift, "", docs[i]);
+            json_thing_t *expected = json_utf8_decode_string(buffer);
+            json_thing_t *thing =
+                json_utf8_decode_ex(buffer, strlen(buffer),
+                                    JSON_DECODE_STRUCTURAL_INDEX);
+            if (expected ? !thing || !json_thing_equal(thing, expected, 0)
+                         : thing != NULL) {
+                fprintf(stderr, "Bad indexed decoding: %s\n", buffer);
+                return false;
+            }
+            if (thing) {
+                json_destroy_thing(thing);
+                json_destroy_thing(expected);
+            }
+        }
+    json_thing_t *expected = json_utf8_decode_string(data);
+    json_thing_t *thing = json_utf8_decode_ex(data, strlen(data),
+                                              JSON_DECODE_STRUCTURAL_INDEX);
+    if (!thing || !json_thing_equal(thing, expected, 0)) {
+        fprintf(stderr, "Bad indexed decoding of test data\n");
+        return false;
+    }
+    json_destroy_thing(thing);
+    json_destroy_thing(expected);
+    return true;
+}
+
+static bool test_zero_copy()
+{
+    static const char encoding[] =
+        "{\"plain\":\"value\",\"esc\\u0061ped\":\"a\\nb\",\"\":[\"\"]}";
+    const char *end = encoding + sizeof encoding - 1;
+    unsigned flags[] = { JSON_DECODE_ZERO_COPY,
+                         JSON_DECODE_ZERO_COPY | JSON_DECODE_STRUCTURAL_INDEX };
+    int i;
+    for (i = 0; i < 2; i++) {
+        json_thing_t *thing =
+            json_utf8_decode_ex(encoding, sizeof encoding - 1, flags[i]);
+        if (!thing) {
+            fprintf(stderr, "Zero-copy decoding failed\n");
+            return false;
+        }
+        const char *value;
+        if (!json_object_get_string(thing, "plain", &value) ||
+            value < encoding || value >= end ||
+            json_string_length(json_object_get(thing, "plain")) != 5 ||
+            strncmp(value, "value", 5)) {
+            fprintf(stderr, "Unescaped string was copied\n");
+            return false;
+        }
+        if (!json_object_get_string(thing, "escaped", &value) ||
+            (value >= encoding && value < end) || strcmp(value, "a\nb")) {
+            fprintf(stderr, "Escaped string was not copied\n");
+            return false;
+        }
+        json_field_t *f = json_object_first(thing);
+        if (json_field_name(f) < encoding || json_field_name(f) >= end ||
+            json_field_name_length(f) != 5) {
+            fprintf(stderr, "Bad zero-copy field name\n");
+            return false;
+        }
+        char buffer[100];
+        json_utf8_encode(thing, buffer, sizeof buffer);
+        if (strcmp(buffer,
+                   "{\"plain\":\"value\",\"escaped\":\"a\\nb\",\"\":[\"\"]}")) {
+            fprintf(stderr, "Bad zero-copy encoding: %s\n", buffer);
+            return false;
+        }
+        json_thing_t *clone = json_clone(thing);
+        json_thing_t *copy = json_utf8_decode_string(encoding);
+        if (!json_thing_equal(thing, copy, 0) ||
+            !json_thing_equal(clone, thing, 0)) {
+            fprintf(stderr, "Zero-copy decoding differs\n");
+            return false;
+        }
+        json_destroy_thing(thing);
+        json_destroy_thing(copy);
+        if (!json_object_get_string(clone, "plain", &value) ||
+            strcmp(value, "value")) {
+            fprintf(stderr, "Bad clone of zero-copy decoding\n");
+            return false;
+        }
+        json_destroy_thing(clone);
+    }
+    return true;
+}
+
+static json_thing_t *parse_in_chunks(const char *encoding, size_t size,
+                                     size_t chunk_size)
+{
+    json_parser_t *parser = json_make_parser();
+    size_t n;
+    for (n = 0; n < size; n += chunk_size) {
+        size_t count = size - n < chunk_size ? size - n : chunk_size;
+        if (!json_parser_feed(parser, encoding + n, count))
+            break;
+    }
+    json_thing_t *thing = json_parser_finish(parser);
+    json_destroy_parser(parser);
+    return thing;
+}
+
+static bool test_parser()
+{
+    static const char *const docs[] = {
+        "[1, -2.5e3, \"a\\\\\", \"b\\\"]\", true, false, null]",
+        "{\"x\": {\"y\": [[], {}, \"\\u00e9\\uD852\\udf62\"]}, \"z\": 0}",
+        "123", " 4.5e-1 ", "\"\"", "true", "[1 2]", "[1,]", "{\"a\" 1}",
+        "{\"a\":}", "{1: 2}", "[truex]", "tru", "12a", "[1\"a\"]",
+        "\"a\"\"b\"", "\"unterminated", "[", "]", "", "   ", "1 2",
+        "{\"a\":1,}", "[-]", "[1.2.3]", "\"\\x\"", "{\"a\":[{\"b\":", NULL
+    };
+    int i;
+    size_t n;
+    for (i = 0; docs[i]; i++) {
+        size_t size = strlen(docs[i]);
+        json_thing_t *expected = json_utf8_decode(docs[i], size);
+        for (n = 1; n <= size + 1; n++) {
+            json_thing_t *thing = parse_in_chunks(docs[i], size, n);
+            if (expected ? !thing || !json_thing_equal(thing, expected, 0)
+                         : thing != NULL) {
+                fprintf(stderr, "Bad chunked parse: %s\n", docs[i]);
+                return false;
+            }
+            if (thing)
+                json_destroy_thing(thing);
+        }
+        if (expected)
+            json_destroy_thing(expected);
+    }
+    json_thing_t *expected = json_utf8_decode_string(data);
+    for (n = 1; n < 20; n++) {
+        json_thing_t *thing = parse_in_chunks(data, strlen(data), n);
+        if (!thing || !json_thing_equal(thing, expected, 0)) {
+            fprintf(stderr, "Bad chunked parse of test data\n");
+            return false;
+        }
+        json_destroy_thing(thing);
+    }
+    json_destroy_thing(expected);
+    char deep[403];
+    memset(deep, '[', 201);
+    memset(deep + 201, ']', 201);
+    deep[402] = '\0';
+    json_thing_t *thing = parse_in_chunks(deep + 1, 400, 7);
+    if (!thing) {
+        fprintf(stderr, "Nesting limit too low\n");
+        return false;
+    }
+    json_destroy_thing(thing);
+    if (parse_in_chunks(deep, 402, 7)) {
+        fprintf(stderr, "Nesting limit not enforced\n");
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    char trace[200];
+    size_t length;
+} scan_trace_t;
+
+static bool trace_event(void *ctx, const char *format, ...)
+{
+    scan_trace_t *trace = ctx;
+    va_list ap;
+    va_start(ap, format);
+    trace->length += vsnprintf(trace->trace + trace->length,
+                               sizeof trace->trace - trace->length, format, ap);
+    va_end(ap);
+    return trace->length < sizeof trace->trace;
+}
+
+static bool trace_start_object(void *ctx)
+{
+    return trace_event(ctx, "{");
+}
+
+static bool trace_key(void *ctx, const char *name, size_t len)
+{
+    if (len == 4 && !memcmp(name, "stop", 4))
+        return false;
+    return trace_event(ctx, "%.*s:", (int) len, name);
+}
+
+static bool trace_end_object(void *ctx)
+{
+    return trace_event(ctx, "}");
+}
+
+static bool trace_start_array(void *ctx)
+{
+    return trace_event(ctx, "[");
+}
+
+static bool trace_end_array(void *ctx)
+{
+    return trace_event(ctx, "]");
+}
+
+static bool trace_string(void *ctx, const char *value, size_t len)
+{
+    return trace_event(ctx, "'%.*s'", (int) len, value);
+}
+
+static bool trace_integer(void *ctx, long long value)
+{
+    return trace_event(ctx, "i%lld", value);
+}
+
+static bool trace_unsigned(void *ctx, unsigned long long value)
+{
+    return trace_event(ctx, "u%llu", value);
+}
+
+static bool trace_real(void *ctx, double value)
+{
+    return trace_event(ctx, "f%g", value);
+}
+
+static bool trace_boolean(void *ctx, bool value)
+{
+    return trace_event(ctx, value ? "T" : "F");
+}
+
+static bool trace_null(void *ctx)
+{
+    return trace_event(ctx, "N");
+}
+
+static bool test_scan()
+{
+    static const json_callbacks_t callbacks = {
+        .start_object = trace_start_object,
+        .key = trace_key,
+        .end_object = trace_end_object,
+        .start_array = trace_start_array,
+        .end_array = trace_end_array,
+        .string = trace_string,
+        .integer = trace_integer,
+        .unsigned_integer = trace_unsigned,
+        .real = trace_real,
+        .boolean = trace_boolean,
+        .null = trace_null,
+    };
+    static const struct {
+        const char *encoding, *trace;
+    } cases[] = {
+        { "{\"a\" : [1, -2, 3.5, \"x\\u0079\"], \"b\": {}, \"c\": [true, "
+          "false, null, []]}",
+          "{a:[u1i-2f3.5'xy']b:{}c:[TFN[]]}" },
+        { " -0 ", "u0" },
+        { "\"\"", "''" },
+        { "[1 2]", NULL },
+        { "{\"a\":1,}", NULL },
+        { "[1]]", NULL },
+        { "{\"a\" 1}", NULL },
+        { "[", NULL },
+        { "", NULL },
+        { NULL }
+    };
+    int i;
+    for (i = 0; cases[i].encoding; i++) {
+        scan_trace_t trace = { .length = 0 };
+        const char *encoding = cases[i].encoding;
+        errno = 0;
+        bool ok = json_utf8_scan(encoding, strlen(encoding), &callbacks,
+                                 &trace);
+        json_thing_t *thing = json_utf8_decode_string(encoding);
+        if (ok != (thing != NULL) || (!ok && errno != EINVAL) ||
+            (ok && strcmp(trace.trace, cases[i].trace))) {
+            fprintf(stderr, "Bad scan of %s\n", encoding);
+            return false;
+        }
+        if (thing)
+            json_destroy_thing(thing);
+    }
+    static const char stop[] = "[{\"go\": 1}, {\"stop\": 2}, 3]";
+    scan_trace_t trace = { .length = 0 };
+    errno = 0;
+    if (json_utf8_scan(stop, sizeof stop - 1, &callbacks, &trace) ||
+        errno || strcmp(trace.trace, "[{go:u1}{")) {
+        fprintf(stderr, "Scan not stopped by callback\n");
+        return false;
+    }
+    static const json_callbacks_t none = { NULL };
+    if (!json_utf8_scan(data, strlen(data), &none, NULL)) {
+        fprintf(stderr, "Bad scan of test data\n");
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    size_t count, bad, limit;
+    long long sum;
+    size_t last_offset;
+    bool in_order;
+    const char *input;
+} ndjson_tally_t;
+
+static bool tally_record(void *ctx, size_t offset, json_thing_t *record)
+{
+    ndjson_tally_t *tally = ctx;
+    if (tally->count && offset <= tally->last_offset)
+        tally->in_order = false;
+    tally->last_offset = offset;
+    tally->count++;
+    long long n;
+    if (!record)
+        tally->bad++;
+    else if (!json_object_get_integer(record, "n", &n) ||
+             strncmp(tally->input + offset, "{\"n\"", 4))
+        return false;
+    else
+        tally->sum += n;
+    return tally->count != tally->limit;
+}
+
+static bool test_ndjson()
+{
+    enum { RECORDS = 3000 };
+    size_t capacity = RECORDS * 40;
+    char *input = malloc(capacity);
+    size_t size = 0;
+    long long sum = 0;
+    int i;
+    for (i = 0; i < RECORDS; i++) {
+        if (i % 100 == 7)
+            size += sprintf(input + size, "{\"n\": oops}\n");
+        else if (i % 100 == 8)
+            size += sprintf(input + size, "  \r\n");
+        else {
+            size += sprintf(input + size, "{\"n\": %d, \"s\": \"x\"}\n", i);
+            sum += i;
+        }
+    }
+    size += sprintf(input + size, "{\"n\": 0}"); /* no final newline */
+    FILE *f = tmpfile();
+    fwrite(input, 1, size, f);
+    static const struct {
+        unsigned num_workers;
+        bool ordered;
+        size_t chunk_size;
+    } configs[] = {
+        { 0, true, 0 }, { 1, true, 100 }, { 4, true, 300 }, { 4, false, 300 },
+        { 3, true, 1 },
+    };
+    size_t c;
+    for (c = 0; c < sizeof configs / sizeof configs[0]; c++) {
+        json_ndjson_options_t options = {
+            .num_workers = configs[c].num_workers,
+            .ordered = configs[c].ordered,
+            .chunk_size = configs[c].chunk_size,
+            .flags = 0,
+        };
+        size_t limit;
+        for (limit = 0; limit <= 500; limit += 500) {
+            int pass;
+            for (pass = 0; pass < 2; pass++) {
+                ndjson_tally_t tally = {
+                    .limit = limit,
+                    .in_order = true,
+                    .input = input,
+                };
+                bool ok;
+                if (pass) {
+                    rewind(f);
+                    ok = json_ndjson_decode_file(f, &options, tally_record,
+                                                 &tally);
+                } else
+                    ok = json_ndjson_decode(input, size, &options,
+                                            tally_record, &tally);
+                if (limit ? ok || tally.count != limit
+                          : !ok || tally.count != RECORDS - RECORDS / 100 + 1 ||
+                            tally.bad != RECORDS / 100 || tally.sum != sum) {
+                    fprintf(stderr, "Bad NDJSON decoding\n");
+                    return false;
+                }
+                if (configs[c].ordered && !tally.in_order) {
+                    fprintf(stderr, "NDJSON records out of order\n");
+                    return false;
+                }
+            }
+        }
+    }
+    fclose(f);
+    free(input);
+    return true;
+}
+
+static bool test_decode_path()
+{
+    char path[] = "/tmp/test_encjson.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+    size_t size = strlen(data);
+    if (write(fd, data, size) != size) {
+        perror("write");
+        return false;
+    }
+    close(fd);
+    json_thing_t *expected = json_utf8_decode_string(data);
+    json_thing_t *thing = json_utf8_decode_path(path, size);
+    if (!thing || !json_thing_equal(thing, expected, 0)) {
+        fprintf(stderr, "Bad decoding of mapped file\n");
+        return false;
+    }
+    json_destroy_thing(thing);
+    errno = 0;
+    if (json_utf8_decode_path(path, size - 1) || errno != ENOMEM) {
+        fprintf(stderr, "Mapped file size limit not enforced\n");
+        return false;
+    }
+    unlink(path);
+    errno = 0;
+    if (json_utf8_decode_path(path, size) || errno != ENOENT) {
+        fprintf(stderr, "Missing file not reported\n");
+        return false;
+    }
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return false;
+    }
+    if (write(fds[1], data, size) != size) {
+        perror("write");
+        return false;
+    }
+    close(fds[1]);
+    thing = json_utf8_decode_fd(fds[0], size);
+    close(fds[0]);
+    if (!thing || !json_thing_equal(thing, expected, 0)) {
+        fprintf(stderr, "Bad decoding of pipe\n");
+        return false;
+    }
+    json_destroy_thing(thing);
+    json_destroy_thing(expected);
+    return true;
+}
+
+typedef struct {
+    char *buffer;
+    size_t size, writes_left;
+} test_sink_t;
+
+static bool test_sink_write(void *obj, const void *data, size_t size)
+{
+    test_sink_t *sink = obj;
+    if (!sink->writes_left--)
+        return false;
+    sink->buffer = realloc(sink->buffer, sink->size + size + 1);
+    memcpy(sink->buffer + sink->size, data, size);
+    sink->size += size;
+    sink->buffer[sink->size] = '\0';
+    return true;
+}
+
+static bool test_sink()
+{
+    json_thing_t *thing = json_utf8_decode_string(data);
+    json_thing_t *array = json_make_array();
+    int i;
+    for (i = 0; i < 1000; i++)
+        json_add_to_array(array, json_clone(thing));
+    json_thing_t *things[] = { thing, array };
+    for (i = 0; i < 2; i++) {
+        int pretty;
+        for (pretty = 0; pretty < 2; pretty++) {
+            size_t size = pretty
+                ? json_utf8_prettyprint(things[i], NULL, 0, 3, 2)
+                : json_utf8_encode(things[i], NULL, 0);
+            char *expected = malloc(size + 1);
+            if (pretty)
+                json_utf8_prettyprint(things[i], expected, size + 1, 3, 2);
+            else
+                json_utf8_encode(things[i], expected, size + 1);
+            test_sink_t sink_data = {
+                .buffer = NULL,
+                .size = 0,
+                .writes_left = -1,
+            };
+            json_sink_t sink = { &sink_data, test_sink_write };
+            bool ok = pretty
+                ? json_utf8_prettyprint_to(things[i], &sink, 3, 2)
+                : json_utf8_encode_to(things[i], &sink);
+            size_t alloc_size;
+            char *alloc = pretty
+                ? json_utf8_prettyprint_alloc(things[i], &alloc_size, 3, 2)
+                : json_utf8_encode_alloc(things[i], &alloc_size);
+            if (!ok || sink_data.size != size ||
+                strcmp(sink_data.buffer, expected) || alloc_size != size ||
+                strcmp(alloc, expected)) {
+                fprintf(stderr, "Bad single-pass encoding\n");
+                return false;
+            }
+            fsfree(alloc);
+            char small[10];
+            if ((pretty ? json_utf8_prettyprint(things[i], small, sizeof small,
+                                                3, 2)
+                        : json_utf8_encode(things[i], small, sizeof small)) !=
+                    size ||
+                strncmp(small, expected, sizeof small - 1) ||
+                small[sizeof small - 1]) {
+                fprintf(stderr, "Bad truncated encoding\n");
+                return false;
+            }
+            free(expected);
+            free(sink_data.buffer);
+        }
+    }
+    test_sink_t failing = {
+        .buffer = NULL,
+        .size = 0,
+        .writes_left = 1,
+    };
+    json_sink_t sink = { &failing, test_sink_write };
+    if (json_utf8_encode_to(array, &sink)) {
+        fprintf(stderr, "Sink failure not reported\n");
+        return false;
+    }
+    free(failing.buffer);
+    json_destroy_thing(array);
+    json_destroy_thing(thing);
+    return true;
+}
+
+static char *escape_reference(const char *s, size_t len)
+{
+    char *buffer = malloc(6 * len + 3), *q = buffer;
+    size_t i;
+    *q++ = '"';
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            q += sprintf(q, "\\%c", c);
+        else if (c == '\n')
+            q += sprintf(q, "\\n");
+        else if (c == '\t')
+            q += sprintf(q, "\\t");
+        else if (c == '\b')
+            q += sprintf(q, "\\b");
+        else if (c == '\f')
+            q += sprintf(q, "\\f");
+        else if (c == '\r')
+            q += sprintf(q, "\\r");
+        else if (c < 0x20 || c == 0x7f)
+            q += sprintf(q, "\\u%04x", c);
+        else if (c == 0xc2 && i + 1 < len && (s[i + 1] & 0xe0) == 0x80)
+            q += sprintf(q, "\\u%04x", s[++i] & 0xff);
+        else
+            *q++ = c;
+    }
+    *q++ = '"';
+    *q = '\0';
+    return buffer;
+}
+
+static bool test_string_escaping()
+{
+    static const char *const pieces[] = {
+        "a", "\"", "\\", "\n", "\x01", "\x1f", "\x7f", " ", "\xc2\x85",
+        "\xc2\x9f", "\xc2\xa9", "\xc3\xa9", "/", "~",
+    };
+    enum { NUM_PIECES = sizeof pieces / sizeof pieces[0] };
+    char s[200];
+    unsigned seed = 1;
+    int round;
+    for (round = 0; round < 1000; round++) {
+        size_t limit = round % (sizeof s - 1), len = 0;
+        for (;;) {
+            seed = seed * 1103515245 + 12345;
+            /* bias towards long runs that need no escaping */
+            unsigned choice = (seed >> 16) % (2 * NUM_PIECES);
+            const char *piece = choice < NUM_PIECES
+                ? pieces[choice]
+                : "a run of plain text";
+            if (strlen(piece) > limit - len)
+                break;
+            memcpy(s + len, piece, strlen(piece));
+            len += strlen(piece);
+        }
+        if (round % 3 == 0)
+            s[len++] = '\0'; /* embedded NUL */
+        json_thing_t *thing = json_make_bounded_string(s, len);
+        char *expected = escape_reference(s, len);
+        size_t size;
+        char *encoding = json_utf8_encode_alloc(thing, &size);
+        if (size != strlen(expected) || strcmp(encoding, expected)) {
+            fprintf(stderr, "Bad string escaping: %s\n", encoding);
+            return false;
+        }
+        json_thing_t *decoded = json_utf8_decode(encoding, size);
+        if (!decoded || !json_thing_equal(thing, decoded, 0)) {
+            fprintf(stderr, "String escaping does not round-trip\n");
+            return false;
+        }
+        json_destroy_thing(decoded);
+        fsfree(encoding);
+        free(expected);
+        json_destroy_thing(thing);
+    }
+    return true;
+}
+
+static bool test_integer_formatting()
+{
+    static const long long integers[] = {
+        0, 1, -1, 9, 10, 99, 100, -100, 12345, 1000000007,
+        LLONG_MAX, LLONG_MIN, LLONG_MIN + 1,
+    };
+    static const unsigned long long unsigneds[] = {
+        0, 7, 42, 999, 1000, 18446744073709551615ULL, 10000000000000000000ULL,
+    };
+    json_thing_t *array = json_make_array();
+    char expected[1000], *q = expected;
+    size_t i;
+    q += sprintf(q, "[");
+    for (i = 0; i < sizeof integers / sizeof integers[0]; i++) {
+        json_add_to_array(array, json_make_integer(integers[i]));
+        q += sprintf(q, "%s%lld", i ? "," : "", integers[i]);
+    }
+    for (i = 0; i < sizeof unsigneds / sizeof unsigneds[0]; i++) {
+        json_add_to_array(array, json_make_unsigned(unsigneds[i]));
+        q += sprintf(q, ",%llu", unsigneds[i]);
+    }
+    unsigned long long n;
+    for (n = 1; n && n <= ULLONG_MAX / 10; n *= 10) {
+        json_add_to_array(array, json_make_unsigned(n - 1));
+        json_add_to_array(array, json_make_unsigned(n));
+        q += sprintf(q, ",%llu,%llu", n - 1, n);
+    }
+    q += sprintf(q, "]");
+    char *encoding = json_utf8_encode_alloc(array, NULL);
+    if (strcmp(encoding, expected)) {
+        fprintf(stderr, "Bad integer formatting: %s\n", encoding);
+        return false;
+    }
+    fsfree(encoding);
+    json_destroy_thing(array);
+    return true;
+}
+
+static bool test_integer_parsing()
+{
+    static const struct {
+        const char *repr;
+        json_thing_type_t type;
+        long long integer;
+        unsigned long long u_integer;
+    } cases[] = {
+        { "0", JSON_UNSIGNED, 0, 0 },
+        { "-0", JSON_UNSIGNED, 0, 0 },
+        { "7", JSON_UNSIGNED, 0, 7 },
+        { "-7", JSON_INTEGER, -7, 0 },
+        { "200", JSON_UNSIGNED, 0, 200 },
+        { "12345678", JSON_UNSIGNED, 0, 12345678 },
+        { "123456789", JSON_UNSIGNED, 0, 123456789 },
+        { "1234567812345678", JSON_UNSIGNED, 0, 1234567812345678 },
+        { "9999999999999999999", JSON_UNSIGNED, 0, 9999999999999999999ULL },
+        { "18446744073709551615", JSON_UNSIGNED, 0, 18446744073709551615ULL },
+        { "1e3", JSON_UNSIGNED, 0, 1000 },
+        { "9223372036854775807", JSON_UNSIGNED, 0, 9223372036854775807 },
+        { "-9223372036854775807", JSON_INTEGER, -9223372036854775807, 0 },
+        { "-9223372036854775808", JSON_INTEGER, LLONG_MIN, 0 },
+        { "-9223372036854775809", JSON_FLOAT, 0, 0 },
+        { "18446744073709551616", JSON_FLOAT, 0, 0 },
+        { "1.5", JSON_FLOAT, 0, 0 },
+        { "10E1", JSON_UNSIGNED, 0, 100 },
+    };
+    size_t i;
+    for (i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        char buffer[100];
+        sprintf(buffer, "[%s,%s]", cases[i].repr, cases[i].repr);
+        json_thing_t *array = json_utf8_decode_string(buffer);
+        if (!array || json_array_size(array) != 2) {
+            fprintf(stderr, "Failed to decode %s\n", buffer);
+            return false;
+        }
+        json_thing_t *number = json_array_get(array, 0);
+        if (json_thing_type(number) != cases[i].type ||
+            (cases[i].type == JSON_INTEGER &&
+             json_integer_value(number) != cases[i].integer) ||
+            (cases[i].type == JSON_UNSIGNED &&
+             json_unsigned_value(number) != cases[i].u_integer)) {
+            fprintf(stderr, "Bad decoding of %s\n", cases[i].repr);
+            return false;
+        }
+        json_destroy_thing(array);
+    }
+    static const char *const bad[] = {
+        "[-]", "[-x]", "[1.]", "[1e]", "[1e+]",
+    };
+    for (i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+        json_thing_t *thing = json_utf8_decode_string(bad[i]);
+        if (thing) {
+            fprintf(stderr, "Accepted bad number %s\n", bad[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_compact_nodes()
+{
+    if (json_make_null() != json_make_null() ||
+        json_make_boolean(true) != json_make_boolean(true) ||
+        json_make_boolean(false) == json_make_boolean(true)) {
+        fprintf(stderr, "Booleans and nulls are not shared\n");
+        return false;
+    }
+    json_thing_t *array = json_make_array();
+    json_add_to_array(array, json_make_null());
+    json_add_to_array(array, json_make_null());
+    json_add_to_array(array, json_make_boolean(true));
+    json_destroy_thing(json_make_null());
+    char *encoding = json_utf8_encode_alloc(array, NULL);
+    if (strcmp(encoding, "[null,null,true]")) {
+        fprintf(stderr, "Bad singleton encoding: %s\n", encoding);
+        return false;
+    }
+    fsfree(encoding);
+    json_destroy_thing(array);
+
+    char s[40];
+    size_t len;
+    for (len = 0; len < sizeof s; len++) {
+        size_t i;
+        for (i = 0; i < len; i++)
+            s[i] = i % 7 ? 'a' + i % 26 : '\0';
+        json_thing_t *string = json_make_bounded_string(s, len);
+        if (json_string_length(string) != len ||
+            memcmp(json_string_value(string), s, len) ||
+            json_string_value(string)[len]) {
+            fprintf(stderr, "Bad string of length %zu\n", len);
+            return false;
+        }
+        json_thing_t *clone = json_clone(string);
+        if (!json_thing_equal(string, clone, 0)) {
+            fprintf(stderr, "Bad string clone of length %zu\n", len);
+            return false;
+        }
+        json_destroy_thing(clone);
+        encoding = json_utf8_encode_alloc(string, NULL);
+        unsigned flags;
+        for (flags = 0; flags < 4; flags++) {
+            json_arena_t *arena = flags & 2 ? json_make_arena() : NULL;
+            int zero_copy = flags & 1 ? JSON_DECODE_ZERO_COPY : 0;
+            json_thing_t *decoding = arena
+                ? json_utf8_decode_in_arena(arena, encoding,
+                                            strlen(encoding))
+                : json_utf8_decode_ex(encoding, strlen(encoding), zero_copy);
+            if (!json_thing_equal(string, decoding, 0)) {
+                fprintf(stderr, "Bad string decoding of length %zu\n", len);
+                return false;
+            }
+            if (arena)
+                json_destroy_arena(arena);
+            else
+                json_destroy_thing(decoding);
+        }
+        fsfree(encoding);
+        json_destroy_thing(string);
+    }
+    return true;
+}
+
+static json_thing_t *linear_get(json_thing_t *object, const char *key)
+{
+    json_field_t *f;
+    for (f = json_object_first(object); f; f = json_field_next(f))
+        if (!strcmp(json_field_name(f), key))
+            return json_field_value(f);
+    return NULL;
+}
+
+static bool check_lookups(json_thing_t *object, int num_names)
+{
+    int round, i;
+    for (round = 0; round < 3; round++)
+        for (i = 0; i < num_names; i++) {
+            char name[20];
+            sprintf(name, "key%d", i);
+            json_thing_t *expected = linear_get(object, name);
+            if (json_object_get(object, name) != expected ||
+                json_object_get_key(object, json_intern(name)) != expected) {
+                fprintf(stderr, "Bad lookup of %s\n", name);
+                return false;
+            }
+        }
+    return true;
+}
+
+static bool test_interned_keys()
+{
+    json_key_t a = json_intern("user_id");
+    if (json_intern("user_id") != a || json_intern("user") == a) {
+        fprintf(stderr, "Bad interning\n");
+        return false;
+    }
+    enum { NUM_NAMES = 200 };
+    json_thing_t *object = json_make_object();
+    int i;
+    for (i = 0; i < NUM_NAMES; i += 2) {
+        char name[20];
+        sprintf(name, "key%d", i % 150); /* some duplicates */
+        json_add_to_object(object, name, json_make_integer(i));
+    }
+    if (!check_lookups(object, NUM_NAMES))
+        return false;
+    for (i = 1; i < NUM_NAMES; i += 2) {
+        char name[20];
+        sprintf(name, "key%d", i);
+        json_add_to_object(object, name, json_make_integer(i));
+    }
+    if (!check_lookups(object, NUM_NAMES))
+        return false;
+    for (i = 0; i < NUM_NAMES; i += 3) {
+        char name[20];
+        sprintf(name, "key%d", i);
+        json_thing_t *expected = linear_get(object, name);
+        json_thing_t *value = json_object_pop(object, name);
+        if (value != expected) {
+            fprintf(stderr, "Bad pop of %s\n", name);
+            return false;
+        }
+        if (value)
+            json_destroy_thing(value);
+        if (!check_lookups(object, NUM_NAMES))
+            return false;
+    }
+    json_destroy_thing(object);
+    return true;
+}
+
+static bool test_path()
+{
+    json_thing_t *thing = json_utf8_decode_string(
+        "{\"a\": {\"b\": [0, 1, 2, {\"c\": \"x\"}], \"d\": 7},"
+        " \"e\": [[true]]}");
+    static const struct {
+        const char *expr, *encoding; /* NULL if the path does not match */
+    } cases[] = {
+        { "", NULL },
+        { "a.b[3].c", "\"x\"" },
+        { "a.b[2]", "2" },
+        { "a.b[4]", NULL },
+        { "a.d", "7" },
+        { "a.d.e", NULL },
+        { "e[0][0]", "true" },
+        { "e.x", NULL },
+        { "f", NULL },
+        { "a.b", "[0,1,2,{\"c\":\"x\"}]" },
+    };
+    enum { NUM_CASES = sizeof cases / sizeof cases[0] };
+    json_path_t *paths[NUM_CASES];
+    int i;
+    for (i = 0; i < NUM_CASES; i++) {
+        paths[i] = json_path_compile(cases[i].expr);
+        if (!paths[i]) {
+            fprintf(stderr, "Failed to compile %s\n", cases[i].expr);
+            return false;
+        }
+    }
+    json_path_set_t *set = json_make_path_set(paths, NUM_CASES);
+    json_thing_t *results[NUM_CASES];
+    json_path_set_eval(set, thing, results);
+    for (i = 0; i < NUM_CASES; i++) {
+        json_thing_t *value = json_path_eval(paths[i], thing);
+        json_destroy_path(paths[i]);
+        if (value != results[i]) {
+            fprintf(stderr, "Path set disagrees on %s\n", cases[i].expr);
+            return false;
+        }
+        if (!*cases[i].expr) {
+            if (value != thing) {
+                fprintf(stderr, "Empty path is not the identity\n");
+                return false;
+            }
+            continue;
+        }
+        char *encoding = value ? json_utf8_encode_alloc(value, NULL) : NULL;
+        if (cases[i].encoding ? !encoding || strcmp(encoding, cases[i].encoding)
+                              : encoding != NULL) {
+            fprintf(stderr, "Bad evaluation of %s\n", cases[i].expr);
+            return false;
+        }
+        fsfree(encoding);
+    }
+    json_destroy_path_set(set);
+    static const char *const bad[] = {
+        ".a", "a.", "a..b", "a[", "a[]", "a[x]", "a[1", "a[1]b", "[1]]",
+        "a[99999999999999999999999]",
+    };
+    for (i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+        errno = 0;
+        if (json_path_compile(bad[i]) || errno != EINVAL) {
+            fprintf(stderr, "Accepted bad path %s\n", bad[i]);
+            return false;
+        }
+    }
+    json_destroy_thing(thing);
+    return true;
+}
+
+static bool test_lazy()
+{
+    static const char encoding[] =
+        "{ \"a\" : { \"b\" : [ 1, 2, { \"c\" : \"x y\" } ], \"d\" : {} },\n"
+        "  \"e\" : [ [ true ], \"\\\"]\" ], \"f\": 3 }";
+    json_thing_t *eager = json_utf8_decode_string(encoding);
+    char *expected = json_utf8_encode_alloc(eager, NULL);
+    char *pretty = json_utf8_prettyprint_alloc(eager, NULL, 0, 2);
+    int round;
+    for (round = 0; round < 4; round++) {
+        json_thing_t *lazy = json_utf8_decode_lazy(encoding, strlen(encoding));
+        if (!lazy) {
+            fprintf(stderr, "Lazy decoding failed\n");
+            return false;
+        }
+        char *encoding2 = NULL;
+        switch (round) {
+            case 0: /* untouched */
+                encoding2 = json_utf8_encode_alloc(lazy, NULL);
+                break;
+            case 1: { /* partially expanded */
+                json_path_t *path = json_path_compile("a.b[1]");
+                if (json_unsigned_value(json_path_eval(path, lazy)) != 2) {
+                    fprintf(stderr, "Bad lazy access\n");
+                    return false;
+                }
+                json_destroy_path(path);
+                encoding2 = json_utf8_encode_alloc(lazy, NULL);
+            } break;
+            case 2:
+                encoding2 = json_utf8_prettyprint_alloc(lazy, NULL, 0, 2);
+                break;
+            default: {
+                json_thing_t *clone = json_clone(lazy);
+                if (!json_thing_equal(lazy, eager, 0) ||
+                    !json_thing_equal(clone, eager, 0)) {
+                    fprintf(stderr, "Lazy decoding differs\n");
+                    return false;
+                }
+                json_destroy_thing(json_object_pop(
+                    json_object_fetch(lazy, "a"), "b"));
+                json_destroy_thing(clone);
+            }
+        }
+        if (encoding2 && strcmp(encoding2, round == 2 ? pretty : expected)) {
+            fprintf(stderr, "Bad lazy encoding: %s\n", encoding2);
+            return false;
+        }
+        fsfree(encoding2);
+        json_destroy_thing(lazy);
+    }
+    static const char bad[] = "{\"a\": [1, 2}";
+    if (json_utf8_decode_lazy(bad, strlen(bad))) {
+        fprintf(stderr, "Bad lazy decoding accepted\n");
+        return false;
+    }
+    /* a lazy decoding stays accessible under a tighter depth limit */
+    json_thing_t *lazy = json_utf8_decode_lazy(encoding, strlen(encoding));
+    unsigned old_limit = json_set_max_depth(1);
+    json_thing_t *b = json_object_get(json_object_get(lazy, "a"), "b");
+    json_set_max_depth(old_limit);
+    if (!b || json_array_size(b) != 3) {
+        fprintf(stderr, "Bad lazy expansion under a depth limit\n");
+        return false;
+    }
+    json_destroy_thing(lazy);
+    fsfree(expected);
+    fsfree(pretty);
+    json_destroy_thing(eager);
+    return true;
+}
+
+static bool test_binary()
+{
+    json_thing_t *thing = json_utf8_decode_string(data);
+    json_thing_t *numbers = json_make_array();
+    json_add_to_array(numbers, json_make_integer(LLONG_MIN));
+    json_add_to_array(numbers, json_make_integer(-1));
+    json_add_to_array(numbers, json_make_integer(LLONG_MAX));
+    json_add_to_array(numbers, json_make_unsigned(0));
+    json_add_to_array(numbers, json_make_unsigned(ULLONG_MAX));
+    json_add_to_array(numbers, json_make_float(0.1));
+    json_add_to_array(numbers, json_make_float(-0.0));
+    json_add_to_array(numbers, json_make_float(3.0));
+    json_add_to_array(numbers, json_make_bounded_string("a\0b", 3));
+    json_add_to_object(thing, "numbers", numbers);
+    size_t size;
+    char *encoding = json_binary_encode(thing, &size);
+    unsigned flags;
+    for (flags = 0; flags <= JSON_DECODE_ZERO_COPY;
+         flags += JSON_DECODE_ZERO_COPY) {
+        json_thing_t *decoding = json_binary_decode(encoding, size, flags);
+        if (!decoding || !json_thing_equal(thing, decoding, 0)) {
+            fprintf(stderr, "Bad binary round trip\n");
+            return false;
+        }
+        json_thing_t *copy = json_object_fetch(decoding, "numbers");
+        size_t i;
+        for (i = 0; i < json_array_size(numbers); i++) {
+            json_thing_t *a = json_array_get(numbers, i);
+            json_thing_t *b = json_array_get(copy, i);
+            if (json_thing_type(a) != json_thing_type(b) ||
+                (json_thing_type(a) == JSON_FLOAT &&
+                 memcmp(&(double) { json_double_value(a) },
+                        &(double) { json_double_value(b) },
+                        sizeof(double)))) {
+                fprintf(stderr, "Binary number %zu not preserved\n", i);
+                return false;
+            }
+        }
+        const char *value = json_string_value(json_array_get(copy, 8));
+        bool borrowed = value >= encoding && value < encoding + size;
+        if (borrowed != (flags == JSON_DECODE_ZERO_COPY)) {
+            fprintf(stderr, "Bad binary zero copy\n");
+            return false;
+        }
+        json_destroy_thing(decoding);
+    }
+    size_t n;
+    for (n = 0; n < size; n++) {
+        errno = 0;
+        if (json_binary_decode(encoding, n, 0) || errno != EINVAL) {
+            fprintf(stderr, "Truncated binary encoding accepted\n");
+            return false;
+        }
+    }
+    encoding[4]++; /* the version */
+    if (json_binary_decode(encoding, size, 0)) {
+        fprintf(stderr, "Unsupported binary version accepted\n");
+        return false;
+    }
+    fsfree(encoding);
+    json_destroy_thing(thing);
+    return true;
+}
+
+static bool test_freeze()
+{
+    json_thing_t *thing = json_utf8_decode_string(data);
+    json_thing_t *big = json_make_object();
+    int i;
+    for (i = 0; i < 100; i++) {
+        char name[20];
+        sprintf(name, "field-%d", i);
+        json_add_to_object(big, name, json_make_integer(i));
+    }
+    json_add_to_object(thing, "big", big);
+    json_add_to_object(thing, "raw", json_make_raw("[1,2]"));
+    size_t size;
+    char *block = json_freeze(thing, &size);
+    /* the block must work at any (aligned) address */
+    char *copy = fsalloc(size);
+    memcpy(copy, block, size);
+    fsfree(block);
+    json_thing_t *root = json_frozen_root(copy, size);
+    if (!root || !json_thing_equal(thing, root, 0) ||
+        !json_thing_equal(root, thing, 0)) {
+        fprintf(stderr, "Bad frozen copy\n");
+        return false;
+    }
+    size_t len = json_utf8_encode(thing, NULL, 0) + 1;
+    char a[len], b[len];
+    (void) json_utf8_encode(thing, a, len);
+    if (json_utf8_encode(root, b, len) != len - 1 || strcmp(a, b)) {
+        fprintf(stderr, "Bad frozen encoding: %s\n", b);
+        return false;
+    }
+    json_thing_t *frozen_big = json_object_fetch(root, "big");
+    json_field_t *field;
+    i = 0;
+    for (field = json_object_first(frozen_big); field;
+         field = json_field_next(field), i++) {
+        char name[20];
+        sprintf(name, "field-%d", i);
+        long long n;
+        if (strcmp(json_field_name(field), name) ||
+            !json_object_get_integer(frozen_big, name, &n) || n != i ||
+            json_object_get_key(frozen_big, json_intern(name)) !=
+                json_field_value(field)) {
+            fprintf(stderr, "Bad frozen field %d\n", i);
+            return false;
+        }
+    }
+    if (i != 100 || json_object_get(frozen_big, "field-100")) {
+        fprintf(stderr, "Bad frozen object\n");
+        return false;
+    }
+    json_path_t *path = json_path_compile("truth");
+    json_thing_t *truth = json_path_eval(path, root);
+    if (!truth || json_thing_type(truth) != JSON_BOOLEAN ||
+        !json_boolean_value(truth)) {
+        fprintf(stderr, "Bad frozen path lookup\n");
+        return false;
+    }
+    json_destroy_path(path);
+    json_thing_t *clone = json_clone(root);
+    if (!json_thing_equal(clone, thing, 0)) {
+        fprintf(stderr, "Bad clone of a frozen document\n");
+        return false;
+    }
+    json_destroy_thing(clone);
+    errno = 0;
+    if (json_frozen_root(copy, size - 8) || errno != EINVAL) {
+        fprintf(stderr, "Truncated frozen block accepted\n");
+        return false;
+    }
+    copy[0] = 'X';
+    if (json_frozen_root(copy, size)) {
+        fprintf(stderr, "Bad frozen magic accepted\n");
+        return false;
+    }
+    fsfree(copy);
+    json_destroy_thing(thing);
+    return true;
+}
+
+typedef struct {
+    json_thing_t *thing;
+    size_t max_size;
+    bool ok;
+} trace_job_t;
+
+static void *trace_worker(void *p)
+{
+    trace_job_t *job = p;
+    size_t len = json_utf8_encode(job->thing, NULL, 0) + 1;
+    char expected[len];
+    (void) json_utf8_encode(job->thing, expected, len);
+    size_t n = job->max_size < len - 1 ? job->max_size : len - 1;
+    int i;
+    job->ok = true;
+    for (i = 0; i < 1000; i++) {
+        json_trace_max_size(&job->max_size);
+        const char *a = json_trace(job->thing);
+        json_trace_max_size(&job->max_size);
+        const char *b = json_trace(job->thing);
+        if (a == b || strlen(a) != n || strncmp(a, expected, n) ||
+            strcmp(a, b))
+            job->ok = false;
+    }
+    return NULL;
+}
+
+static bool test_trace()
+{
+    json_thing_t *thing = json_utf8_decode_string(data);
+    enum { THREADS = 4 };
+    pthread_t threads[THREADS];
+    trace_job_t jobs[THREADS];
+    int i;
+    for (i = 0; i < THREADS; i++) {
+        jobs[i].thing = thing;
+        jobs[i].max_size = 10 + 40 * i;
+        pthread_create(&threads[i], NULL, trace_worker, &jobs[i]);
+    }
+    bool ok = true;
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok) {
+            fprintf(stderr, "Bad trace output with maximum size %zu\n",
+                    jobs[i].max_size);
+            ok = false;
+        }
+    }
+    size_t len = json_utf8_encode(thing, NULL, 0) + 1;
+    char expected[len];
+    (void) json_utf8_encode(thing, expected, len);
+    const char *s = json_trace(thing);
+    if (strcmp(s, expected)) {
+        fprintf(stderr, "Bad trace output: %s\n", s);
+        ok = false;
+    }
+    json_destroy_thing(thing);
+    return ok;
+}
+
+static bool check_written(const char *path, const char *expected)
+{
+    FILE *f = fopen(path, "r");
+    size_t size = strlen(expected);
+    char *buffer = fsalloc(size + 2);
+    size_t count = fread(buffer, 1, size + 1, f);
+    fclose(f);
+    bool ok = count == size && !memcmp(buffer, expected, size);
+    fsfree(buffer);
+    return ok;
+}
+
+static bool test_write()
+{
+    json_thing_t *thing = json_make_array();
+    int i;
+    for (i = 0; i < 20000; i++)
+        json_add_to_array(thing, json_utf8_decode_string(data));
+    char path[] = "/tmp/test_encjson.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return false;
+    }
+    char *compact = json_utf8_encode_alloc(thing, NULL);
+    if (!json_utf8_write(thing, fd, 0) || !check_written(path, compact)) {
+        fprintf(stderr, "Bad compact write\n");
+        return false;
+    }
+    fsfree(compact);
+    size_t size;
+    char *pretty = json_utf8_prettyprint_alloc(thing, &size, 0, 2);
+    char *expected = fsalloc(size + 2);
+    strcpy(expected, pretty);
+    strcat(expected, "\n");
+    fsfree(pretty);
+    if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("ftruncate");
+        return false;
+    }
+    if (!json_utf8_write(thing, fd, JSON_WRITE_PRETTY | JSON_WRITE_NEWLINE) ||
+        !check_written(path, expected)) {
+        fprintf(stderr, "Bad pretty write\n");
+        return false;
+    }
+    close(fd);
+    FILE *f = fopen(path, "w");
+    if (json_utf8_dump(thing, f) != size + 1 || fclose(f) ||
+        !check_written(path, expected)) {
+        fprintf(stderr, "Bad dump\n");
+        return false;
+    }
+    fsfree(expected);
+    unlink(path);
+    errno = 0;
+    if (json_utf8_write(thing, fd, 0) || errno != EBADF) {
+        fprintf(stderr, "Write error not reported\n");
+        return false;
+    }
+    json_destroy_thing(thing);
+    return true;
+}
+
+/* Return {"a":[{"a":[...1...]}]} with the given number of nested
+ * objects and arrays. */
+static char *make_deep(size_t pairs)
+{
+    char *encoding = fsalloc(8 * pairs + 2);
+    char *p = encoding;
+    size_t i;
+    for (i = 0; i < pairs; i++) {
+        memcpy(p, "{\"a\":[", 6);
+        p += 6;
+    }
+    *p++ = '1';
+    for (i = 0; i < pairs; i++) {
+        memcpy(p, "]}", 2);
+        p += 2;
+    }
+    *p = '\0';
+    return encoding;
+}
+
+/* Return 1 if all decoders accept the nesting, 0 if they all reject it
+ * and -1 if they disagree. Lazy decoding is quadratic in the depth, so
+ * it is left out of the deepest tests. */
+static int decodes_deep(size_t pairs, bool lazy)
+{
+    char *encoding = make_deep(pairs);
+    size_t size = strlen(encoding);
+    json_thing_t *things[4] = {
+        json_utf8_decode(encoding, size),
+        json_utf8_decode_ex(encoding, size, JSON_DECODE_STRUCTURAL_INDEX),
+        lazy ? json_utf8_decode_lazy(encoding, size) : NULL,
+    };
+    json_parser_t *parser = json_make_parser();
+    json_parser_feed(parser, encoding, size);
+    things[3] = json_parser_finish(parser);
+    json_destroy_parser(parser);
+    json_callbacks_t no_callbacks = { NULL };
+    int result = json_utf8_scan(encoding, size, &no_callbacks, NULL);
+    int i;
+    for (i = 0; i < 4; i++)
+        if (i != 2 || lazy) {
+            if ((things[i] != NULL) != result ||
+                (things[i] && !json_thing_equal(things[i], things[0], 0)))
+                result = -1;
+        }
+    for (i = 0; i < 4; i++)
+        if (things[i])
+            json_destroy_thing(things[i]);
+    fsfree(encoding);
+    return result;
+}
+
+static bool test_deep_nesting()
+{
+    /* the scalar is at the depth of 2 * pairs */
+    if (decodes_deep(99, true) != 1 || decodes_deep(100, true) != 0) {
+        fprintf(stderr, "Bad default depth limit\n");
+        return false;
+    }
+    enum { PAIRS = 100000 };
+    unsigned old_limit = json_set_max_depth(2 * PAIRS + 1);
+    if (old_limit != JSON_DEFAULT_MAX_DEPTH ||
+        decodes_deep(PAIRS, false) != 1 ||
+        decodes_deep(PAIRS + 1, false) != 0) {
+        fprintf(stderr, "Bad custom depth limit\n");
+        return false;
+    }
+    char *encoding = make_deep(PAIRS);
+    json_thing_t *thing = json_utf8_decode_string(encoding);
+    char *compact = json_utf8_encode_alloc(thing, NULL);
+    if (strcmp(compact, encoding)) {
+        fprintf(stderr, "Bad deep encoding\n");
+        return false;
+    }
+    fsfree(compact);
+    char *pretty = json_utf8_prettyprint_alloc(thing, NULL, 0, 0);
+    json_thing_t *clone = json_clone(thing);
+    json_thing_t *reparsed = json_utf8_decode_string(pretty);
+    if (!reparsed || !json_thing_equal(clone, thing, 0) ||
+        !json_thing_equal(reparsed, thing, 0)) {
+        fprintf(stderr, "Bad deep clone or prettyprint\n");
+        return false;
+    }
+    json_destroy_thing(reparsed);
+    json_destroy_thing(clone);
+    fsfree(pretty);
+    json_destroy_thing(thing);
+    fsfree(encoding);
+    json_set_max_depth(old_limit);
+    return true;
+}
+
+static bool test_parallel_encoding()
+{
+    json_thing_t *thing = json_utf8_decode_string(data);
+    json_thing_t *events = json_make_array();
+    json_thing_t *index = json_make_object();
+    int i;
+    for (i = 0; i < 5000; i++) {
+        json_add_to_array(events, json_clone(thing));
+        char name[20];
+        sprintf(name, "event-%d", i);
+        json_add_to_object(index, name, json_make_integer(i));
+    }
+    json_thing_t *doc = json_make_object();
+    json_add_to_object(doc, "events", events);
+    json_add_to_object(doc, "index", index);
+    json_add_to_object(doc, "small", thing);
+    char *expected = json_utf8_encode_alloc(doc, NULL);
+    unsigned nthreads;
+    for (nthreads = 0; nthreads <= 8; nthreads += 4) {
+        test_sink_t sink_data = {
+            .buffer = NULL,
+            .size = 0,
+            .writes_left = -1,
+        };
+        json_sink_t sink = { &sink_data, test_sink_write };
+        if (!json_utf8_encode_parallel(doc, nthreads, &sink) ||
+            strcmp(sink_data.buffer, expected)) {
+            fprintf(stderr, "Bad parallel encoding with %u threads\n",
+                    nthreads);
+            return false;
+        }
+        free(sink_data.buffer);
+    }
+    fsfree(expected);
+    test_sink_t failing = {
+        .buffer = NULL,
+        .size = 0,
+        .writes_left = 2,
+    };
+    json_sink_t sink = { &failing, test_sink_write };
+    if (json_utf8_encode_parallel(doc, 4, &sink)) {
+        fprintf(stderr, "Parallel sink failure not reported\n");
+        return false;
+    }
+    free(failing.buffer);
+    json_destroy_thing(doc);
+    return true;
+}
+
+/* The sizing call must agree with the actual encoding. Sizing twice
+ * exercises the remembered lengths. */
+static bool size_is_right(json_thing_t *thing)
+{
+    size_t measured = json_utf8_encode(thing, NULL, 0);
+    size_t remeasured = json_utf8_encode(thing, NULL, 0);
+    size_t size;
+    char *encoding = json_utf8_encode_alloc(thing, &size);
+    fsfree(encoding);
+    return measured == size && remeasured == size;
+}
+
+static bool test_encoded_size_cache()
+{
+    json_thing_t *doc = json_utf8_decode_string(data);
+    json_thing_t *months = json_object_get(doc, "months");
+    json_thing_t *inner = json_make_object();
+    json_add_to_array(months, inner);
+    if (!size_is_right(doc)) {
+        fprintf(stderr, "Bad initial encoded size\n");
+        return false;
+    }
+    json_add_to_object(inner, "added", json_make_string("deep down"));
+    if (!size_is_right(doc)) {
+        fprintf(stderr, "Encoded size not updated after adding\n");
+        return false;
+    }
+    json_destroy_thing(json_object_pop(inner, "added"));
+    char small[8];
+    if (json_utf8_encode(doc, small, sizeof small) !=
+            json_utf8_encode(doc, NULL, 0) ||
+        !size_is_right(doc)) {
+        fprintf(stderr, "Encoded size not updated after popping\n");
+        return false;
+    }
+    json_thing_t *popped = json_object_pop(doc, "months");
+    json_add_to_array(popped, json_make_null());
+    if (!size_is_right(doc) || !size_is_right(popped)) {
+        fprintf(stderr, "Bad encoded size of a popped value\n");
+        return false;
+    }
+    json_destroy_thing(popped);
+    json_destroy_thing(doc);
+    const char *nested = "{\"a\": {\"b\": [1, 2, {\"c\": []}]}}";
+    doc = json_utf8_decode_lazy(nested, strlen(nested));
+    if (!size_is_right(doc)) {
+        fprintf(stderr, "Bad encoded size of a lazy decoding\n");
+        return false;
+    }
+    json_thing_t *b = json_object_get(json_object_get(doc, "a"), "b");
+    json_add_to_object(json_array_get(b, 2), "d", json_make_integer(4));
+    if (!size_is_right(doc)) {
+        fprintf(stderr, "Encoded size not updated in a lazy decoding\n");
+        return false;
+    }
+    json_destroy_thing(doc);
+    return true;
+}
+
+typedef struct {
+    json_thing_t *copy;
+    int n;
+    bool ok;
+} share_job_t;
+
+static void *share_worker(void *p)
+{
+    share_job_t *job = p;
+    json_thing_t *b =
+        json_object_get(json_object_get(job->copy, "a"), "b");
+    json_add_to_array(b, json_make_integer(job->n));
+    char expected[100], buffer[100];
+    sprintf(expected, "{\"a\":{\"b\":[1,2,{\"c\":[]},%d],\"s\":\"shared "
+            "string\"},\"d\":[{\"e\":true}]}", job->n);
+    json_utf8_encode(job->copy, buffer, sizeof buffer);
+    job->ok = !strcmp(buffer, expected) && size_is_right(job->copy);
+    json_destroy_thing(job->copy);
+    return NULL;
+}
+
+static bool test_share()
+{
+    const char *encoding = "{\"a\":{\"b\":[1,2,{\"c\":[]}],"
+                           "\"s\":\"shared string\"},\"d\":[{\"e\":true}]}";
+    json_thing_t *thing = json_utf8_decode_string(encoding);
+    json_thing_t *copy = json_share(thing);
+    json_thing_t *other = json_share(thing);
+    json_thing_t *c = json_array_get(
+        json_object_get(json_object_get(copy, "a"), "b"), 2);
+    json_add_to_object(c, "new", json_make_null());
+    json_destroy_thing(json_object_pop(json_array_get(
+        json_object_get(other, "d"), 0), "e"));
+    char buffer[100];
+    json_utf8_encode(thing, buffer, sizeof buffer);
+    if (strcmp(buffer, encoding) || !size_is_right(thing)) {
+        fprintf(stderr, "Shared original modified: %s\n", buffer);
+        return false;
+    }
+    json_utf8_encode(copy, buffer, sizeof buffer);
+    if (strcmp(buffer, "{\"a\":{\"b\":[1,2,{\"c\":[],\"new\":null}],"
+                       "\"s\":\"shared string\"},\"d\":[{\"e\":true}]}") ||
+        !size_is_right(copy)) {
+        fprintf(stderr, "Bad modified share: %s\n", buffer);
+        return false;
+    }
+    json_destroy_thing(thing);
+    json_utf8_encode(other, buffer, sizeof buffer);
+    if (strcmp(buffer, "{\"a\":{\"b\":[1,2,{\"c\":[]}],"
+                       "\"s\":\"shared string\"},\"d\":[{}]}") ||
+        !size_is_right(other)) {
+        fprintf(stderr, "Bad share of a destroyed original: %s\n", buffer);
+        return false;
+    }
+    json_field_t *field;
+    for (field = json_object_first(copy); field; field = json_field_next(field))
+        if (json_thing_type(json_field_value(field)) == JSON_ARRAY)
+            json_add_to_array(json_field_value(field), json_make_integer(0));
+    json_utf8_encode(copy, buffer, sizeof buffer);
+    if (strcmp(buffer, "{\"a\":{\"b\":[1,2,{\"c\":[],\"new\":null}],"
+                       "\"s\":\"shared string\"},\"d\":[{\"e\":true},0]}")) {
+        fprintf(stderr, "Bad iteration over a share: %s\n", buffer);
+        return false;
+    }
+    json_destroy_thing(copy);
+    json_thing_t *clone = json_share(other);
+    json_destroy_thing(other);
+    json_utf8_encode(clone, buffer, sizeof buffer);
+    if (strcmp(buffer, "{\"a\":{\"b\":[1,2,{\"c\":[]}],"
+                       "\"s\":\"shared string\"},\"d\":[{}]}")) {
+        fprintf(stderr, "Bad share of a share: %s\n", buffer);
+        return false;
+    }
+    json_destroy_thing(clone);
+    thing = json_utf8_decode_lazy(encoding, strlen(encoding));
+    copy = json_share(thing);
+    json_add_to_array(json_object_get(json_object_get(copy, "a"), "b"),
+                      json_make_integer(3));
+    json_utf8_encode(thing, buffer, sizeof buffer);
+    if (strcmp(buffer, encoding) || !size_is_right(thing) ||
+        !size_is_right(copy)) {
+        fprintf(stderr, "Bad share of a lazy decoding: %s\n", buffer);
+        return false;
+    }
+    json_destroy_thing(thing);
+    json_destroy_thing(copy);
+    /* the last holder of an original that has been copied */
+    thing = json_utf8_decode_string(encoding);
+    copy = json_share(thing);
+    other = json_share(thing);
+    json_object_get(copy, "a");
+    json_destroy_thing(thing);
+    json_add_to_array(json_object_get(json_object_get(other, "a"), "b"),
+                      json_make_integer(3));
+    json_utf8_encode(copy, buffer, sizeof buffer);
+    if (strcmp(buffer, encoding) || !size_is_right(copy) ||
+        !size_is_right(other)) {
+        fprintf(stderr, "Bad share after the original is gone: %s\n",
+                buffer);
+        return false;
+    }
+    json_destroy_thing(copy);
+    json_destroy_thing(other);
+    thing = json_utf8_decode_string(encoding);
+    enum { NUM_THREADS = 4 };
+    pthread_t threads[NUM_THREADS];
+    share_job_t jobs[NUM_THREADS];
+    int i;
+    for (i = 0; i < NUM_THREADS; i++) {
+        jobs[i] = (share_job_t) { json_share(thing), i, false };
+        pthread_create(&threads[i], NULL, share_worker, &jobs[i]);
+    }
+    json_destroy_thing(thing);
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok) {
+            fprintf(stderr, "Bad share in thread %d\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool test_hash()
+{
+    const char *encoding =
+        "{\"x\":1,\"y\":[1,2.0,{\"z\":null}],\"s\":\"str\"}";
+    json_thing_t *a = json_utf8_decode_string(encoding);
+    json_thing_t *b = json_utf8_decode_string(
+        "{\"s\":\"str\",\"y\":[1.0,2,{\"z\":null}],\"x\":1e0}");
+    json_thing_t *c = json_utf8_decode_string(
+        "{\"x\":1,\"y\":[1,2.0,{\"z\":false}],\"s\":\"str\"}");
+    json_thing_t *d = json_utf8_decode_string(
+        "{\"x\":1,\"y\":[2.0,1,{\"z\":null}],\"s\":\"str\"}");
+    uint64_t hash = json_thing_hash(a);
+    if (!hash || json_thing_hash(a) != hash || json_thing_hash(b) != hash ||
+        !json_thing_equal(a, b, 0)) {
+        fprintf(stderr, "Bad hash of equal things\n");
+        return false;
+    }
+    if (json_thing_hash(c) == hash || json_thing_hash(d) == hash ||
+        json_thing_equal(a, c, 0) || json_thing_equal(a, d, 0)) {
+        fprintf(stderr, "Bad hash of unequal things\n");
+        return false;
+    }
+    json_thing_t *inner = json_array_get(json_object_get(c, "y"), 2);
+    json_destroy_thing(json_object_pop(inner, "z"));
+    json_add_to_object(inner, "z", json_make_null());
+    if (json_thing_hash(c) != hash || !json_thing_equal(a, c, 0)) {
+        fprintf(stderr, "Hash not updated after modification\n");
+        return false;
+    }
+    size_t size;
+    void *block = json_freeze(a, &size);
+    json_thing_t *lazy = json_utf8_decode_lazy(encoding, strlen(encoding));
+    if (json_thing_hash(json_frozen_root(block, size)) != hash ||
+        json_thing_hash(lazy) != hash) {
+        fprintf(stderr, "Bad hash of a frozen or lazy decoding\n");
+        return false;
+    }
+    fsfree(block);
+    json_destroy_thing(lazy);
+    json_thing_t *big = json_make_object();
+    json_thing_t *reversed = json_make_object();
+    int i;
+    for (i = 0; i < 100; i++) {
+        char name[20];
+        sprintf(name, "field-%d", i);
+        json_add_to_object(big, name, json_make_integer(i));
+        sprintf(name, "field-%d", 99 - i);
+        json_add_to_object(reversed, name, json_make_unsigned(99 - i));
+    }
+    if (!json_thing_equal(big, reversed, 0) ||
+        json_thing_hash(big) != json_thing_hash(reversed)) {
+        fprintf(stderr, "Bad comparison of big objects\n");
+        return false;
+    }
+    json_add_to_object(reversed, "extra", json_make_null());
+    json_add_to_object(big, "extra", json_make_boolean(false));
+    if (json_thing_equal(big, reversed, 0) ||
+        json_thing_hash(big) == json_thing_hash(reversed)) {
+        fprintf(stderr, "Bad comparison of unequal big objects\n");
+        return false;
+    }
+    json_destroy_thing(big);
+    json_destroy_thing(reversed);
+    json_destroy_thing(a);
+    json_destroy_thing(b);
+    json_destroy_thing(c);
+    json_destroy_thing(d);
+    return true;
+}
+
+static bool test_typed_arrays()
+{
+    const char *encoding = "{\"v\":[ 1, -2 ,3.5,18446744073709551615],"
+                           "\"w\":[[0.25,\"x\"],[],[7]]}";
+    static const unsigned flag_sets[] = {
+        JSON_DECODE_PACK_NUMBERS,
+        JSON_DECODE_PACK_NUMBERS | JSON_DECODE_STRUCTURAL_INDEX,
+    };
+    json_thing_t *eager = json_utf8_decode_string(encoding);
+    char *expected = json_utf8_encode_alloc(eager, NULL);
+    size_t k;
+    for (k = 0; k < sizeof flag_sets / sizeof flag_sets[0]; k++) {
+        json_thing_t *thing =
+            json_utf8_decode_ex(encoding, strlen(encoding), flag_sets[k]);
+        json_thing_t *v = json_object_get(thing, "v");
+        double doubles[5];
+        int64_t integers[4];
+        uint64_t unsigneds[4];
+        if (json_array_size(v) != 4 ||
+            json_array_to_doubles(v, doubles, 5) != 4 || doubles[0] != 1 ||
+            doubles[1] != -2 || doubles[2] != 3.5 ||
+            doubles[3] != 18446744073709551615.0 ||
+            json_array_to_int64s(v, integers, 4) != 2 || integers[0] != 1 ||
+            integers[1] != -2 || json_array_to_uint64s(v, unsigneds, 4) != 1 ||
+            unsigneds[0] != 1 || json_array_to_doubles(v, doubles, 1) != 1) {
+            fprintf(stderr, "Bad bulk cast of a packed array\n");
+            return false;
+        }
+        json_thing_t *w = json_object_get(thing, "w");
+        if (json_array_to_doubles(json_array_get(w, 0), doubles, 2) != 1 ||
+            doubles[0] != 0.25 || json_array_to_doubles(w, doubles, 2)) {
+            fprintf(stderr, "Bad bulk cast of an array\n");
+            return false;
+        }
+        char *result = json_utf8_encode_alloc(thing, NULL);
+        if (strcmp(result, expected) ||
+            json_thing_hash(thing) != json_thing_hash(eager)) {
+            fprintf(stderr, "Bad encoding or hash of packed arrays\n");
+            return false;
+        }
+        fsfree(result);
+        json_thing_t *clone = json_clone(thing);
+        json_thing_t *share = json_share(thing);
+        json_thing_t *element = json_array_get(v, 1);
+        if (!element || json_thing_type(element) != JSON_INTEGER ||
+            json_integer_value(element) != -2 ||
+            !json_thing_equal(thing, eager, 0) ||
+            !json_thing_equal(clone, eager, 0) ||
+            !json_thing_equal(share, eager, 0)) {
+            fprintf(stderr, "Bad access to a packed array\n");
+            return false;
+        }
+        result = json_utf8_encode_alloc(share, NULL);
+        if (strcmp(result, expected)) {
+            fprintf(stderr, "Bad encoding of a shared packed array\n");
+            return false;
+        }
+        fsfree(result);
+        json_destroy_thing(clone);
+        json_destroy_thing(share);
+        json_destroy_thing(thing);
+        if (json_utf8_decode_ex("[1,2", 4, flag_sets[k]) ||
+            json_utf8_decode_ex("[1 2]", 5, flag_sets[k]) ||
+            json_utf8_decode_ex("[1,]", 4, flag_sets[k])) {
+            fprintf(stderr, "Bad packed array accepted\n");
+            return false;
+        }
+        unsigned old_limit = json_set_max_depth(1);
+        json_thing_t *shallow = json_utf8_decode_ex("[1, 2]", 6, flag_sets[k]);
+        json_set_max_depth(old_limit);
+        if (shallow) {
+            fprintf(stderr, "Depth limit ignored by a packed array\n");
+            return false;
+        }
+    }
+    fsfree(expected);
+    json_destroy_thing(eager);
+    return true;
+}
+
+static bool test_decoder()
+{
+    json_thing_t *document = json_make_object();
+    json_add_to_object(document, "id", json_make_integer(7));
+    json_add_to_object(document, "a rather long field name",
+                       json_make_string("a string too long to be inline"));
+    json_thing_t *numbers = json_make_array();
+    int i;
+    for (i = 0; i < 2000; i++)
+        json_add_to_array(numbers, json_make_integer(i));
+    json_add_to_object(document, "numbers", numbers);
+    char long_string[300];
+    memset(long_string, 'x', sizeof long_string - 1);
+    long_string[sizeof long_string - 1] = '\0';
+    json_add_to_object(document, long_string, json_make_string(long_string));
+    char *encoding = json_utf8_encode_alloc(document, NULL);
+    json_decoder_t *decoder = json_make_decoder();
+    for (i = 0; i < 6; i++) {
+        unsigned flags = i & 1 ? JSON_DECODE_STRUCTURAL_INDEX : 0;
+        json_thing_t *thing = json_decoder_decode(decoder, encoding,
+                                                  strlen(encoding), flags);
+        if (!thing || !json_thing_equal(thing, document, 0)) {
+            fprintf(stderr, "Bad decoding with a decoder context\n");
+            return false;
+        }
+        char *result = json_utf8_encode_alloc(thing, NULL);
+        if (strcmp(result, encoding)) {
+            fprintf(stderr, "Bad encoding of a pooled decoding\n");
+            return false;
+        }
+        fsfree(result);
+        if (i < 4)
+            json_decoder_release(decoder, thing);
+        else
+            json_destroy_thing(thing);
+        if (json_decoder_decode(decoder, encoding, strlen(encoding) - 1,
+                                flags)) {
+            fprintf(stderr, "Bad decoding accepted with a decoder context\n");
+            return false;
+        }
+    }
+    char *adopted = fsalloc(20);
+    memset(adopted, 'y', 20);
+    json_add_to_object(document, "adopted",
+                       json_adopt_bounded_string(adopted, 20));
+    json_decoder_release(decoder, document);
+    json_thing_t *thing =
+        json_decoder_decode(decoder, encoding, strlen(encoding), 0);
+    json_decoder_release(decoder, thing);
+    json_destroy_decoder(decoder);
+    fsfree(encoding);
+    return true;
+}
+
+static bool test_stats()
+{
+    json_stats_t before, after;
+    bool enabled = json_stats_get(&before);
+    const char *encoding = "{\"a\":[1,[2,[3]]],\"b\":\"xyz\"}";
+    json_thing_t *thing = json_utf8_decode(encoding, strlen(encoding));
+    char buffer[100];
+    size_t size = json_utf8_encode(thing, buffer, sizeof buffer);
+    json_destroy_thing(thing);
+    if (json_stats_get(&after) != enabled) {
+        fprintf(stderr, "json_stats_get() changed its mind\n");
+        return false;
+    }
+    if (!enabled) {
+        static const json_stats_t zero;
+        if (memcmp(&before, &zero, sizeof zero) ||
+            memcmp(&after, &zero, sizeof zero)) {
+            fprintf(stderr, "Disabled statistics are not zero\n");
+            return false;
+        }
+        return true;
+    }
+    if (after.decode_calls != before.decode_calls + 1 ||
+        after.decoded_bytes != before.decoded_bytes + strlen(encoding) ||
+        after.encode_calls != before.encode_calls + 1 ||
+        after.encoded_bytes != before.encoded_bytes + size ||
+        after.nodes[JSON_ARRAY] != before.nodes[JSON_ARRAY] + 3 ||
+        after.nodes[JSON_OBJECT] != before.nodes[JSON_OBJECT] + 1 ||
+        after.node_bytes[JSON_ARRAY] <= before.node_bytes[JSON_ARRAY] ||
+        after.max_depth < 4) {
+        fprintf(stderr, "Unexpected statistics\n");
+        return false;
+    }
+    const char *trace = json_trace_stats(&after);
+    json_thing_t *traced = json_utf8_decode(trace, strlen(trace));
+    unsigned long long decode_calls;
+    if (!json_object_get_unsigned(traced, "decode_calls", &decode_calls) ||
+        decode_calls != after.decode_calls) {
+        fprintf(stderr, "Bad json_trace_stats(): %s\n", trace);
+        return false;
+    }
+    json_destroy_thing(traced);
+    /* the push parser, the scanner and the binary codec count too */
+    json_stats_get(&before);
+    json_parser_t *parser = json_make_parser();
+    json_parser_feed(parser, encoding, 5);
+    json_parser_feed(parser, encoding + 5, strlen(encoding) - 5);
+    thing = json_parser_finish(parser);
+    json_destroy_parser(parser);
+    static const json_callbacks_t none = { NULL };
+    json_utf8_scan(encoding, strlen(encoding), &none, NULL);
+    char *binary = json_binary_encode(thing, &size);
+    json_destroy_thing(thing);
+    json_destroy_thing(json_binary_decode(binary, size, 0));
+    fsfree(binary);
+    json_stats_get(&after);
+    if (after.decode_calls != before.decode_calls + 3 ||
+        after.decoded_bytes !=
+            before.decoded_bytes + 2 * strlen(encoding) + size ||
+        after.encode_calls != before.encode_calls + 1 ||
+        after.encoded_bytes != before.encoded_bytes + size) {
+        fprintf(stderr, "Unexpected statistics of other codecs\n");
+        return false;
+    }
+    /* a parallel encoding counts once */
+    thing = json_make_array();
+    int i;
+    for (i = 0; i < 1000; i++)
+        json_add_to_array(thing, json_make_integer(i));
+    test_sink_t sink_data = {
+        .buffer = NULL,
+        .size = 0,
+        .writes_left = -1,
+    };
+    json_sink_t sink = { &sink_data, test_sink_write };
+    json_stats_get(&before);
+    json_utf8_encode_parallel(thing, 4, &sink);
+    json_stats_get(&after);
+    json_destroy_thing(thing);
+    free(sink_data.buffer);
+    if (after.encode_calls != before.encode_calls + 1 ||
+        after.encoded_bytes != before.encoded_bytes + sink_data.size) {
+        fprintf(stderr, "Unexpected statistics of a parallel encoding\n");
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    if (!test_simple())
+        return EXIT_FAILURE;
+    if (!test_simple2())
+        return EXIT_FAILURE;
+    if (!test_integers())
+        return EXIT_FAILURE;
+    if (!test_signed())
+        return EXIT_FAILURE;
+    if (!test_unsigned())
+        return EXIT_FAILURE;
+    if (!test_float())
+        return EXIT_FAILURE;
+    if (!test_big_array())
+        return EXIT_FAILURE;
+    if (!test_big_object())
+        return EXIT_FAILURE;
+    if (!test_long_strings())
+        return EXIT_FAILURE;
+    if (!test_iteration())
+        return EXIT_FAILURE;
+    if (!test_nested_object())
+        return EXIT_FAILURE;
+    if (!test_arena())
+        return EXIT_FAILURE;
+    if (!test_structural_index())
+        return EXIT_FAILURE;
+    if (!test_zero_copy())
+        return EXIT_FAILURE;
+    if (!test_parser())
+        return EXIT_FAILURE;
+    if (!test_scan())
+        return EXIT_FAILURE;
+    if (!test_ndjson())
+        return EXIT_FAILURE;
+    if (!test_decode_path())
+        return EXIT_FAILURE;
+    if (!test_sink())
+        return EXIT_FAILURE;
+    if (!test_string_escaping())
+        return EXIT_FAILURE;
+    if (!test_integer_formatting())
+        return EXIT_FAILURE;
+    if (!test_integer_parsing())
+        return EXIT_FAILURE;
+    if (!test_compact_nodes())
+        return EXIT_FAILURE;
+    if (!test_interned_keys())
+        return EXIT_FAILURE;
+    if (!test_path())
+        return EXIT_FAILURE;
+    if (!test_lazy())
+        return EXIT_FAILURE;
+    if (!test_binary())
+        return EXIT_FAILURE;
+    if (!test_freeze())
+        return EXIT_FAILURE;
+    if (!test_trace())
+        return EXIT_FAILURE;
+    if (!test_write())
+        return EXIT_FAILURE;
+    if (!test_deep_nesting())
+        return EXIT_FAILURE;
+    if (!test_parallel_encoding())
+        return EXIT_FAILURE;
+    if (!test_encoded_size_cache())
+        return EXIT_FAILURE;
+    if (!test_share())
+        return EXIT_FAILURE;
+    if (!test_hash())
+        return EXIT_FAILURE;
+    if (!test_typed_arrays())
+        return EXIT_FAILURE;
+    if (!test_decoder())
+        return EXIT_FAILURE;
+    if (!test_stats())
         return EXIT_FAILURE;
     fprintf(stderr, "Ok\n");
     return EXIT_SUCCESS;